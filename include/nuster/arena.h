@@ -0,0 +1,86 @@
+/*
+ * include/nuster/arena.h
+ * This file defines everything related to nuster per stream arena.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NUSTER_ARENA_H
+#define _NUSTER_ARENA_H
+
+#include <nuster/common.h>
+
+
+/*
+ * A bump allocator over the tail of the pool object holding the ctx of a
+ * stream, the txn buffer and the keys are carved from it and everything
+ * is released at once with the ctx.
+ * When the arena is exhausted, or there is no arena, allocations fall back
+ * to malloc and must be released with nst_arena_free.
+ */
+#define NST_ARENA_ALIGN                8
+
+typedef struct nst_arena {
+    char                       *area;
+    uint32_t                    size;
+    uint32_t                    used;
+    uint32_t                    allocs;         /* pool and heap allocations */
+} nst_arena_t;
+
+
+static inline void
+nst_arena_init(nst_arena_t *arena, char *area, uint32_t size) {
+    arena->area   = area;
+    arena->size   = size;
+    arena->used   = 0;
+    arena->allocs = 1;
+}
+
+static inline void *
+nst_arena_alloc(nst_arena_t *arena, uint32_t size) {
+    uint32_t  need = (size + NST_ARENA_ALIGN - 1) & ~(NST_ARENA_ALIGN - 1);
+    char     *p;
+
+    if(arena && need <= arena->size - arena->used) {
+        p = arena->area + arena->used;
+
+        arena->used += need;
+
+        return p;
+    }
+
+    if(arena) {
+        arena->allocs++;
+    }
+
+    return malloc(size);
+}
+
+static inline int
+nst_arena_owns(nst_arena_t *arena, void *p) {
+    return arena && (char *)p >= arena->area && (char *)p < arena->area + arena->size;
+}
+
+static inline void
+nst_arena_free(nst_arena_t *arena, void *p) {
+
+    if(p && !nst_arena_owns(arena, p)) {
+        free(p);
+    }
+}
+
+#endif /* _NUSTER_ARENA_H */
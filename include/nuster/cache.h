@@ -25,6 +25,21 @@
 #include <nuster/common.h>
 
 
+/*
+ * Streams waiting for an entry being created are woken up by the stream
+ * creating it, the timer only retries for the cases it cannot cover:
+ * the creator runs in another process, or the entry is released without
+ * being finished or aborted. In ms.
+ */
+#define NST_CACHE_WAIT_POLL            1000
+#define NST_CACHE_WAIT_POLL_NBPROC     10
+
+/*
+ * A failed refresh of a stale entry is retried after that long, in ms,
+ * the stream retrying gets the response of the backend server.
+ */
+#define NST_CACHE_STALE_RETRY          1000
+
 extern hpx_flt_ops_t  nst_cache_filter_ops;
 extern const char    *nst_cache_flt_id;
 
@@ -41,7 +56,12 @@ unsigned int nst_cache_update(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int
 
 int nst_cache_finish(nst_ctx_t *ctx);
 void nst_cache_abort(nst_ctx_t *ctx);
+void nst_cache_refresh_end(nst_ctx_t *ctx, int failed);
+void nst_cache_revalidate(hpx_http_msg_t *msg, nst_ctx_t *ctx);
+void nst_cache_revalidated(hpx_stream_t *s, nst_ctx_t *ctx);
+int nst_cache_refresh_failed(hpx_stream_t *s, nst_ctx_t *ctx);
 int nst_cache_exists(nst_ctx_t *ctx);
+void nst_cache_wait_leave(nst_waiter_t *waiter);
 int nst_cache_delete(nst_key_t *key);
 void nst_cache_hit(hpx_stream_t *s, hpx_stream_interface_t *si, hpx_channel_t *req,
         hpx_channel_t *res, nst_ctx_t *ctx);
@@ -37,14 +37,17 @@ typedef struct channel                  hpx_channel_t;
 typedef struct flt_ops                  hpx_flt_ops_t;
 typedef struct htx_blk                  hpx_htx_blk_t;
 typedef struct htx_ret                  hpx_htx_ret_t;
+typedef struct pool_head                hpx_pool_head_t;
 typedef struct session                  hpx_session_t;
 typedef struct buffer                   hpx_buffer_t;
 typedef struct stream                   hpx_stream_t;
+typedef struct server                   hpx_server_t;
 typedef struct appctx                   hpx_appctx_t;
 typedef struct applet                   hpx_applet_t;
 typedef struct htx_sl                   hpx_htx_sl_t;
 typedef struct filter                   hpx_filter_t;
 typedef struct sample                   hpx_sample_t;
+typedef struct task                     hpx_task_t;
 typedef struct proxy                    hpx_proxy_t;
 typedef struct list                     hpx_list_t;
 typedef struct ist                      hpx_ist_t;
@@ -76,6 +79,7 @@ typedef struct nst_core  nst_core_t;
 
 #include <common/buf.h>
 #include <types/global.h>
+#include <eb64tree.h>
 
 #define NST_OK                          0
 #define NST_ERR                         1
@@ -90,6 +94,8 @@ typedef struct nst_core  nst_core_t;
 #define NST_DEFAULT_DISK_CLEANER        100
 #define NST_DEFAULT_DISK_LOADER         100
 #define NST_DEFAULT_DISK_SAVER          100
+#define NST_DEFAULT_EVICT_HIGH          95
+#define NST_DEFAULT_EVICT_LOW           85
 #define NST_DEFAULT_KEY                "method.scheme.host.uri"
 #define NST_DEFAULT_CODE               "200"
 
@@ -104,6 +110,16 @@ enum {
     NST_MODE_NOSQL       = 2,
 };
 
+enum {
+    NST_DICT_ENGINE_CHAIN = 0,
+    NST_DICT_ENGINE_SWISS = 1,
+};
+
+enum {
+    NST_DICT_EVICT_OFF    = 0,
+    NST_DICT_EVICT_CLOCK  = 1,
+};
+
 enum {
     NST_RULE_DISABLED    = 0,
     NST_RULE_ENABLED     = 1,
@@ -157,11 +173,25 @@ typedef struct nst_key_element {
     char                      *data;
 } nst_key_element_t;
 
+/*
+ * The keys of a proxy are compiled into a prefix tree of elements,
+ * keys starting with the same elements share the nodes of that prefix.
+ */
+typedef struct nst_key_node {
+    struct nst_key_node       *next;           /* all nodes of the proxy */
+    struct nst_key_node       *parent;         /* NULL for the first element */
+
+    nst_key_element_t         *element;
+    int                        idx;            /* node index in the proxy */
+    int                        eidx;           /* distinct element index in the proxy */
+} nst_key_node_t;
+
 typedef struct nst_rule_key {
     struct nst_rule_key       *next;
 
     char                      *name;
     nst_key_element_t        **data;           /* parsed key */
+    nst_key_node_t            *node;           /* node of the last element */
     int                        idx;
 } nst_rule_key_t;
 
@@ -183,6 +213,15 @@ typedef struct nst_rule_config {
     int                        etag;          /* etag on|off */
     int                        last_modified; /* last_modified on|off */
     int                        wait;          /* -1: not wait, 0: wait forever, > 0, wait seconds */
+    int                        admit;         /* 0: always admit, > 0: admit on the nth request */
+    int                        early;         /* early-refresh on|off */
+    int                        jitter;        /* percentage of ttl randomly removed */
+
+    /* seconds an expired entry is still served, while it is refreshed or on errors */
+    struct {
+        uint32_t               revalidate;    /* stale-while-revalidate */
+        uint32_t               error;         /* stale-if-error */
+    } stale;
 
     /*
      * auto ttl extend
@@ -224,6 +263,15 @@ typedef struct nst_rule {
     int                        last_modified; /* last_modified on|off */
     uint8_t                    extend[4];
     int                        wait;
+    int                        admit;
+    int                        early;
+    int                        jitter;
+
+    struct {
+        uint32_t               revalidate;
+        uint32_t               error;
+    } stale;
+
     hpx_acl_cond_t            *cond;          /* acl condition to meet */
 } nst_rule_t;
 
@@ -232,6 +280,15 @@ typedef struct nst_flt_conf {
     int                       pid;
 } nst_flt_conf_t;
 
+/*
+ * A task parked on a key hash until the entry being created changes
+ */
+typedef struct nst_waiter {
+    struct eb64_node           node;
+    hpx_task_t                *task;
+    int                        parked;
+} nst_waiter_t;
+
 
 /* get current timestamp in milliseconds */
 static inline uint64_t
@@ -23,10 +23,12 @@
 #define _NUSTER_CORE_H
 
 #include <nuster/common.h>
+#include <nuster/arena.h>
 #include <nuster/store.h>
 #include <nuster/http.h>
 #include <nuster/key.h>
 #include <nuster/dict.h>
+#include <nuster/sketch.h>
 
 
 enum {
@@ -45,18 +47,30 @@ enum {
     NST_CTX_STATE_CHECK_DISK,        /* check disk */
 };
 
+/*
+ * The ctx of a stream, its keys, the txn buffer, the key cache and
+ * NST_CTX_KEYS_SIZE() bytes for key data are allocated as one object
+ * from nuster.pool.ctx.
+ */
+#define NST_CTX_KEYS_SIZE()            (global.tune.bufsize / 4)
+
 typedef struct nst_proxy {
     nst_rule_t                  *rule;
     nst_rule_key_t              *key;
+    nst_key_node_t              *node;
 
     int                         rule_cnt;
     int                         key_cnt;
+    int                         node_cnt;
+    int                         element_cnt;
 } nst_proxy_t;
 
 typedef struct nst_ctx {
     int                         state;
 
     nst_dict_entry_t           *entry;
+    nst_key_t                  *refresh;          /* key of the stale entry refreshed */
+    int                         revalidate;       /* validators sent with the refresh */
 
     nst_http_txn_t              txn;
 
@@ -67,7 +81,7 @@ typedef struct nst_ctx {
     struct {
         struct {
             nst_ring_data_t    *data;
-            nst_ring_item_t    *item;
+            nst_ring_extent_t  *tail;
         } ring;
         nst_disk_data_t         disk;
     } store;
@@ -76,18 +90,69 @@ typedef struct nst_ctx {
     int                         key_cnt;
     hpx_buffer_t               *key;
     nst_rule_t                 *rule;
+
+    nst_arena_t                 arena;
+    nst_key_cache_t             key_cache;
+
+    /* parked on the key hash while another stream creates the entry */
+    nst_waiter_t                wait;
+
     nst_key_t                   keys[0];
 } nst_ctx_t;
 
+/*
+ * The proxy and rule names of the rules of the configuration owning the
+ * core, by rule uuid, kept in the memory so that a new configuration can
+ * bind the entries to its own rules, see nst_core_attach.
+ */
+typedef struct nst_core_rule {
+    char                       *proxy;
+    char                       *name;
+} nst_core_rule_t;
+
 struct nst_core {
     nst_memory_t               *memory;
     hpx_ist_t                   root;
 
+    nst_epoch_t                 epoch;          /* lock-free hits */
     nst_dict_t                  dict;
     nst_store_t                 store;
+
+    nst_sketch_t                sketch;         /* cache admission */
+
+    nst_core_rule_t            *rule;
+    int                         rule_cnt;
 };
 
 
 int nst_test_rule(hpx_stream_t *s, nst_rule_t *rule, int res);
 
+uint64_t nst_core_layout(int engine, uint64_t dict_size, uint64_t data_size, hpx_ist_t root);
+int nst_core_bind(nst_core_t *core, int mode);
+int nst_core_attach(nst_core_t *core, int mode, hpx_ist_t root);
+
+nst_ctx_t *nst_ctx_alloc(int pid);
+void nst_ctx_free(nst_ctx_t *ctx);
+
+/*
+ * Free what lock-free readers can no longer hold. The epoch is advanced
+ * twice so that what has been retired by this housekeeping is freed
+ * right away unless a reader is in a read section.
+ * Only called by master housekeeping.
+ */
+static inline void
+nst_core_reclaim(nst_core_t *core) {
+    int  i;
+
+    for(i = 0; i < NST_EPOCH_LISTS - 1; i++) {
+
+        if(nst_epoch_advance(&core->epoch) != NST_OK) {
+            break;
+        }
+
+        nst_dict_reclaim(&core->dict);
+        nst_ring_reclaim(&core->store.ring);
+    }
+}
+
 #endif /* _NUSTER_CORE_H */
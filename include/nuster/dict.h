@@ -22,10 +22,59 @@
 #ifndef _NUSTER_DICT_H
 #define _NUSTER_DICT_H
 
+#include <eb64tree.h>
+
 #include <nuster/common.h>
+#include <nuster/epoch.h>
 #include <nuster/http.h>
 #include <nuster/key.h>
+#include <nuster/shctx.h>
+
+
+/*
+ * The dict is protected by NST_DICT_STRIPES locks instead of a single one,
+ * bucket idx is protected by stripe[idx % NST_DICT_STRIPES].
+ * dict->size is always a multiple of NST_DICT_STRIPES, so the stripe can be
+ * computed from either the key hash or the bucket index.
+ * Memory hits are looked up without lock by nst_dict_get_hit, anything it
+ * cannot serve falls back to nst_dict_get under the lock.
+ */
+#define NST_DICT_STRIPES               64
+#define NST_DICT_STRIPE_ALIGN          64
+
+/*
+ * The dict grows when used reaches the capacity of the table,
+ * and shrinks, but not below the initial size, when
+ * used < capacity / NST_DICT_LOAD_FACTOR_SHRINK.
+ * Buckets are moved to the new table NST_DICT_REHASH_BUCKETS at a time
+ * by the master process housekeeping.
+ */
+#define NST_DICT_LOAD_FACTOR_SHRINK    8
+#define NST_DICT_REHASH_BUCKETS        1024
+
+/*
+ * swiss engine: a bucket is a group of NST_DICT_GROUP_SLOTS entries with
+ * one control byte each: empty, deleted, or the top 7 bits of the hash.
+ * The capacity is 3/4 of the slots.
+ * Groups are probed with a stride of NST_DICT_STRIPES groups, so that
+ * all groups probed for a key are protected by the same stripe.
+ */
+#define NST_DICT_GROUP_SLOTS           16
+#define NST_DICT_CTRL_EMPTY            0x80
+#define NST_DICT_CTRL_DELETED          0xFE
+
+/*
+ * CLOCK eviction: a hit increments entry->freq up to NST_DICT_EVICT_FREQ_MAX,
+ * the hand decrements it and evicts entries found at 0, so entries never
+ * read after being stored are the first to go.
+ */
+#define NST_DICT_EVICT_FREQ_MAX        3
 
+enum {
+    NST_DICT_WALK_NEXT     = 0x00,
+    NST_DICT_WALK_REMOVE   = 0x01,      /* unlink the entry, the callback frees it */
+    NST_DICT_WALK_STOP     = 0x02,      /* stop walking the bucket */
+};
 
 enum {
     NST_DICT_ENTRY_STATE_INIT      = 0,
@@ -38,7 +87,7 @@ enum {
  * A nst_dict_entry is an entry in nst_dict hash table
  */
 typedef struct nst_dict_entry {
-    struct nst_dict_entry      *next;
+    struct nst_dict_entry      *next;           /* chain engine only */
 
     int                         state;
 
@@ -51,14 +100,17 @@ typedef struct nst_dict_entry {
     hpx_ist_t                   path;
     hpx_ist_t                   etag;
     hpx_ist_t                   last_modified;
+    int                         validator;      /* see nst_http_res.validator */
 
     int                         pid;            /* proxy uuid */
+    int                         rule_uuid;      /* see nst_core_attach */
     int                         header_len;
     uint64_t                    payload_len;
 
     uint64_t                    expire;
     uint64_t                    ctime;
     uint64_t                    atime;
+    uint32_t                    fetch;          /* ms taken to fetch it, see rule.early */
 
     /* For entries loaded from disk */
     uint32_t                    ttl;
@@ -70,10 +122,26 @@ typedef struct nst_dict_entry {
     /* extended count  */
     int                         extended;
 
+    /* see rule.stale, kept that long after expire to be served stale */
+    struct {
+        uint32_t                revalidate;
+        uint32_t                error;
+        int                     refresh;        /* a stream is refreshing it */
+        uint64_t                failed;         /* ms the last refresh failed, or 0 */
+    } stale;
+
+    /* hits since last seen by the eviction hand */
+    uint8_t                     freq;
+
+    /* node in the expiry tree of the stripe, key is in seconds */
+    struct eb64_node            exp;
+
+    struct nst_dict_entry      *retired;        /* next retired entry */
+
     struct {
         struct {
             nst_ring_data_t    *data;
-            nst_ring_item_t    *item;
+            nst_ring_data_t    *fill;           /* being added, INIT only */
         } ring;
         struct {
             char               *file;
@@ -81,27 +149,102 @@ typedef struct nst_dict_entry {
     } store;
 } nst_dict_entry_t;
 
+typedef struct nst_dict_group {
+    uint8_t                     ctrl[NST_DICT_GROUP_SLOTS];
+    nst_dict_entry_t           *entry[NST_DICT_GROUP_SLOTS];
+} nst_dict_group_t;
+
+/*
+ * Entries are indexed by the second they can be reclaimed in an eb64 tree
+ * per stripe, invalid ones at 0, so that cleanup only pops the entries
+ * that are due instead of sweeping the table.
+ */
+typedef struct nst_dict_stripe {
+#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
+    pthread_mutex_t             mutex;
+#else
+    unsigned int                waiters;
+#endif
+    struct eb_root              exp;            /* expiry tree */
+} __attribute__((aligned(NST_DICT_STRIPE_ALIGN))) nst_dict_stripe_t;
+
 typedef struct nst_dict {
     nst_memory_t               *memory;
+    nst_dict_stripe_t          *stripe;
 
-    nst_dict_entry_t          **entry;
-    uint64_t                    size;           /* number of entries */
+    int                         engine;
+
+    void                       *table;          /* buckets or groups */
+    uint64_t                    size;           /* number of buckets or groups */
     uint64_t                    used;           /* number of used entries */
+    uint64_t                    deleted;        /* number of deleted slots, swiss only */
+    uint64_t                    min_size;       /* initial size */
+    uint64_t                    gen;            /* odd while tables change */
+
+    /* table being migrated to table, table is NULL if not resizing */
+    struct {
+        void                   *table;
+        uint64_t                size;
+        uint64_t                idx;            /* next bucket to migrate */
+    } rehash;
 
-    uint64_t                    cleanup_idx;
+    uint64_t                    cleanup_idx;    /* next stripe to clean up */
 
     uint64_t                    sync_idx;
 
-    nst_store_t                *store;
+    struct {
+        int                     policy;
+        int                     active;         /* evicting until low is reached */
+        uint64_t                high;           /* in bytes */
+        uint64_t                low;
+        uint64_t                idx;            /* clock hand */
+        uint64_t                failed;         /* memory->failed last seen */
+        uint64_t                count;          /* number of evicted entries */
+    } evict;
+
+    /* unlinked, but lock-free readers may still hold them */
+    struct {
+        nst_dict_entry_t       *entry[NST_EPOCH_LISTS];
+        void                   *table;
+        uint64_t                epoch;          /* when table was retired */
+    } retired;
 
-#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
-    pthread_mutex_t             mutex;
-#else
-    unsigned int                waiters;
-#endif
+    nst_epoch_t                *epoch;
+    nst_store_t                *store;
 } nst_dict_t;
 
 
+/*
+ * lock the stripe of a key hash or a bucket index
+ */
+#define nst_dict_lock(dict, n)      nst_shctx_lock(nst_dict_stripe(dict, n))
+#define nst_dict_unlock(dict, n)    nst_shctx_unlock(nst_dict_stripe(dict, n))
+
+static inline nst_dict_stripe_t *
+nst_dict_stripe(nst_dict_t *dict, uint64_t n) {
+    return &dict->stripe[n & (NST_DICT_STRIPES - 1)];
+}
+
+/*
+ * Entries are only created by the processes owning the dict, those of an
+ * old configuration would link rules the new one does not have.
+ */
+static inline int
+nst_dict_owned(nst_dict_t *dict) {
+    return nst_epoch_owned(dict->epoch);
+}
+
+static inline void
+nst_dict_incr_used(nst_dict_t *dict) {
+    __sync_add_and_fetch(&dict->used, 1);
+}
+
+static inline void
+nst_dict_decr_used(nst_dict_t *dict) {
+    __sync_sub_and_fetch(&dict->used, 1);
+}
+
+
 static inline int
 nst_dict_entry_expired(nst_dict_entry_t *entry) {
 
@@ -113,6 +256,32 @@ nst_dict_entry_expired(nst_dict_entry_t *entry) {
 
 }
 
+/*
+ * in seconds, expired entries are kept until then, see nst_cache_exists
+ */
+static inline uint64_t
+nst_dict_entry_stale_end(nst_dict_entry_t *entry) {
+
+    if(entry->stale.revalidate > entry->stale.error) {
+        return entry->expire + entry->stale.revalidate;
+    }
+
+    return entry->expire + entry->stale.error;
+}
+
+/*
+ * whether an expired entry is still kept to be served stale
+ */
+static inline int
+nst_dict_entry_stale(nst_dict_entry_t *entry) {
+
+    if(entry->expire == 0) {
+        return 0;
+    }
+
+    return nst_dict_entry_stale_end(entry) > get_current_timestamp() / 1000;
+}
+
 static inline int
 nst_dict_entry_invalid(nst_dict_entry_t *entry) {
 
@@ -123,7 +292,7 @@ nst_dict_entry_invalid(nst_dict_entry_t *entry) {
 
     /* check expire */
     if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
-        return nst_dict_entry_expired(entry);
+        return nst_dict_entry_expired(entry) && !nst_dict_entry_stale(entry);
     }
 
     return 0;
@@ -139,12 +308,62 @@ nst_dict_entry_valid(nst_dict_entry_t *entry) {
     return 0;
 }
 
-int nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_memory_t *memory, uint64_t dict_size);
-void nst_dict_cleanup(nst_dict_t *dict);
+typedef int (*nst_dict_walk_cb)(nst_dict_t *dict, nst_dict_entry_t *entry, void *data);
+
+static inline int
+nst_dict_rehashing(nst_dict_t *dict) {
+    return dict->rehash.table != NULL;
+}
+
+/*
+ * Walkers iterate over [0, nst_dict_walk_size()), the old table first
+ * while resizing, so that entries moved by the migration are not missed.
+ * The walk must restart when dict->gen changes.
+ */
+static inline uint64_t
+nst_dict_walk_size(nst_dict_t *dict) {
+    return dict->rehash.size + dict->size;
+}
+
+static inline uint64_t
+nst_dict_slots(nst_dict_t *dict) {
+
+    if(dict->engine == NST_DICT_ENGINE_SWISS) {
+        return dict->size * NST_DICT_GROUP_SLOTS;
+    }
+
+    return dict->size;
+}
+
+int nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_memory_t *memory, uint64_t dict_size,
+        int engine, nst_epoch_t *epoch);
+int nst_dict_lock_init(nst_dict_t *dict);
+int nst_dict_cleanup(nst_dict_t *dict);
+void nst_dict_schedule(nst_dict_t *dict, nst_dict_entry_t *entry);
+void nst_dict_rehash(nst_dict_t *dict);
+void nst_dict_reclaim(nst_dict_t *dict);
+void nst_dict_evict_init(nst_dict_t *dict, int policy, int high, int low);
+
+/*
+ * whether the memory zone is full enough that new entries will
+ * take the place of others
+ */
+static inline int
+nst_dict_pressure(nst_dict_t *dict) {
+    return dict->evict.active || dict->memory->used >= dict->evict.low;
+}
+
+int nst_dict_evict(nst_dict_t *dict);
+int nst_dict_walk(nst_dict_t *dict, uint64_t idx, nst_dict_walk_cb cb, void *data);
 
 nst_dict_entry_t *nst_dict_get(nst_dict_t *dict, nst_key_t *key);
+nst_dict_entry_t *nst_dict_get_hit(nst_dict_t *dict, nst_key_t *key, nst_ring_data_t **data);
 nst_dict_entry_t *nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn,
         nst_rule_t *rule, int pid);
+nst_dict_entry_t *nst_dict_prepare(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn,
+        nst_rule_t *rule, int pid);
+int nst_dict_replace(nst_dict_t *dict, nst_dict_entry_t *entry);
+void nst_dict_discard(nst_dict_t *dict, nst_dict_entry_t *entry);
 
 int nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, hpx_ist_t host, hpx_ist_t path,
         nst_key_t *key, char *file, char *meta);
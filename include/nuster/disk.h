@@ -44,7 +44,8 @@
    8 * 9               8                       last-modified length
    8 * 10              8                       ttl: 4, extend: 4
    8 * 11              20                      uuid
-   8 * 11 + 20         20                      reserved
+   8 * 11 + 20         8                       stale: revalidate: 4, error: 4
+   8 * 11 + 28         12                      reserved
    8 * 16              key_len                 key
    + key_len           host_len                host
    + host_len          path_len                path
@@ -66,6 +67,7 @@
 #define NST_DISK_META_POS_LAST_MODIFIED_LEN  8 * 9
 #define NST_DISK_META_POS_TTL_EXTEND         8 * 10
 #define NST_DISK_META_POS_UUID               8 * 11
+#define NST_DISK_META_POS_STALE              8 * 11 + 20
 
 #define NST_DISK_META_SIZE                   8 * 16
 #define NST_DISK_POS_KEY                     NST_DISK_META_SIZE
@@ -153,15 +155,18 @@ nst_disk_meta_get_expire(char *p) {
     return *(uint64_t *)(p + NST_DISK_META_POS_EXPIRE);
 }
 
+/*
+ * stale: seconds the data can still be served after expire
+ */
 static inline int
-nst_disk_meta_check_expire(char *p) {
+nst_disk_meta_check_expire(char *p, uint32_t stale) {
     uint64_t expire = *(uint64_t *)(p + NST_DISK_META_POS_EXPIRE);
 
     if(expire == 0) {
         return NST_OK;
     }
 
-    if(expire * 1000 > get_current_timestamp()) {
+    if((expire + stale) * 1000 > get_current_timestamp()) {
         return NST_OK;
     } else {
         return NST_ERR;
@@ -258,6 +263,33 @@ nst_disk_meta_get_uuid(char *p) {
     return (char *)(p + NST_DISK_META_POS_UUID);
 }
 
+static inline void
+nst_disk_meta_set_stale(char *p, uint32_t revalidate, uint32_t error) {
+    *(uint32_t *)(p + NST_DISK_META_POS_STALE)     = revalidate;
+    *(uint32_t *)(p + NST_DISK_META_POS_STALE + 4) = error;
+}
+
+static inline uint32_t
+nst_disk_meta_get_stale_revalidate(char *p) {
+    return *(uint32_t *)(p + NST_DISK_META_POS_STALE);
+}
+
+static inline uint32_t
+nst_disk_meta_get_stale_error(char *p) {
+    return *(uint32_t *)(p + NST_DISK_META_POS_STALE + 4);
+}
+
+/*
+ * seconds the file is kept after expire, see nst_dict_entry_stale_end
+ */
+static inline uint32_t
+nst_disk_meta_get_stale(char *p) {
+    uint32_t  revalidate = nst_disk_meta_get_stale_revalidate(p);
+    uint32_t  error      = nst_disk_meta_get_stale_error(p);
+
+    return revalidate > error ? revalidate : error;
+}
+
 static inline int
 nst_disk_get_header_pos(char *p) {
     return (int)(NST_DISK_META_SIZE
@@ -287,6 +319,7 @@ nst_disk_meta_init(char *p, uint64_t hash, uint64_t expire, uint64_t header_len,
     nst_disk_meta_set_etag_len(p, etag_len);
     nst_disk_meta_set_last_modified_len(p, last_modified_len);
     nst_disk_meta_set_ttl_extend(p, ttl_extend);
+    nst_disk_meta_set_stale(p, 0, 0);
 }
 
 int nst_disk_data_exists(nst_disk_t *disk, nst_disk_data_t *data, nst_key_t *key);
@@ -374,7 +407,7 @@ void nst_disk_cleanup(nst_core_t *core);
 
 DIR *nst_disk_opendir_by_idx(hpx_ist_t root, char *path, int idx);
 nst_dirent_t *nst_disk_dir_next(DIR *dir);
-int nst_disk_data_valid(nst_disk_data_t *disk, nst_key_t *key);
+int nst_disk_data_valid(nst_disk_data_t *disk, nst_key_t *key, uint32_t stale);
 int nst_disk_purge_by_key(hpx_ist_t root, nst_disk_data_t *disk, nst_key_t *key);
 int nst_disk_purge_by_path(char *path);
 void nst_disk_update_expire(char *file, uint64_t expire);
@@ -0,0 +1,121 @@
+/*
+ * include/nuster/epoch.h
+ * This file defines everything related to nuster epoch based reclamation.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NUSTER_EPOCH_H
+#define _NUSTER_EPOCH_H
+
+#include <common/hathreads.h>
+
+#include <nuster/common.h>
+
+
+/*
+ * Readers which look entries up without the dict lock publish the global
+ * epoch in the slot of their process and thread while they hold pointers
+ * to shared objects.
+ * The master unlinks objects and retires them to the list of the current
+ * epoch, the global epoch only advances when every reader has seen it,
+ * so objects retired at epoch e are freed once the global epoch reaches
+ * e + 2, one list out of NST_EPOCH_LISTS is freed each time.
+ *
+ * The processes of one configuration, identified by nst_epoch_self, own
+ * the epoch and use one half of the slots. When a new configuration
+ * attaches a memory kept in a file, it takes the other half, and the
+ * workers of the old one stop reading without lock, see nst_epoch_own,
+ * while the master still waits for those in a read section.
+ */
+#define NST_EPOCH_LISTS                3
+#define NST_EPOCH_SLOT_ALIGN           64
+
+typedef struct nst_epoch_slot {
+    uint64_t                    epoch;          /* 0 outside of read sections */
+} __attribute__((aligned(NST_EPOCH_SLOT_ALIGN))) nst_epoch_slot_t;
+
+typedef struct nst_epoch {
+    uint64_t                    global;
+    uint64_t                    owner;          /* nst_epoch_self of the owner */
+    int                         half;           /* slots of the owner */
+    int                         size;           /* slots per half, nbproc * MAX_THREADS */
+    nst_epoch_slot_t           *slot;
+} nst_epoch_t;
+
+extern uint64_t  nst_epoch_self;
+
+
+int nst_epoch_init(nst_epoch_t *epoch, nst_memory_t *memory, int size);
+int nst_epoch_advance(nst_epoch_t *epoch);
+void nst_epoch_own(nst_epoch_t *epoch, int orphaned);
+
+static inline int
+nst_epoch_owned(nst_epoch_t *epoch) {
+    return *(volatile uint64_t *)&epoch->owner == nst_epoch_self;
+}
+
+/*
+ * return NULL if the calling thread has no slot,
+ * the caller should use the locked path then.
+ */
+static inline nst_epoch_slot_t *
+nst_epoch_enter(nst_epoch_t *epoch) {
+    nst_epoch_slot_t  *slot;
+    int                half = *(volatile int *)&epoch->half;
+    int                n    = (relative_pid - 1) * MAX_THREADS + tid;
+
+    /* the half is read before the owner, see nst_epoch_own */
+    __sync_synchronize();
+
+    if(!nst_epoch_owned(epoch) || n < 0 || n >= epoch->size) {
+        return NULL;
+    }
+
+    slot        = &epoch->slot[half * epoch->size + n];
+    slot->epoch = epoch->global;
+
+    /* publish the slot before reading any shared pointer */
+    __sync_synchronize();
+
+    return slot;
+}
+
+static inline void
+nst_epoch_leave(nst_epoch_slot_t *slot) {
+    __sync_synchronize();
+
+    slot->epoch = 0;
+}
+
+/*
+ * the list objects retired now go to
+ */
+static inline int
+nst_epoch_retire_list(nst_epoch_t *epoch) {
+    return epoch->global % NST_EPOCH_LISTS;
+}
+
+/*
+ * the list whose objects can be freed, retired two epochs ago
+ */
+static inline int
+nst_epoch_reclaim_list(nst_epoch_t *epoch) {
+    return (epoch->global + 1) % NST_EPOCH_LISTS;
+}
+
+#endif /* _NUSTER_EPOCH_H */
@@ -41,6 +41,12 @@ enum {
     NST_HTTP_SIZE
 };
 
+/* validators sent by the server, see nst_cache_revalidate */
+enum {
+    NST_HTTP_VALIDATOR_ETAG           = 0x01,
+    NST_HTTP_VALIDATOR_LAST_MODIFIED  = 0x02,
+};
+
 typedef struct nst_http_code {
     int                 status;
     hpx_ist_t           code;
@@ -64,6 +70,7 @@ typedef struct nst_http_res {
     uint64_t            payload_len;
     hpx_ist_t           etag;
     hpx_ist_t           last_modified;
+    int                 validator;      /* NST_HTTP_VALIDATOR_* */
 } nst_http_res_t;
 
 typedef struct nst_http_txn {
@@ -96,6 +103,7 @@ int nst_http_ring_item_to_htx(nst_ring_item_t *item, hpx_htx_t *htx);
 void nst_http_reply(hpx_stream_t *s, int idx);
 int nst_http_reply_100(hpx_stream_t *s);
 void nst_http_reply_304(hpx_stream_t *s, hpx_ist_t last_modified, hpx_ist_t etag);
+void nst_http_drop_response(hpx_stream_t *s);
 
 int nst_http_handle_expect(hpx_stream_t *s, hpx_htx_t *htx, hpx_http_msg_t *msg);
 int nst_http_handle_conditional_req(hpx_stream_t *s, hpx_htx_t *htx,
@@ -25,6 +25,7 @@
 #include <import/xxhash.h>
 
 #include <nuster/common.h>
+#include <nuster/arena.h>
 
 
 #define NST_KEY_UUID_LEN        20
@@ -32,8 +33,14 @@
 enum {
     NST_KEY_MEMORY_CHECKED = 0x0001,
     NST_KEY_DISK_CHECKED   = 0x0002,
+    NST_KEY_UUID_SET       = 0x0004,      /* uuid has been computed */
 };
 
+/*
+ * hash identifies the key in the dict, along with size and data.
+ * uuid, the SHA1 of data, only names disk files, so it is computed
+ * by nst_key_uuid when the disk is first touched.
+ */
 typedef struct nst_key {
     uint8_t             flags;
     uint32_t            size;
@@ -42,6 +49,26 @@ typedef struct nst_key {
     unsigned char       uuid[NST_KEY_UUID_LEN];
 } nst_key_t;
 
+/*
+ * What nst_key_build already did for the stream, indexed by node and by
+ * element, so that each element is extracted, and each shared prefix is
+ * hashed, once per stream whatever the number of rules.
+ * data point into built keys, which live as long as the stream.
+ */
+typedef struct nst_key_prefix {
+    char                       *data;           /* NULL if not built yet */
+    uint32_t                    size;
+    XXH64_state_t               hash;
+} nst_key_prefix_t;
+
+typedef struct nst_key_cache {
+    nst_arena_t                *arena;
+    nst_key_prefix_t           *prefix;         /* by node */
+    hpx_ist_t                  *element;        /* by element, with the delimiter */
+} nst_key_cache_t;
+
+void nst_key_uuid(nst_key_t *key);
+
 
 static inline int
 nst_key_memory_checked(nst_key_t *key) {
@@ -70,11 +97,7 @@ nst_key_reset_flag(nst_key_t *key) {
 
 static inline hpx_buffer_t *
 nst_key_init() {
-    hpx_buffer_t  *key = get_trash_chunk();
-
-    memset(key->area, 0, key->size);
-
-    return key;
+    return get_trash_chunk();
 }
 
 static inline int
@@ -97,7 +120,8 @@ nst_key_catist(hpx_buffer_t *key, hpx_ist_t v) {
     }
 
     memcpy(key->area + key->data, v.ptr, v.len);
-    key->data += v.len + 1;
+    key->data += v.len;
+    key->area[key->data++] = '\0';
 
     return NST_OK;
 }
@@ -108,7 +132,7 @@ nst_key_catdel(hpx_buffer_t *key) {
         return NST_ERR;
     }
 
-    key->data += 1;
+    key->area[key->data++] = '\0';
 
     return NST_OK;
 }
@@ -120,16 +144,16 @@ static inline void
 nst_key_uuid_stringify(nst_key_t *key, char *str){
     int  i;
 
+    nst_key_uuid(key);
+
     for(i = 0; i < NST_KEY_UUID_LEN; i++) {
         sprintf((char*)&(str[i*2]), "%02x", key->uuid[i]);
     }
 }
 
-void nst_key_hash(nst_key_t *key);
-
 void nst_key_debug(hpx_stream_t *s, nst_key_t *key);
 
 int nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_txn_t *txn,
-        nst_key_t *key, enum http_meth_t method);
+        nst_key_cache_t *cache, nst_key_t *key, enum http_meth_t method);
 
 #endif /* _NUSTER_KEY_H */
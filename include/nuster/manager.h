@@ -53,6 +53,10 @@ typedef struct nst_stats {
         uint64_t                hit;
         uint64_t                abort;
         uint64_t                bytes;
+        uint64_t                admit;
+        uint64_t                reject;
+        uint64_t                revalidate;
+        uint64_t                allocs;         /* heap and pool allocations */
     } cache;
 
     struct {
@@ -61,6 +65,7 @@ typedef struct nst_stats {
         uint64_t                post;
         uint64_t                delete;
         uint64_t                abort;
+        uint64_t                allocs;
     } nosql;
 
 #if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
@@ -78,8 +83,10 @@ void nst_manager_init();
 /* stats */
 int nst_stats_init();
 int nst_stats_applet(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px);
-void nst_stats_update_cache(int state, uint64_t bytes);
-void nst_stats_update_nosql(enum http_meth_t meth);
+void nst_stats_update_cache(int state, uint64_t bytes, uint32_t allocs);
+void nst_stats_update_cache_admit(int admit);
+void nst_stats_update_cache_revalidate();
+void nst_stats_update_nosql(enum http_meth_t meth, uint32_t allocs);
 
 /* purger */
 void nst_purger_init();
@@ -32,6 +32,26 @@
 #define NST_MEMORY_BLOCK_MAX_SIZE      1024 * 1024 * 2
 #define NST_MEMORY_BLOCK_MAX_SHIFT     21
 #define NST_MEMORY_INFO_BITMAP_BITS    32
+#define NST_MEMORY_BLOCK_TYPE_RUN      0xFF
+#define NST_MEMORY_BLOCK_TYPE_FREE     0xFE
+#define NST_MEMORY_RUN_CLASSES         32
+#define NST_MEMORY_PAGE_SIZE           4096
+#define NST_MEMORY_HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+#define NST_MEMORY_CLASS_STEP_SHIFT    2
+#define NST_MEMORY_CLASS_FINE_SHIFT    5
+#define NST_MEMORY_MAGAZINES           4
+#define NST_MEMORY_MAGAZINE_CLASSES    40
+#define NST_MEMORY_MAGAZINE_SIZE       16
+#define NST_MEMORY_MAGAZINE_BYTES      16384
+#define NST_MEMORY_MAGAZINE_SHARE      16
+#define NST_MEMORY_MAGIC               0x31304d454d54534eULL   /* NSTMEM01 */
+
+/* see huge-pages */
+enum {
+    NST_MEMORY_PAGES_DEFAULT       = 0,
+    NST_MEMORY_PAGES_HUGE,                      /* MAP_HUGETLB, reserved huge pages */
+    NST_MEMORY_PAGES_TRANSPARENT,               /* madvise MADV_HUGEPAGE */
+};
 
 
 /* start                                 alignment                   stop
@@ -45,9 +65,19 @@
 
 /*
  * info:
- * | bitmap: 32 | reserved: 16 | 5 | full: 1 | bitmap: 1 | inited: 1 | type: 8 |
+ * | bitmap: 32 | reserved: 16 | 4 | evac: 1 | full: 1 | bitmap: 1 | inited: 1 | type: 8 |
  * bitmap: points to bitmap area, doesn't change once set
- * chunk size[n]: 1<<(NST_MEMORY_CHUNK_MIN_SHIFT + n)
+ * The upper 32 bits hold the bitmap of the chunks if there are at most 32
+ * of them, or else the number of used chunks.
+ * chunk size[n]: class[n].size
+ *
+ * A run of contiguous blocks has type NST_MEMORY_BLOCK_TYPE_RUN, the first
+ * block stores the number of blocks in place of the bitmap.
+ *
+ * Unused blocks form free runs, the first and the last block of a free run
+ * have type NST_MEMORY_BLOCK_TYPE_FREE and store its length the same way,
+ * so that a freed run is merged with its neighbours in constant time.
+ * The first block is linked in runs[n], 2^n <= length < 2^(n+1).
  */
 typedef struct nst_memory_ctrl {
     uint64_t                    info;
@@ -57,12 +87,40 @@ typedef struct nst_memory_ctrl {
     struct nst_memory_ctrl     *next;
 } nst_memory_ctrl_t;
 
+/*
+ * Size classes are powers of two from 1 << chunk_shift up to
+ * 1 << NST_MEMORY_CLASS_FINE_SHIFT, then 4 classes per power of two,
+ * 2^k + j * 2^(k - NST_MEMORY_CLASS_STEP_SHIFT) for j = 1..4, up to
+ * block_size, so that rounding wastes at most 20% instead of 50%.
+ * A block holds block_size / size chunks of one class, the rest of the
+ * block is lost.
+ */
+typedef struct nst_memory_class {
+    uint32_t                    size;
+    uint32_t                    chunks;      /* chunks per block */
+    uint64_t                    blocks;      /* blocks of this class */
+    uint64_t                    used;        /* used chunks */
+} nst_memory_class_t;
+
+/*
+ * A memory kept in a file is attached again by the next process if magic,
+ * layout and the sizes match, and it can be mapped at start again since
+ * it holds pointers. root is set by the creator once the objects in it
+ * are initialized, a memory without root is created again.
+ * A process killed while holding a lock leaves it held in the file, the
+ * locks of an orphaned memory are initialized again, see nst_core_attach.
+ */
 typedef struct nst_memory {
     uint8_t                    *start;
     uint8_t                    *stop;
     uint8_t                    *bitmap;
     char                        name[16];
 
+    uint64_t                    magic;
+    uint64_t                    layout;      /* fingerprint given by the creator */
+    void                       *root;        /* first object of the creator */
+    int                         orphaned;    /* attached with no process left */
+
 #if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
     pthread_mutex_t             mutex;
 #else
@@ -71,28 +129,51 @@ typedef struct nst_memory {
 
     uint64_t                    size;
     uint64_t                    used;
+    uint64_t                    failed;      /* allocations failed for lack of blocks */
 
     uint32_t                    block_size;  /* max memory can be allocated */
     uint32_t                    chunk_size;  /* min memory can be allocated */
     int                         chunk_shift;
     int                         block_shift;
 
-    int                         chunks;
+    int                         chunks;      /* number of size classes */
     int                         blocks;
 
+    nst_memory_class_t         *class;
     nst_memory_ctrl_t         **chunk;
     nst_memory_ctrl_t          *block;
-    nst_memory_ctrl_t          *empty;
     nst_memory_ctrl_t          *full;
+    nst_memory_ctrl_t          *evac;        /* blocks being evacuated */
+    nst_memory_ctrl_t          *runs[NST_MEMORY_RUN_CLASSES];  /* free runs */
 
     struct {
         uint8_t                *begin;
-        uint8_t                *free;
+        uint8_t                *free;        /* blocks from here were never used */
         uint8_t                *end;
     } data;
 } nst_memory_t;
 
 
+/*
+ * Each thread of the workers keeps magazines of free chunks per size class
+ * and memory, so that most allocations and frees do not take the memory
+ * lock, a magazine is refilled or flushed by half under one lock.
+ * Chunks in magazines are accounted as used. A class holds at most
+ * NST_MEMORY_MAGAZINE_BYTES, and all magazines at most 1/SHARE of the
+ * memory.
+ */
+typedef struct nst_memory_magazine {
+    int                         count;
+    int                         size;        /* max chunks, 0 if disabled */
+    void                       *chunk[NST_MEMORY_MAGAZINE_SIZE];
+} nst_memory_magazine_t;
+
+typedef struct nst_memory_magazines {
+    nst_memory_t               *memory;
+    nst_memory_magazine_t       magazine[NST_MEMORY_MAGAZINE_CLASSES];
+} nst_memory_magazines_t;
+
+
 #define bit_set(bit, i) (bit |= 1 << i)
 #define bit_clear(bit, i) (bit &= ~(1 << i))
 #define bit_used(bit, i) (((bit) >> (i)) & 1)
@@ -133,10 +214,60 @@ _nst_memory_block_clear_full(nst_memory_ctrl_t *block) {
     bit_clear(block->info, 11);
 }
 
+static inline void
+_nst_memory_block_set_evac(nst_memory_ctrl_t *block) {
+    bit_set(block->info, 12);
+}
+
+static inline int
+_nst_memory_block_is_evac(nst_memory_ctrl_t *block) {
+    return bit_used(block->info, 12);
+}
+
+static inline void
+_nst_memory_block_clear_evac(nst_memory_ctrl_t *block) {
+    bit_clear(block->info, 12);
+}
+
+/*
+ * Compaction: nst_memory_evacuate takes the sparsest chunk blocks out of
+ * the chunk lists, so that nothing new is allocated in them, the owners of
+ * the chunks in them move their objects elsewhere, and each block goes
+ * back to the free runs once its last chunk is freed.
+ * nst_memory_evacuate_end puts the blocks which could not be emptied back
+ * in the chunk lists.
+ * A block is sparse when at most 1/NST_MEMORY_EVAC_SPARSE of its chunks
+ * are used, compaction starts when the unused bytes of chunk blocks reach
+ * 1/NST_MEMORY_EVAC_WASTE of the memory.
+ */
+#define NST_MEMORY_EVAC_SPARSE         4
+#define NST_MEMORY_EVAC_WASTE          8
+
+/*
+ * whether p lies in a block being evacuated, read without the lock
+ */
+static inline int
+nst_memory_evacuating(nst_memory_t *memory, void *p) {
+
+    if((uint8_t *)p < memory->data.begin || (uint8_t *)p >= memory->data.free) {
+        return 0;
+    }
+
+    return _nst_memory_block_is_evac(
+            &memory->block[((uint8_t *)p - memory->data.begin) / memory->block_size]);
+}
+
 nst_memory_t *
-nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_size);
+nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_size,
+        int pages, int prefault, char *file, uint64_t layout);
 
-void *nst_memory_alloc(nst_memory_t *memory, int size);
+void *nst_memory_alloc(nst_memory_t *memory, uint64_t size);
+void *nst_memory_calloc(nst_memory_t *memory, uint64_t size);
+uint64_t nst_memory_size(nst_memory_t *memory, uint64_t size);
+uint64_t nst_memory_waste(nst_memory_t *memory, int idx);
+int nst_memory_evacuate(nst_memory_t *memory, int max);
+void nst_memory_evacuate_end(nst_memory_t *memory);
 void nst_memory_free(nst_memory_t *memory, void *p);
+void nst_memory_free_locked(nst_memory_t *memory, void *p);
 
 #endif /* _NUSTER_MEMORY_H */
@@ -51,6 +51,10 @@ typedef struct nuster {
     } applet;
 
     nst_proxy_t               **proxy;
+
+    struct {
+        hpx_pool_head_t        *ctx;            /* nst_ctx_t and its arena */
+    } pool;
 } nuster_t;
 
 extern nuster_t nuster;
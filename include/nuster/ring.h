@@ -22,54 +22,95 @@
 #ifndef _NUSTER_RING_H
 #define _NUSTER_RING_H
 
-#include <nuster/common.h>
+#include <common/htx.h>
 
+#include <nuster/common.h>
+#include <nuster/epoch.h>
 
 
 /*
  * A nst_ring_data contains a complete http response data,
  * and is pointed by nst_entry->data.
- * All nst_ring_data are stored in a circular singly linked list
+ * A nst_ring_data is pushed to the garbage list of the ring when it is
+ * invalidated, cleanup then moves it to the queue of invalid data and
+ * retires it once its clients are gone, so cleanup only walks garbage.
+ *
+ * The items of a data, one per htx block, are packed back to back in
+ * extents, an extent is filled up before the next one is linked, so
+ * serving a hit walks a few extents instead of one allocation per block.
+ * Extents grow from NST_RING_EXTENT_MIN_SIZE up to the memory block size,
+ * or are sized after the payload still expected when it is known, up to
+ * NST_RING_EXTENT_MAX_SIZE in a run of blocks, data items are split over
+ * two extents to fill them up.
  */
-typedef struct nst_ring_item {
-    struct nst_ring_item        *next;
+#define NST_RING_EXTENT_MIN_SIZE       512
+#define NST_RING_EXTENT_MAX_SIZE       (1024 * 1024)
+#define NST_RING_ITEM_ALIGN            4
+#define NST_RING_ITEM_SPLIT_MIN        64
 
+typedef struct nst_ring_item {
     uint32_t                     info;
     char                         data[0];
 } nst_ring_item_t;
 
+typedef struct nst_ring_extent {
+    struct nst_ring_extent      *next;
+
+    uint32_t                     size;          /* room for items */
+    uint32_t                     used;          /* bytes of items added */
+    char                         data[0];
+} nst_ring_extent_t;
+
 typedef struct nst_ring_data {
-    struct nst_ring_data        *next;
+    struct nst_ring_data        *next;          /* next garbage, invalid or retired */
 
     int                          clients;
     int                          invalid;
+    int                          done;          /* all items are added */
+
+    uint64_t                     size;          /* memory used by extents */
+    uint64_t                     expect;        /* payload bytes still expected */
 
-    nst_ring_item_t             *item;
+    nst_ring_extent_t           *extent;
 } nst_ring_data_t;
 
 typedef struct nst_ring {
     nst_memory_t                *memory;
 
+    /* pushed by any process, taken as a whole by cleanup */
+    nst_ring_data_t             *garbage;
+
+    /* invalid data still used by clients, master only */
     nst_ring_data_t             *head;
     nst_ring_data_t             *tail;
 
     uint64_t                     count;
     uint64_t                     invalid;
 
-#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
-    pthread_mutex_t              mutex;
-#else
-    unsigned int                 waiters;
-#endif
+    nst_epoch_t                 *epoch;
+    nst_ring_data_t             *retired[NST_EPOCH_LISTS];
+
+    /* see nst_ring_compact, master only */
+    struct {
+        int                      active;
+        uint64_t                 idx;           /* next bucket to walk */
+        uint64_t                 time;          /* when the last pass started */
+        uint64_t                 moved;         /* number of data moved */
+    } compact;
 } nst_ring_t;
 
 
+/*
+ * invalid and clients are updated atomically by every process, invalid
+ * is set before clients is read so a client attaching later sees it.
+ */
 static inline int
 nst_ring_data_invalid(nst_ring_data_t *data) {
 
-    if(data->invalid) {
+    if(*(volatile int *)&data->invalid) {
+        __sync_synchronize();
 
-        if(!data->clients) {
+        if(!*(volatile int *)&data->clients) {
             return NST_OK;
         }
     }
@@ -77,48 +118,158 @@ nst_ring_data_invalid(nst_ring_data_t *data) {
     return NST_ERR;
 }
 
-int nst_ring_init(nst_ring_t *ring, nst_memory_t *memory);
+#define NST_RING_RECLAIM_BATCH         64
+
+/*
+ * Compaction evacuates up to NST_RING_COMPACT_BLOCKS sparse memory blocks,
+ * then walks the dict and moves the valid data with extents in them to new
+ * extents, a pass starts at most every NST_RING_COMPACT_INTERVAL ms.
+ */
+#define NST_RING_COMPACT_BLOCKS        64
+#define NST_RING_COMPACT_INTERVAL      10000
+
+int nst_ring_init(nst_ring_t *ring, nst_memory_t *memory, nst_epoch_t *epoch);
 nst_ring_data_t *nst_ring_alloc_data(nst_ring_t *ring);
 
+/*
+ * size of the htx block value stored in the item
+ */
+static inline uint32_t
+nst_ring_item_size(nst_ring_item_t *item) {
+    uint32_t  info = item->info;
+    int       type = info >> 28;
+
+    if(type == HTX_BLK_HDR || type == HTX_BLK_TLR) {
+        return (info & 0xff) + ((info >> 8) & 0xfffff);
+    }
+
+    return info & 0xfffffff;
+}
+
+static inline uint32_t
+nst_ring_item_len(uint32_t size) {
+    return (sizeof(nst_ring_item_t) + size + NST_RING_ITEM_ALIGN - 1)
+        & ~(NST_RING_ITEM_ALIGN - 1);
+}
+
+/*
+ * Return the item at the cursor, NULL if there is none yet.
+ * The cursor is the extent, NULL before the first one, and the offset
+ * in it of the next item to read, see nst_ring_item_skip.
+ * Readers may follow the data while it is being added, the used size of
+ * an extent is final once the next one is linked, see nst_ring_store_add.
+ */
 static inline nst_ring_item_t *
-nst_ring_alloc_item(nst_ring_t *ring, uint32_t size) {
-    return nst_memory_alloc(ring->memory, sizeof(nst_ring_item_t) + size);
+nst_ring_item_get(nst_ring_data_t *data, nst_ring_extent_t **extent, uint32_t *offset) {
+    nst_ring_extent_t  *ext = *extent;
+    nst_ring_extent_t  *next;
+
+    if(!ext) {
+        ext = *(nst_ring_extent_t * volatile *)&data->extent;
+
+        if(!ext) {
+            return NULL;
+        }
+
+        *extent = ext;
+        *offset = 0;
+    }
+
+    while(1) {
+
+        if(*offset < *(volatile uint32_t *)&ext->used) {
+            __sync_synchronize();
+
+            return (nst_ring_item_t *)(ext->data + *offset);
+        }
+
+        next = *(nst_ring_extent_t * volatile *)&ext->next;
+
+        if(!next) {
+            return NULL;
+        }
+
+        __sync_synchronize();
+
+        if(*offset < *(volatile uint32_t *)&ext->used) {
+            continue;
+        }
+
+        ext     = next;
+        *extent = ext;
+        *offset = 0;
+    }
 }
 
+static inline void
+nst_ring_item_skip(nst_ring_item_t *item, uint32_t *offset) {
+    *offset += nst_ring_item_len(nst_ring_item_size(item));
+}
+
+/*
+ * clients is updated without the ring lock, data can only be attached
+ * under the dict lock or in an epoch read section, and the reader must
+ * check data->invalid afterwards, see nst_dict_get_hit
+ */
 static inline void
 nst_ring_data_attach(nst_ring_t *ring, nst_ring_data_t *data) {
-    nst_shctx_lock(ring);
-    data->clients++;
-    nst_shctx_unlock(ring);
+    __sync_add_and_fetch(&data->clients, 1);
 }
 
 static inline void
 nst_ring_data_detach(nst_ring_t *ring, nst_ring_data_t *data) {
-    nst_shctx_lock(ring);
-    data->clients--;
-    nst_shctx_unlock(ring);
+    __sync_sub_and_fetch(&data->clients, 1);
 }
 
+/*
+ * the data is freed by nst_ring_cleanup once no client uses it,
+ * only the first call counts it and pushes it to the garbage list.
+ */
 static inline void
-nst_ring_incr_invalid(nst_ring_t *ring) {
-    nst_shctx_lock(ring);
-    ring->invalid++;
-    nst_shctx_unlock(ring);
+nst_ring_data_invalidate(nst_ring_t *ring, nst_ring_data_t *data) {
+    nst_ring_data_t  *head;
+
+    if(!__sync_bool_compare_and_swap(&data->invalid, 0, 1)) {
+        return;
+    }
+
+    __sync_add_and_fetch(&ring->invalid, 1);
+
+    do {
+        head       = *(nst_ring_data_t * volatile *)&ring->garbage;
+        data->next = head;
+    } while(!__sync_bool_compare_and_swap(&ring->garbage, head, data));
 }
 
-void nst_ring_cleanup(nst_ring_t *ring);
+void nst_ring_cleanup(nst_ring_t *ring, int max);
+void nst_ring_reclaim(nst_ring_t *ring);
 
 static inline nst_ring_data_t *
 nst_ring_store_init(nst_ring_t *ring) {
     return nst_ring_alloc_data(ring);
 }
 
-int nst_ring_store_add(nst_ring_t *ring, nst_ring_data_t *data, nst_ring_item_t **tail,
+/*
+ * the payload size if known, used to size the extents
+ */
+static inline void
+nst_ring_store_expect(nst_ring_data_t *data, uint64_t size) {
+    data->expect = size;
+}
+
+int nst_ring_store_add(nst_ring_t *ring, nst_ring_data_t *data, nst_ring_extent_t **tail,
         const char *buf, uint32_t len, uint32_t info);
 
+/*
+ * Readers may follow the data while it is being added, see
+ * _nst_cache_memory_handler, so items are published after being filled
+ * and done is set after the last one is published.
+ */
 static inline int
 nst_ring_store_end(nst_ring_t *ring, nst_ring_data_t *data) {
-    data->invalid = 0;
+    __sync_synchronize();
+
+    data->done = 1;
 
     return NST_OK;
 }
@@ -127,12 +278,11 @@ static inline void
 nst_ring_store_abort(nst_ring_t *ring, nst_ring_data_t *data) {
 
     if(data) {
-        data->invalid = 1;
+        nst_ring_data_invalidate(ring, data);
     }
-
-    nst_ring_incr_invalid(ring);
 }
 
 void nst_ring_store_sync(nst_core_t *core);
+void nst_ring_compact(nst_core_t *core);
 
 #endif /* _NUSTER_RING_H */
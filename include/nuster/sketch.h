@@ -0,0 +1,52 @@
+/*
+ * include/nuster/sketch.h
+ * This file defines everything related to nuster frequency sketch.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NUSTER_SKETCH_H
+#define _NUSTER_SKETCH_H
+
+#include <nuster/common.h>
+
+
+/*
+ * A count-min sketch estimating how many times a key hash has been seen,
+ * NST_SKETCH_ROWS rows of width counters, saturating at NST_SKETCH_MAX.
+ * All counters are halved every width * NST_SKETCH_SAMPLE increments so
+ * that old popularity fades.
+ * One counter per NST_SKETCH_BYTES_PER_KEY bytes of data-size.
+ */
+#define NST_SKETCH_ROWS                4
+#define NST_SKETCH_MAX                 15
+#define NST_SKETCH_SAMPLE              10
+#define NST_SKETCH_MIN_WIDTH           1024
+#define NST_SKETCH_BYTES_PER_KEY       4096
+
+typedef struct nst_sketch {
+    uint8_t                    *table;
+    uint64_t                    width;          /* power of 2 */
+    uint64_t                    incr;           /* increments since last aging */
+} nst_sketch_t;
+
+
+int nst_sketch_init(nst_sketch_t *sketch, nst_memory_t *memory, uint64_t data_size);
+uint8_t nst_sketch_incr(nst_sketch_t *sketch, uint64_t hash);
+void nst_sketch_age(nst_sketch_t *sketch);
+
+#endif /* _NUSTER_SKETCH_H */
@@ -34,9 +34,9 @@ typedef struct nst_store {
 
 
 static inline int
-nst_store_init(hpx_ist_t root, nst_store_t *store, nst_memory_t *memory) {
+nst_store_init(hpx_ist_t root, nst_store_t *store, nst_memory_t *memory, nst_epoch_t *epoch) {
 
-    if(nst_ring_init(&store->ring, memory) != NST_OK) {
+    if(nst_ring_init(&store->ring, memory, epoch) != NST_OK) {
         return NST_ERR;
     }
 
@@ -81,7 +81,9 @@ struct appctx {
 			union {
 				struct {
 					struct nst_ring_data    *data;
-					struct nst_ring_item    *item;
+					struct nst_ring_extent  *extent;
+					uint32_t                 offset;  /* next item to send */
+					struct nst_waiter        wait;  /* waiting for items */
 				} ring;
 				struct {
 					int       fd;
@@ -93,6 +95,7 @@ struct appctx {
 			struct {
 				struct nst_dict  *dict;
 				uint64_t          idx;
+				uint64_t          gen;
 				struct buffer     buf;
 				struct ist	  host;
 				struct ist	  path;
@@ -186,6 +186,13 @@ struct global {
 
 			uint64_t dict_size;              /* max memory used by dict, in bytes */
 			uint64_t data_size;              /* max memory used by data, in bytes */
+			int dict_engine;                 /* dict engine: chain or swiss */
+			int evict;                       /* eviction policy: off or clock */
+			int evict_high;                  /* start evicting at this % of memory used */
+			int evict_low;                   /* stop evicting below this % of memory used */
+			int huge_pages;                  /* off, on or transparent */
+			int prefault;                    /* threads faulting in the memory, 0 if off */
+			char *shm_file;                  /* memory kept in this file across reloads */
 
 			int dict_cleaner;                /* the number of entries checked once */
 			int data_cleaner;                /* the number of data checked once */
@@ -202,6 +209,13 @@ struct global {
 
 			uint64_t dict_size;              /* max memory used by dict, in bytes */
 			uint64_t data_size;              /* max memory used by data, in bytes */
+			int dict_engine;                 /* dict engine: chain or swiss */
+			int evict;                       /* eviction policy: off or clock */
+			int evict_high;                  /* start evicting at this % of memory used */
+			int evict_low;                   /* stop evicting below this % of memory used */
+			int huge_pages;                  /* off, on or transparent */
+			int prefault;                    /* threads faulting in the memory, 0 if off */
+			char *shm_file;                  /* memory kept in this file across reloads */
 
 			int dict_cleaner;                /* the number of entries checked once */
 			int data_cleaner;                /* the number of data checked once */
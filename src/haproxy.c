@@ -198,6 +198,10 @@ struct global global = {
 			.status       = NST_STATUS_UNDEFINED,
 			.data_size    = NST_DEFAULT_DATA_SIZE,
 			.dict_size    = NST_DEFAULT_DICT_SIZE,
+			.dict_engine  = NST_DICT_ENGINE_CHAIN,
+			.evict        = NST_DICT_EVICT_OFF,
+			.evict_high   = NST_DEFAULT_EVICT_HIGH,
+			.evict_low    = NST_DEFAULT_EVICT_LOW,
 			.dict_cleaner = NST_DEFAULT_DICT_CLEANER,
 			.data_cleaner = NST_DEFAULT_DATA_CLEANER,
 			.disk_cleaner = NST_DEFAULT_DISK_CLEANER,
@@ -212,6 +216,10 @@ struct global global = {
 			.status       = NST_STATUS_UNDEFINED,
 			.data_size    = NST_DEFAULT_DATA_SIZE,
 			.dict_size    = NST_DEFAULT_DICT_SIZE,
+			.dict_engine  = NST_DICT_ENGINE_CHAIN,
+			.evict        = NST_DICT_EVICT_OFF,
+			.evict_high   = NST_DEFAULT_EVICT_HIGH,
+			.evict_low    = NST_DEFAULT_EVICT_LOW,
 			.dict_cleaner = NST_DEFAULT_DICT_CLEANER,
 			.data_cleaner = NST_DEFAULT_DATA_CLEANER,
 			.disk_cleaner = NST_DEFAULT_DISK_CLEANER,
@@ -26,14 +26,137 @@
 
 #include <nuster/nuster.h>
 
+/*
+ * Streams of this process parked while another stream creates the entry,
+ * and memory applets which caught up with it, indexed by the key hash.
+ */
+static struct eb_root  nst_cache_waiters = EB_ROOT;
+
+__decl_aligned_spinlock(nst_cache_waiters_lock);
+
+/*
+ * Streams call it with the dict lock held and the entry in INIT state,
+ * applets before checking the data again, so that the creator, which
+ * changes them before waking up the waiters, cannot be missed.
+ */
+static void
+_nst_cache_wait(nst_waiter_t *waiter, uint64_t hash) {
+
+    if(waiter->parked) {
+        return;
+    }
+
+    waiter->node.key = hash;
+    waiter->parked   = 1;
+
+    HA_SPIN_LOCK(OTHER_LOCK, &nst_cache_waiters_lock);
+    eb64_insert(&nst_cache_waiters, &waiter->node);
+    HA_SPIN_UNLOCK(OTHER_LOCK, &nst_cache_waiters_lock);
+}
+
+void
+nst_cache_wait_leave(nst_waiter_t *waiter) {
+
+    if(!waiter->parked) {
+        return;
+    }
+
+    /* taken even if already woken up, the waker may still use the task */
+    HA_SPIN_LOCK(OTHER_LOCK, &nst_cache_waiters_lock);
+    eb64_delete(&waiter->node);
+    HA_SPIN_UNLOCK(OTHER_LOCK, &nst_cache_waiters_lock);
+
+    waiter->parked = 0;
+}
+
+static void
+_nst_cache_wakeup(uint64_t hash) {
+    struct eb64_node  *node, *next;
+    nst_waiter_t      *waiter;
+
+    HA_SPIN_LOCK(OTHER_LOCK, &nst_cache_waiters_lock);
+
+    node = eb64_lookup(&nst_cache_waiters, hash);
+
+    while(node) {
+        next   = eb64_next_dup(node);
+        waiter = eb64_entry(node, nst_waiter_t, node);
+
+        eb64_delete(node);
+        task_wakeup(waiter->task, TASK_WOKEN_MSG);
+
+        node = next;
+    }
+
+    HA_SPIN_UNLOCK(OTHER_LOCK, &nst_cache_waiters_lock);
+}
+
+/*
+ * Called by the creator for each part added, the lock is only taken
+ * when something waits, the barrier pairs with the one of
+ * _nst_cache_memory_wait.
+ */
+static inline void
+_nst_cache_notify(uint64_t hash) {
+    __sync_synchronize();
+
+    if(!eb_is_empty(&nst_cache_waiters)) {
+        _nst_cache_wakeup(hash);
+    }
+}
+
+/*
+ * The item after the last one sent, the data may still be being added
+ * by the stream creating the entry, see nst_ring_store_add.
+ */
+static inline nst_ring_item_t *
+_nst_cache_memory_next(hpx_appctx_t *appctx) {
+    return nst_ring_item_get(appctx->ctx.nuster.store.ring.data,
+            &appctx->ctx.nuster.store.ring.extent, &appctx->ctx.nuster.store.ring.offset);
+}
+
+/*
+ * Caught up with the creator, sleep until it adds more items.
+ * node.key is set by nst_cache_hit.
+ */
+static void
+_nst_cache_memory_wait(hpx_appctx_t *appctx) {
+    nst_ring_data_t  *data   = appctx->ctx.nuster.store.ring.data;
+    nst_waiter_t     *waiter = &appctx->ctx.nuster.store.ring.wait;
+
+    _nst_cache_wait(waiter, waiter->node.key);
+
+    __sync_synchronize();
+
+    if(_nst_cache_memory_next(appctx) || data->done || data->invalid) {
+        nst_cache_wait_leave(waiter);
+        appctx_wakeup(appctx);
+
+        return;
+    }
+
+    appctx->t->expire = tick_add(now_ms,
+            global.nbproc > 1 ? NST_CACHE_WAIT_POLL_NBPROC : NST_CACHE_WAIT_POLL);
+}
+
+/*
+ * The cache memory applet sends the items of the data, following the
+ * stream creating the entry if the data is not done yet.
+ */
 static void
 _nst_cache_memory_handler(hpx_appctx_t *appctx) {
-    hpx_stream_interface_t  *si  = appctx->owner;
-    hpx_channel_t           *req = si_oc(si);
-    hpx_channel_t           *res = si_ic(si);
+    hpx_stream_interface_t  *si   = appctx->owner;
+    hpx_channel_t           *req  = si_oc(si);
+    hpx_channel_t           *res  = si_ic(si);
+    nst_ring_data_t         *data = appctx->ctx.nuster.store.ring.data;
     hpx_htx_t               *req_htx, *res_htx;
-    nst_ring_item_t         *item = NULL;
+    nst_ring_item_t         *item;
     int                      total = 0;
+    int                      done  = 1;
+
+    nst_cache_wait_leave(&appctx->ctx.nuster.store.ring.wait);
+
+    appctx->t->expire = TICK_ETERNITY;
 
     res_htx = htxbuf(&res->buf);
     total   = res_htx->data;
@@ -49,12 +172,13 @@ _nst_cache_memory_handler(hpx_appctx_t *appctx) {
         goto out;
     }
 
-    if(res->flags & (CF_SHUTW|CF_SHUTR|CF_SHUTW_NOW)) {
-        appctx->ctx.nuster.store.ring.item = NULL;
-    }
+    if(!(res->flags & (CF_SHUTW|CF_SHUTR|CF_SHUTW_NOW))) {
+        /* items linked before done is read are all sent below */
+        done = *(volatile int *)&data->done;
+
+        __sync_synchronize();
 
-    if(appctx->ctx.nuster.store.ring.item) {
-        item = appctx->ctx.nuster.store.ring.item;
+        item = _nst_cache_memory_next(appctx);
 
         while(item) {
             if(nst_http_ring_item_to_htx(item, res_htx) != NST_OK) {
@@ -63,33 +187,38 @@ _nst_cache_memory_handler(hpx_appctx_t *appctx) {
                 goto out;
             }
 
-            item = item->next;
+            nst_ring_item_skip(item, &appctx->ctx.nuster.store.ring.offset);
 
+            item = _nst_cache_memory_next(appctx);
         }
 
-    } else {
-
-        if(!htx_add_endof(res_htx, HTX_BLK_EOM)) {
-            si_rx_room_blk(si);
+        if(!done && !data->invalid) {
+            _nst_cache_memory_wait(appctx);
 
             goto out;
         }
+    }
 
-        if(!(res->flags & CF_SHUTR) ) {
-            res->flags |= CF_READ_NULL;
-            si_shutr(si);
-        }
+    /* the creation was aborted if not done, close without EOM */
+    if(done && !htx_add_endof(res_htx, HTX_BLK_EOM)) {
+        si_rx_room_blk(si);
 
-        /* eat the whole request */
-        if(co_data(req)) {
-            req_htx = htx_from_buf(&req->buf);
-            co_htx_skip(req, req_htx, co_data(req));
-            htx_to_buf(req_htx, &req->buf);
-        }
+        goto out;
+    }
+
+    if(!(res->flags & CF_SHUTR) ) {
+        res->flags |= CF_READ_NULL;
+        si_shutr(si);
+    }
+
+    /* eat the whole request */
+    if(co_data(req)) {
+        req_htx = htx_from_buf(&req->buf);
+        co_htx_skip(req, req_htx, co_data(req));
+        htx_to_buf(req_htx, &req->buf);
     }
 
 out:
-    appctx->ctx.nuster.store.ring.item = item;
     total = res_htx->data - total;
 
     if(total) {
@@ -336,6 +465,14 @@ nst_cache_handler(hpx_appctx_t *appctx) {
     }
 }
 
+static void
+_nst_cache_release(hpx_appctx_t *appctx) {
+
+    if(appctx->st0 == NST_CTX_STATE_HIT_MEMORY) {
+        nst_cache_wait_leave(&appctx->ctx.nuster.store.ring.wait);
+    }
+}
+
 void
 nst_cache_housekeeping() {
     uint64_t  start;
@@ -348,42 +485,52 @@ nst_cache_housekeeping() {
         int  disk_saver   = global.nuster.cache.disk_saver;
         int  ms           = 10;
         int  ratio        = 1;
+        int  evicted;
+
+        nst_dict_rehash(&nuster.cache->dict);
 
         start = get_current_timestamp();
 
         while(dict_cleaner--) {
-            nst_dict_cleanup(&nuster.cache->dict);
+
+            if(nst_dict_cleanup(&nuster.cache->dict) != NST_OK) {
+                break;
+            }
 
             if(get_current_timestamp() - start >= ms) {
                 break;
             }
         }
 
-        start = get_current_timestamp();
+        evicted = nst_dict_evict(&nuster.cache->dict);
 
-        if(data_cleaner > nuster.cache->store.ring.count) {
-            data_cleaner = nuster.cache->store.ring.count;
-        }
+        nst_sketch_age(&nuster.cache->sketch);
 
         if(nuster.cache->store.ring.count) {
             ratio = nuster.cache->store.ring.invalid * 10 / nuster.cache->store.ring.count;
         }
 
         if(ratio >= 2) {
-            data_cleaner = nuster.cache->store.ring.count;
+            data_cleaner = nuster.cache->store.ring.invalid;
 
             ms = ms * ratio ;
             ms = ms >= 100 ? 100 : ms;
         }
 
-        while(data_cleaner--) {
-            nst_ring_cleanup(&nuster.cache->store.ring);
+        /* release the memory of evicted data right away */
+        if(evicted) {
+            data_cleaner = nuster.cache->store.ring.invalid;
 
-            if(get_current_timestamp() - start >= ms) {
-                break;
-            }
+            ms = 100;
         }
 
+        /* only invalid data are checked */
+        nst_ring_cleanup(&nuster.cache->store.ring, data_cleaner);
+
+        nst_core_reclaim(nuster.cache);
+
+        nst_ring_compact(nuster.cache);
+
         start = get_current_timestamp();
 
         while(disk_cleaner--) {
@@ -419,45 +566,84 @@ nst_cache_housekeeping() {
 
 void
 nst_cache_init() {
-    nuster.applet.cache.fct = nst_cache_handler;
+    nuster.applet.cache.fct     = nst_cache_handler;
+    nuster.applet.cache.release = _nst_cache_release;
 
     if(global.nuster.cache.status == NST_STATUS_ON) {
 
         global.nuster.cache.memory = nst_memory_create("cache.shm",
                 global.nuster.cache.dict_size + global.nuster.cache.data_size,
-                global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE);
+                global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE,
+                global.nuster.cache.huge_pages, global.nuster.cache.prefault,
+                global.nuster.cache.shm_file,
+                nst_core_layout(global.nuster.cache.dict_engine, global.nuster.cache.dict_size,
+                    global.nuster.cache.data_size, global.nuster.cache.root));
 
         if(!global.nuster.cache.memory) {
             goto shm_err;
         }
 
-        if(nst_shctx_init(global.nuster.cache.memory) != NST_OK) {
-            goto shm_err;
-        }
+        if(global.nuster.cache.memory->root) {
+            nuster.cache = global.nuster.cache.memory->root;
 
-        nuster.cache = nst_memory_alloc(global.nuster.cache.memory, sizeof(nst_core_t));
+            if(nst_core_attach(nuster.cache, NST_MODE_CACHE, global.nuster.cache.root) != NST_OK) {
+                goto shm_err;
+            }
 
-        if(!nuster.cache) {
-            goto err;
-        }
+            ha_notice("[nuster][cache] attached %s, %"PRIu64" entries\n",
+                    global.nuster.cache.shm_file, nuster.cache->dict.used);
+        } else {
+            if(nst_shctx_init(global.nuster.cache.memory) != NST_OK) {
+                goto shm_err;
+            }
 
-        memset(nuster.cache, 0, sizeof(*nuster.cache));
+            nuster.cache = nst_memory_alloc(global.nuster.cache.memory, sizeof(nst_core_t));
 
-        nuster.cache->memory = global.nuster.cache.memory;
-        nuster.cache->root   = global.nuster.cache.root;
+            if(!nuster.cache) {
+                goto err;
+            }
 
-        if(nst_store_init(global.nuster.cache.root, &nuster.cache->store,
-                    global.nuster.cache.memory) != NST_OK) {
+            memset(nuster.cache, 0, sizeof(*nuster.cache));
 
-            goto err;
-        }
+            nuster.cache->memory = global.nuster.cache.memory;
+            nuster.cache->root   = global.nuster.cache.root;
+
+            if(nst_epoch_init(&nuster.cache->epoch, global.nuster.cache.memory,
+                        global.nbproc * MAX_THREADS) != NST_OK) {
+
+                goto err;
+            }
+
+            if(nst_store_init(global.nuster.cache.root, &nuster.cache->store,
+                        global.nuster.cache.memory, &nuster.cache->epoch) != NST_OK) {
+
+                goto err;
+            }
+
+            if(nst_dict_init(&nuster.cache->dict, &nuster.cache->store, global.nuster.cache.memory,
+                        global.nuster.cache.dict_size, global.nuster.cache.dict_engine,
+                        &nuster.cache->epoch) != NST_OK) {
+
+                goto err;
+            }
+
+            if(nst_sketch_init(&nuster.cache->sketch, global.nuster.cache.memory,
+                        global.nuster.cache.data_size) != NST_OK) {
 
-        if(nst_dict_init(&nuster.cache->dict, &nuster.cache->store, global.nuster.cache.memory,
-                    global.nuster.cache.dict_size) != NST_OK) {
+                goto err;
+            }
+
+            if(nst_core_bind(nuster.cache, NST_MODE_CACHE) != NST_OK) {
+                goto err;
+            }
 
-            goto err;
+            /* the memory can be attached from now on */
+            global.nuster.cache.memory->root = nuster.cache;
         }
 
+        nst_dict_evict_init(&nuster.cache->dict, global.nuster.cache.evict,
+                global.nuster.cache.evict_high, global.nuster.cache.evict_low);
+
         ha_notice("[nuster][cache] on, dict_size=%"PRIu64", data_size=%"PRIu64"\n",
                 global.nuster.cache.dict_size, global.nuster.cache.data_size);
     }
@@ -500,6 +686,38 @@ _nst_cache_record_access(nst_dict_entry_t *entry) {
 
 }
 
+static void
+_nst_cache_hit_entry(nst_ctx_t *ctx, nst_dict_entry_t *entry) {
+    ctx->txn.res.header_len    = entry->header_len;
+    ctx->txn.res.payload_len   = entry->payload_len;
+    ctx->txn.res.etag          = entry->etag;
+    ctx->txn.res.last_modified = entry->last_modified;
+
+    _nst_cache_record_access(entry);
+}
+
+/*
+ * TinyLFU admission: count the miss in the sketch, and while there is
+ * room admit anything, otherwise only keys seen at least rule->admit times,
+ * so that one-hit keys do not evict hotter ones.
+ */
+static int
+_nst_cache_admit(nst_ctx_t *ctx, nst_key_t *key) {
+    uint8_t  freq;
+    int      admit;
+
+    if(!ctx->rule->admit || !nst_store_memory_on(ctx->rule->store)) {
+        return NST_OK;
+    }
+
+    freq  = nst_sketch_incr(&nuster.cache->sketch, key->hash);
+    admit = freq >= ctx->rule->admit || !nst_dict_pressure(&nuster.cache->dict);
+
+    nst_stats_update_cache_admit(admit);
+
+    return admit ? NST_OK : NST_ERR;
+}
+
 void
 nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
     hpx_htx_blk_type_t  type;
@@ -515,18 +733,32 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
 
     htx = htxbuf(&msg->chn->buf);
 
+    if(ctx->refresh != key && _nst_cache_admit(ctx, key) != NST_OK) {
+        ctx->state = NST_CTX_STATE_BYPASS;
+
+        return;
+    }
+
     ctx->state = NST_CTX_STATE_CREATE;
 
-    nst_shctx_lock(&nuster.cache->dict);
+    nst_dict_lock(&nuster.cache->dict, key->hash);
 
     entry = nst_dict_get(&nuster.cache->dict, key);
 
-    if(entry) {
+    if(entry && (ctx->refresh != key || entry->state != NST_DICT_ENTRY_STATE_VALID)) {
         ctx->state = NST_CTX_STATE_BYPASS;
     }
 
     if(ctx->state == NST_CTX_STATE_CREATE) {
-        entry = nst_dict_set(&nuster.cache->dict, key, &ctx->txn, ctx->rule, ctx->pid);
+
+        if(entry) {
+            /* the stale entry is served until nst_cache_finish replaces it */
+            entry = nst_dict_prepare(&nuster.cache->dict, key, &ctx->txn, ctx->rule, ctx->pid);
+        } else {
+            ctx->refresh = NULL;
+
+            entry = nst_dict_set(&nuster.cache->dict, key, &ctx->txn, ctx->rule, ctx->pid);
+        }
 
         if(entry) {
             ctx->state = NST_CTX_STATE_CREATE;
@@ -536,7 +768,7 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         }
     }
 
-    nst_shctx_unlock(&nuster.cache->dict);
+    nst_dict_unlock(&nuster.cache->dict, key->hash);
 
     /* init store data */
 
@@ -557,6 +789,9 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
             *((uint8_t *)(&t) + 3) = ctx->rule->extend[3];
 
             nst_disk_store_init(&nuster.cache->store.disk, &ctx->store.disk, key, &ctx->txn, t);
+
+            nst_disk_meta_set_stale(ctx->store.disk.meta, ctx->rule->stale.revalidate,
+                    ctx->rule->stale.error);
         }
     }
 
@@ -582,7 +817,7 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
                 int  ret;
 
                 ret = nst_ring_store_add(&nuster.cache->store.ring, ctx->store.ring.data,
-                        &ctx->store.ring.item, htx_get_blk_ptr(htx, blk), sz, blk->info);
+                        &ctx->store.ring.tail, htx_get_blk_ptr(htx, blk), sz, blk->info);
 
                 if(ret == NST_ERR) {
                     ctx->store.ring.data = NULL;
@@ -601,6 +836,32 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
                 break;
             }
         }
+
+        /* the payload known so far, extents are sized after it */
+        if(nst_store_memory_on(ctx->rule->store) && ctx->store.ring.data) {
+            uint64_t  expect = htx->extra;
+
+            for(idx = htx_get_next(htx, idx); idx != -1; idx = htx_get_next(htx, idx)) {
+                blk = htx_get_blk(htx, idx);
+
+                if(htx_get_blk_type(blk) == HTX_BLK_DATA) {
+                    expect += htx_get_blksz(blk);
+                }
+            }
+
+            nst_ring_store_expect(ctx->store.ring.data, expect);
+        }
+
+        /* other streams can follow the data from now on */
+        if(ctx->store.ring.data && !ctx->refresh) {
+            nst_dict_lock(&nuster.cache->dict, key->hash);
+
+            ctx->entry->store.ring.fill = ctx->store.ring.data;
+
+            nst_dict_unlock(&nuster.cache->dict, key->hash);
+
+            _nst_cache_wakeup(key->hash);
+        }
     }
 
 err:
@@ -649,7 +910,7 @@ nst_cache_update(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 int  ret;
 
                 ret = nst_ring_store_add(&nuster.cache->store.ring, ctx->store.ring.data,
-                        &ctx->store.ring.item, data.ptr, data.len, info);
+                        &ctx->store.ring.tail, data.ptr, data.len, info);
 
                 if(ret == NST_ERR) {
                     ctx->store.ring.data = NULL;
@@ -671,7 +932,7 @@ nst_cache_update(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 int  ret;
 
                 ret = nst_ring_store_add(&nuster.cache->store.ring, ctx->store.ring.data,
-                        &ctx->store.ring.item, htx_get_blk_ptr(htx, blk), sz, blk->info);
+                        &ctx->store.ring.tail, htx_get_blk_ptr(htx, blk), sz, blk->info);
 
                 if(ret == NST_ERR) {
                     ctx->store.ring.data = NULL;
@@ -698,9 +959,222 @@ nst_cache_update(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
 
     }
 
+    if(forward && ctx->store.ring.data) {
+        _nst_cache_notify(ctx->entry->key.hash);
+    }
+
     return forward;
 }
 
+/*
+ * The stream refreshing a stale entry is done without replacing it,
+ * let another stream refresh it, failed extends the stale-if-error window.
+ * caller must hold nst_dict_lock(dict, ctx->refresh->hash)
+ */
+static void
+_nst_cache_refresh_end(nst_ctx_t *ctx, int failed) {
+    nst_dict_entry_t  *entry = nst_dict_get(&nuster.cache->dict, ctx->refresh);
+
+    if(entry && entry->state == NST_DICT_ENTRY_STATE_VALID) {
+        entry->stale.refresh = 0;
+
+        if(failed) {
+            entry->stale.failed = get_current_timestamp();
+        }
+    }
+
+    ctx->refresh = NULL;
+}
+
+void
+nst_cache_refresh_end(nst_ctx_t *ctx, int failed) {
+    uint64_t  hash = ctx->refresh->hash;
+
+    nst_dict_lock(&nuster.cache->dict, hash);
+
+    _nst_cache_refresh_end(ctx, failed);
+
+    nst_dict_unlock(&nuster.cache->dict, hash);
+}
+
+/*
+ * Make the request refreshing a stale entry conditional, unless the client
+ * sent its own validators, which are for its copy and not for the entry.
+ */
+void
+nst_cache_revalidate(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    hpx_htx_t          *htx = htxbuf(&msg->chn->buf);
+
+    if(ctx->refresh != &ctx->keys[ctx->rule->key->idx]) {
+        ctx->revalidate = 0;
+
+        return;
+    }
+
+    if(http_find_header(htx, ist("If-None-Match"), &hdr, 0)) {
+        ctx->revalidate = 0;
+
+        return;
+    }
+
+    hdr.blk = NULL;
+
+    if(http_find_header(htx, ist("If-Modified-Since"), &hdr, 0)) {
+        ctx->revalidate = 0;
+
+        return;
+    }
+
+    if(ctx->revalidate & NST_HTTP_VALIDATOR_ETAG) {
+        http_add_header(htx, ist("If-None-Match"), ctx->txn.res.etag);
+    }
+
+    if(ctx->revalidate & NST_HTTP_VALIDATOR_LAST_MODIFIED) {
+        http_add_header(htx, ist("If-Modified-Since"), ctx->txn.res.last_modified);
+    }
+}
+
+/*
+ * Serve the entry found by nst_cache_exists in place of the response of
+ * the server, which is dropped, or a 502 if the entry cannot be served.
+ */
+static void
+_nst_cache_replace_response(hpx_stream_t *s, nst_ctx_t *ctx) {
+
+    if(ctx->state != NST_CTX_STATE_HIT_MEMORY && ctx->state != NST_CTX_STATE_HIT_DISK) {
+        goto err;
+    }
+
+    nst_http_drop_response(s);
+
+    nst_cache_hit(s, &s->si[1], &s->req, &s->res, ctx);
+
+    if(!s->target) {
+        s->si[1].state = SI_ST_CLO;
+
+        goto err;
+    }
+
+    return;
+
+err:
+    /* the response cannot be forwarded, see http_wait_for_response */
+    ctx->state     = NST_CTX_STATE_BYPASS;
+    s->txn->status = 502;
+
+    http_reply_and_close(s, s->txn->status, http_error_message(s));
+
+    if(!(s->flags & SF_ERR_MASK)) {
+        s->flags |= SF_ERR_PRXCOND;
+    }
+
+    if(!(s->flags & SF_FINST_MASK)) {
+        s->flags |= SF_FINST_H;
+    }
+
+    s->si[1].flags   |= SI_FL_NOLINGER;
+    s->res.analysers &= AN_RES_FLT_END;
+    s->req.analysers &= AN_REQ_FLT_END;
+}
+
+/*
+ * The server answered the conditional refresh with a 304: the stored data
+ * is kept and only expire is renewed, then the entry is served in place of
+ * the 304 which the client did not ask for.
+ */
+void
+nst_cache_revalidated(hpx_stream_t *s, nst_ctx_t *ctx) {
+    nst_dict_entry_t  *entry;
+    nst_key_t         *key = ctx->refresh;
+    int                ret = NST_ERR;
+
+    nst_dict_lock(&nuster.cache->dict, key->hash);
+
+    entry = nst_dict_get(&nuster.cache->dict, key);
+
+    /* not purged nor replaced meanwhile */
+    if(entry && entry->state == NST_DICT_ENTRY_STATE_VALID && entry->stale.refresh) {
+        entry->expire        = get_current_timestamp() / 1000 + ctx->rule->ttl;
+        entry->stale.refresh = 0;
+        entry->stale.failed  = 0;
+
+        if(entry->store.disk.file) {
+            nst_disk_update_expire(entry->store.disk.file, entry->expire);
+        }
+
+        nst_dict_schedule(&nuster.cache->dict, entry);
+
+        ret = NST_OK;
+    }
+
+    ctx->refresh    = NULL;
+    ctx->revalidate = 0;
+
+    nst_dict_unlock(&nuster.cache->dict, key->hash);
+
+    if(ret == NST_OK) {
+        nst_stats_update_cache_revalidate();
+
+        nst_key_reset_flag(key);
+
+        ctx->state = nst_cache_exists(ctx);
+    } else {
+        ctx->state = NST_CTX_STATE_BYPASS;
+    }
+
+    /* the 304 cannot be forwarded */
+    _nst_cache_replace_response(s, ctx);
+}
+
+/*
+ * The refresh failed with a server error or no response: the entry is
+ * served in place of the error during its stale-if-error window.
+ * Return NST_ERR if the error is to be forwarded.
+ */
+int
+nst_cache_refresh_failed(hpx_stream_t *s, nst_ctx_t *ctx) {
+    nst_dict_entry_t  *entry;
+    nst_key_t         *key = ctx->refresh;
+    uint64_t           now = get_current_timestamp() / 1000;
+    int                ret = NST_ERR;
+
+    nst_dict_lock(&nuster.cache->dict, key->hash);
+
+    entry = nst_dict_get(&nuster.cache->dict, key);
+
+    if(entry && entry->state == NST_DICT_ENTRY_STATE_VALID && entry->stale.refresh
+            && now < entry->expire + entry->stale.error) {
+
+        ret = NST_OK;
+    }
+
+    _nst_cache_refresh_end(ctx, 1);
+
+    ctx->revalidate = 0;
+
+    nst_dict_unlock(&nuster.cache->dict, key->hash);
+
+    if(ret != NST_OK) {
+        return NST_ERR;
+    }
+
+    nst_key_reset_flag(key);
+
+    ctx->state = nst_cache_exists(ctx);
+
+    /* purged meanwhile */
+    if(ctx->state != NST_CTX_STATE_HIT_MEMORY && ctx->state != NST_CTX_STATE_HIT_DISK) {
+        ctx->state = NST_CTX_STATE_BYPASS;
+
+        return NST_ERR;
+    }
+
+    _nst_cache_replace_response(s, ctx);
+
+    return NST_OK;
+}
+
 /*
  * cache done
  */
@@ -708,6 +1182,7 @@ int
 nst_cache_finish(nst_ctx_t *ctx) {
     nst_key_t  *key;
     int         idx;
+    int         ret = NST_OK;
 
     idx = ctx->rule->key->idx;
     key = &(ctx->keys[idx]);
@@ -715,17 +1190,27 @@ nst_cache_finish(nst_ctx_t *ctx) {
     ctx->state = NST_CTX_STATE_DONE;
 
     ctx->entry->ctime = get_current_timestamp();
+    ctx->entry->fetch = ctx->entry->ctime - ctx->ctime;
 
     if(ctx->rule->ttl == 0) {
         ctx->entry->expire = 0;
     } else {
-        ctx->entry->expire = ctx->entry->ctime / 1000 + ctx->rule->ttl;
+        uint32_t  ttl = ctx->rule->ttl;
+
+        /* so that entries stored together do not expire together */
+        if(ctx->rule->jitter) {
+            ttl -= ha_random32() % ((uint64_t)ttl * ctx->rule->jitter / 100 + 1);
+        }
+
+        ctx->entry->expire = ctx->entry->ctime / 1000 + ttl;
     }
 
     ctx->entry->header_len  = ctx->txn.res.header_len;
     ctx->entry->payload_len = ctx->txn.res.payload_len;
 
     if(nst_store_memory_on(ctx->rule->store) && ctx->store.ring.data) {
+        nst_ring_store_end(&nuster.cache->store.ring, ctx->store.ring.data);
+
         ctx->entry->state = NST_DICT_ENTRY_STATE_VALID;
 
         ctx->entry->store.ring.data = ctx->store.ring.data;
@@ -742,22 +1227,192 @@ nst_cache_finish(nst_ctx_t *ctx) {
         }
     }
 
+    nst_dict_lock(&nuster.cache->dict, key->hash);
+
+    ctx->entry->store.ring.fill = NULL;
+
     if(ctx->entry->state == NST_DICT_ENTRY_STATE_INIT) {
         ctx->entry->state = NST_DICT_ENTRY_STATE_INVALID;
 
+        ret = NST_ERR;
+    }
+
+    if(ctx->refresh) {
+
+        if(ret == NST_OK) {
+            ret = nst_dict_replace(&nuster.cache->dict, ctx->entry);
+        } else {
+            nst_dict_discard(&nuster.cache->dict, ctx->entry);
+        }
+
+        if(ret == NST_OK) {
+            ctx->refresh = NULL;
+        } else {
+            /* not cached either */
+            _nst_cache_refresh_end(ctx, 1);
+        }
+
+    } else {
+        nst_dict_schedule(&nuster.cache->dict, ctx->entry);
+    }
+
+    nst_dict_unlock(&nuster.cache->dict, key->hash);
+
+    _nst_cache_wakeup(key->hash);
+
+    return ret;
+}
+
+/*
+ * Attach to the data of an entry being created, so that the stream
+ * is served while the creator adds the rest.
+ * Called with the dict lock held in an epoch read section: the data can be
+ * made invalid without the dict lock, and nst_ring_cleanup only retires
+ * invalid data without clients, so invalid is checked after attaching.
+ */
+static int
+_nst_cache_follow(nst_ctx_t *ctx, nst_dict_entry_t *entry) {
+    nst_ring_data_t  *data = entry->store.ring.fill;
+
+    if(!data) {
+        return NST_ERR;
+    }
+
+    nst_ring_data_attach(&nuster.cache->store.ring, data);
+
+    if(data->invalid) {
+        nst_ring_data_detach(&nuster.cache->store.ring, data);
+
         return NST_ERR;
     }
 
+    ctx->store.ring.data = data;
+
+    return NST_OK;
+}
+
+/*
+ * Keep the validators the server sent with the stale entry, so that
+ * nst_cache_revalidate can ask the server whether it changed.
+ * Called with the dict lock held.
+ */
+static void
+_nst_cache_validators(nst_ctx_t *ctx, nst_dict_entry_t *entry) {
+    hpx_buffer_t  *buf = ctx->txn.buf;
+
+    ctx->revalidate = 0;
+
+    if(entry->validator & NST_HTTP_VALIDATOR_ETAG) {
+        ctx->txn.res.etag.ptr = buf->area + buf->data;
+        ctx->txn.res.etag.len = entry->etag.len;
+
+        if(chunk_istcat(buf, entry->etag)) {
+            ctx->revalidate |= NST_HTTP_VALIDATOR_ETAG;
+        }
+    }
+
+    if(entry->validator & NST_HTTP_VALIDATOR_LAST_MODIFIED) {
+        ctx->txn.res.last_modified.ptr = buf->area + buf->data;
+        ctx->txn.res.last_modified.len = entry->last_modified.len;
+
+        if(chunk_istcat(buf, entry->last_modified)) {
+            ctx->revalidate |= NST_HTTP_VALIDATOR_LAST_MODIFIED;
+        }
+    }
+}
+
+/*
+ * Make the stream the one refreshing the entry, unless another one does
+ * or the last refresh failed less than NST_CACHE_STALE_RETRY ago.
+ * Called with the dict lock held.
+ */
+static int
+_nst_cache_elect(nst_ctx_t *ctx, nst_key_t *key, nst_dict_entry_t *entry) {
+
+    if(entry->stale.refresh || ctx->refresh) {
+        return NST_ERR;
+    }
+
+    if(entry->stale.failed
+            && get_current_timestamp() < entry->stale.failed + NST_CACHE_STALE_RETRY) {
+
+        return NST_ERR;
+    }
+
+    entry->stale.refresh = 1;
+    ctx->refresh         = key;
+
+    _nst_cache_validators(ctx, entry);
+
     return NST_OK;
 }
 
+/*
+ * -ln(u) of a uniform random u in ]0, 1], in 1/1024: an exponentially
+ * distributed value with a mean of 1024. The mantissa of log2 is linear.
+ */
+static inline uint64_t
+_nst_cache_random_exp() {
+    uint32_t  r = ha_random32() | 1;
+    int       n = 31 - __builtin_clz(r);
+    uint64_t  l = n * 1024 + (((r << (31 - n)) & 0x7fffffff) >> 21);
+
+    return (32 * 1024 - l) * 710 / 1024;
+}
+
+/*
+ * XFetch: refresh a valid entry before it expires, with a probability
+ * which grows as expire approaches, and sooner the longer the entry took
+ * to fetch, so that the refreshes of entries stored together spread out.
+ */
+static int
+_nst_cache_early(nst_ctx_t *ctx, nst_dict_entry_t *entry) {
+
+    if(ctx->rule->early != NST_STATUS_ON || !entry->expire || !entry->fetch) {
+        return 0;
+    }
+
+    return get_current_timestamp() + entry->fetch * _nst_cache_random_exp() / 1024
+        >= entry->expire * 1000;
+}
+
+/*
+ * An expired entry kept by stale-while-revalidate or stale-if-error.
+ * One stream at a time refreshes it from the backend, the others are
+ * served the stale entry during the stale-while-revalidate window, and
+ * during the stale-if-error window once a refresh failed, which is then
+ * retried every NST_CACHE_STALE_RETRY.
+ * Called with the dict lock held, return NST_OK to serve the entry.
+ */
+static int
+_nst_cache_stale(nst_ctx_t *ctx, nst_key_t *key, nst_dict_entry_t *entry) {
+    uint64_t  now = get_current_timestamp() / 1000;
+
+    if(_nst_cache_elect(ctx, key, entry) == NST_OK) {
+        return NST_ERR;
+    }
+
+    if(now < entry->expire + entry->stale.revalidate) {
+        return NST_OK;
+    }
+
+    if(entry->stale.failed && now < entry->expire + entry->stale.error) {
+        return NST_OK;
+    }
+
+    return NST_ERR;
+}
+
 /*
  * Check if valid cache exists
  */
 int
 nst_cache_exists(nst_ctx_t *ctx) {
     nst_dict_entry_t  *entry = NULL;
+    nst_epoch_slot_t  *slot;
     nst_key_t         *key;
+    uint32_t           stale = 0;
+    int                early = 0;
     int                ret, idx;
 
     ret = NST_CTX_STATE_INIT;
@@ -771,37 +1426,92 @@ nst_cache_exists(nst_ctx_t *ctx) {
     if(!nst_key_memory_checked(key)) {
         nst_key_memory_set_checked(key);
 
-        nst_shctx_lock(&nuster.cache->dict);
+        /* also covers the locked path, see _nst_cache_follow */
+        slot = nst_epoch_enter(&nuster.cache->epoch);
 
-        entry = nst_dict_get(&nuster.cache->dict, key);
+        if(slot) {
+            entry = nst_dict_get_hit(&nuster.cache->dict, key, &ctx->store.ring.data);
 
-        if(entry) {
+            if(entry && _nst_cache_early(ctx, entry)) {
+                /* the locked path elects the stream refreshing it */
+                nst_ring_data_detach(&nuster.cache->store.ring, ctx->store.ring.data);
+
+                ctx->store.ring.data = NULL;
+
+                early = 1;
+            } else if(entry) {
+                _nst_cache_hit_entry(ctx, entry);
+
+                ret = NST_CTX_STATE_HIT_MEMORY;
+            }
+        }
 
-            if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
+        if(ret == NST_CTX_STATE_INIT) {
 
-                if(entry->store.ring.data) {
-                    ctx->store.ring.data = entry->store.ring.data;
-                    ret = NST_CTX_STATE_HIT_MEMORY;
-                } else if(entry->store.disk.file) {
-                    ctx->store.disk.file = entry->store.disk.file;
-                    ret = NST_CTX_STATE_HIT_DISK;
+            nst_dict_lock(&nuster.cache->dict, key->hash);
+
+            entry = nst_dict_get(&nuster.cache->dict, key);
+
+            if(entry && entry->state == NST_DICT_ENTRY_STATE_VALID
+                    && nst_dict_entry_expired(entry)) {
+
+                if(_nst_cache_stale(ctx, key, entry) == NST_OK) {
+                    stale = nst_dict_entry_stale_end(entry) - entry->expire;
+                } else {
+                    entry = NULL;
                 }
 
-                ctx->txn.res.header_len    = entry->header_len;
-                ctx->txn.res.payload_len   = entry->payload_len;
-                ctx->txn.res.etag          = entry->etag;
-                ctx->txn.res.last_modified = entry->last_modified;
+            } else if(entry && entry->state == NST_DICT_ENTRY_STATE_VALID
+                    && (early || _nst_cache_early(ctx, entry))
+                    && _nst_cache_elect(ctx, key, entry) == NST_OK) {
 
-                _nst_cache_record_access(entry);
+                entry = NULL;
             }
 
-            if(entry->state == NST_DICT_ENTRY_STATE_INIT) {
-                ctx->rule = entry->rule;
-                ret = NST_CTX_STATE_WAIT;
+            if(entry) {
+
+                if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
+
+                    if(entry->store.ring.data) {
+                        ctx->store.ring.data = entry->store.ring.data;
+                        nst_ring_data_attach(&nuster.cache->store.ring, ctx->store.ring.data);
+                        ret = NST_CTX_STATE_HIT_MEMORY;
+                    } else if(entry->store.disk.file) {
+                        ctx->store.disk.file = entry->store.disk.file;
+                        ret = NST_CTX_STATE_HIT_DISK;
+                    }
+
+                    _nst_cache_hit_entry(ctx, entry);
+                }
+
+                if(entry->state == NST_DICT_ENTRY_STATE_INIT) {
+
+                    if(slot && _nst_cache_follow(ctx, entry) == NST_OK) {
+                        _nst_cache_hit_entry(ctx, entry);
+
+                        ret = NST_CTX_STATE_HIT_MEMORY;
+                    } else {
+
+                        /* NULL or of a new configuration, see nst_core_attach */
+                        if(entry->rule && nst_dict_owned(&nuster.cache->dict)) {
+                            ctx->rule = entry->rule;
+                        }
+
+                        ret = NST_CTX_STATE_WAIT;
+
+                        if(ctx->rule->wait >= 0) {
+                            _nst_cache_wait(&ctx->wait, key->hash);
+                        }
+                    }
+                }
             }
+
+            nst_dict_unlock(&nuster.cache->dict, key->hash);
         }
 
-        nst_shctx_unlock(&nuster.cache->dict);
+        if(slot) {
+            nst_epoch_leave(slot);
+        }
     }
 
     if(ret == NST_CTX_STATE_INIT) {
@@ -825,12 +1535,21 @@ nst_cache_exists(nst_ctx_t *ctx) {
             nst_key_disk_set_checked(key);
 
             if(ctx->store.disk.file) {
-                if(nst_disk_data_valid(&ctx->store.disk, key) != NST_OK) {
+                if(nst_disk_data_valid(&ctx->store.disk, key, stale) != NST_OK) {
                     ret = NST_CTX_STATE_INIT;
 
-                    if(entry && entry->state == NST_DICT_ENTRY_STATE_VALID) {
+                    /* the entry may have been released since the lookup */
+                    nst_dict_lock(&nuster.cache->dict, key->hash);
+
+                    if(entry && nst_dict_get(&nuster.cache->dict, key) == entry
+                            && entry->state == NST_DICT_ENTRY_STATE_VALID) {
+
                         entry->state = NST_DICT_ENTRY_STATE_INVALID;
+
+                        nst_dict_schedule(&nuster.cache->dict, entry);
                     }
+
+                    nst_dict_unlock(&nuster.cache->dict, key->hash);
                 }
             } else {
                 ret = NST_CTX_STATE_INIT;
@@ -877,8 +1596,29 @@ nst_cache_exists(nst_ctx_t *ctx) {
 
 void
 nst_cache_abort(nst_ctx_t *ctx) {
+    uint64_t  hash    = ctx->entry->key.hash;
+    int       refresh = 0;
+    int       init;
 
-    if(ctx->entry->state == NST_DICT_ENTRY_STATE_INIT) {
+    nst_dict_lock(&nuster.cache->dict, hash);
+
+    init = ctx->entry->state == NST_DICT_ENTRY_STATE_INIT;
+
+    /* no stream attaches to the data once it is invalid */
+    ctx->entry->store.ring.fill = NULL;
+    ctx->entry->state           = NST_DICT_ENTRY_STATE_INVALID;
+
+    if(ctx->refresh) {
+        refresh = 1;
+
+        _nst_cache_refresh_end(ctx, 1);
+    } else {
+        nst_dict_schedule(&nuster.cache->dict, ctx->entry);
+    }
+
+    nst_dict_unlock(&nuster.cache->dict, hash);
+
+    if(init) {
 
         if(ctx->store.ring.data) {
             nst_ring_store_abort(&nuster.cache->store.ring, ctx->store.ring.data);
@@ -889,7 +1629,12 @@ nst_cache_abort(nst_ctx_t *ctx) {
         }
     }
 
-    ctx->entry->state = NST_DICT_ENTRY_STATE_INVALID;
+    /* never linked, see nst_cache_create */
+    if(refresh) {
+        nst_dict_discard(&nuster.cache->dict, ctx->entry);
+    }
+
+    _nst_cache_wakeup(hash);
 }
 
 /*
@@ -902,7 +1647,7 @@ nst_cache_delete(nst_key_t *key) {
     nst_dict_entry_t  *entry = NULL;
     int                ret   = 1;
 
-    nst_shctx_lock(&nuster.cache->dict);
+    nst_dict_lock(&nuster.cache->dict, key->hash);
 
     entry = nst_dict_get(&nuster.cache->dict, key);
 
@@ -913,10 +1658,9 @@ nst_cache_delete(nst_key_t *key) {
             entry->expire = 0;
 
             if(entry->store.ring.data) {
-                entry->store.ring.data->invalid = 1;
-                entry->store.ring.data          = NULL;
+                nst_ring_data_invalidate(&nuster.cache->store.ring, entry->store.ring.data);
 
-                nst_ring_incr_invalid(&nuster.cache->store.ring);
+                entry->store.ring.data = NULL;
             }
 
             if(entry->store.disk.file) {
@@ -925,6 +1669,8 @@ nst_cache_delete(nst_key_t *key) {
                 entry->store.disk.file = NULL;
             }
 
+            nst_dict_schedule(&nuster.cache->dict, entry);
+
             ret = 1;
 
         }
@@ -932,7 +1678,7 @@ nst_cache_delete(nst_key_t *key) {
         ret = 0;
     }
 
-    nst_shctx_unlock(&nuster.cache->dict);
+    nst_dict_unlock(&nuster.cache->dict, key->hash);
 
     if(!nuster.cache->store.disk.loaded && global.nuster.cache.root.len){
         nst_disk_data_t  disk;
@@ -970,10 +1716,13 @@ nst_cache_hit(hpx_stream_t *s, hpx_stream_interface_t *si, hpx_channel_t *req, h
 
         appctx->st0 = ctx->state;
 
+        /* attached by nst_cache_exists */
         if(ctx->state == NST_CTX_STATE_HIT_MEMORY) {
-            nst_ring_data_attach(&nuster.cache->store.ring, ctx->store.ring.data);
             appctx->ctx.nuster.store.ring.data = ctx->store.ring.data;
-            appctx->ctx.nuster.store.ring.item = ctx->store.ring.data->item;
+
+            /* to wait on if the data is still being added */
+            appctx->ctx.nuster.store.ring.wait.node.key = ctx->keys[ctx->rule->key->idx].hash;
+            appctx->ctx.nuster.store.ring.wait.task     = appctx->t;
         } else {
             appctx->ctx.nuster.store.disk.fd     = ctx->store.disk.fd;
             appctx->ctx.nuster.store.disk.offset = nst_disk_get_header_pos(ctx->store.disk.meta);
@@ -1010,7 +1759,9 @@ nst_cache_build_etag(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
     if(http_find_header(htx, ist("ETag"), &hdr, 1)) {
         ctx->txn.res.etag.len = hdr.value.len;
 
-        chunk_istcat(ctx->txn.buf, hdr.value);
+        if(chunk_istcat(ctx->txn.buf, hdr.value)) {
+            ctx->txn.res.validator |= NST_HTTP_VALIDATOR_ETAG;
+        }
     } else {
         uint64_t t = get_current_timestamp();
 
@@ -1037,8 +1788,8 @@ nst_cache_build_last_modified(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *c
 
     if(http_find_header(htx, ist("Last-Modified"), &hdr, 1)) {
 
-        if(hdr.value.len == len) {
-            chunk_istcat(ctx->txn.buf, hdr.value);
+        if(hdr.value.len == len && chunk_istcat(ctx->txn.buf, hdr.value)) {
+            ctx->txn.res.validator |= NST_HTTP_VALIDATOR_LAST_MODIFIED;
         }
 
     } else {
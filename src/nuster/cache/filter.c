@@ -64,31 +64,14 @@ _nst_cache_filter_attach(hpx_stream_t *s, hpx_filter_t *filter) {
     nst_debug(s, "[cache] ===== attach =====");
 
     if(!filter->ctx) {
-        nst_ctx_t  *ctx;
-        int         rule_cnt, key_cnt, size;
-
-        rule_cnt = nuster.proxy[conf->pid]->rule_cnt;
-        key_cnt  = nuster.proxy[conf->pid]->key_cnt;
-
-        size = sizeof(nst_ctx_t) + key_cnt * sizeof(nst_key_t);
-
-        ctx = calloc(1, size);
+        nst_ctx_t  *ctx = nst_ctx_alloc(conf->pid);
 
         if(ctx == NULL) {
             return 0;
         }
 
-        ctx->state    = NST_CTX_STATE_INIT;
-        ctx->pid      = conf->pid;
-        ctx->ctime    = get_current_timestamp();
-        ctx->rule_cnt = rule_cnt;
-        ctx->key_cnt  = key_cnt;
-
-        if(nst_http_txn_attach(&ctx->txn) != NST_OK) {
-            free(ctx);
-
-            return 0;
-        }
+        ctx->ctime     = get_current_timestamp();
+        ctx->wait.task = s->task;
 
         filter->ctx = ctx;
     }
@@ -96,6 +79,9 @@ _nst_cache_filter_attach(hpx_stream_t *s, hpx_filter_t *filter) {
     register_data_filter(s, &s->req, filter);
     register_data_filter(s, &s->res, filter);
 
+    /* see _nst_cache_filter_pre_analyze */
+    filter->pre_analyzers |= AN_RES_WAIT_HTTP;
+
     return 1;
 }
 
@@ -104,9 +90,9 @@ _nst_cache_filter_detach(hpx_stream_t *s, hpx_filter_t *filter) {
 
     if(filter->ctx) {
         nst_ctx_t  *ctx = filter->ctx;
-        int         i;
 
-        nst_stats_update_cache(ctx->state, ctx->txn.res.payload_len + ctx->txn.res.header_len);
+        nst_stats_update_cache(ctx->state, ctx->txn.res.payload_len + ctx->txn.res.header_len,
+                ctx->arena.allocs);
 
         if(ctx->state == NST_CTX_STATE_HIT_MEMORY) {
             nst_ring_data_detach(&nuster.cache->store.ring, ctx->store.ring.data);
@@ -116,22 +102,55 @@ _nst_cache_filter_detach(hpx_stream_t *s, hpx_filter_t *filter) {
             nst_cache_abort(ctx);
         }
 
-        for(i = 0; i < ctx->key_cnt; i++) {
-            nst_key_t  key = ctx->keys[i];
-
-            if(key.data) {
-                free(key.data);
-            }
+        if(ctx->refresh) {
+            /* a server error, a response not cached or an abort, unless by the client */
+            nst_cache_refresh_end(ctx, (s->flags & SF_ERR_MASK) != SF_ERR_CLICL);
         }
 
-        nst_http_txn_detach(&ctx->txn);
+        nst_cache_wait_leave(&ctx->wait);
 
-        free(ctx);
+        nst_ctx_free(ctx);
     }
 
     nst_debug(s, "[cache] ===== detach =====");
 }
 
+/*
+ * The server sent no response to a refresh, the stale entry is served
+ * instead of the 502 or 504 http_wait_for_response would send.
+ */
+static int
+_nst_cache_filter_pre_analyze(hpx_stream_t *s, hpx_filter_t *filter, hpx_channel_t *chn,
+        unsigned int an_bit) {
+
+    nst_ctx_t  *ctx = filter->ctx;
+    hpx_htx_t  *htx = htxbuf(&chn->buf);
+
+    if(!ctx->refresh || !(htx_is_empty(htx) || htx->first == -1)) {
+        return 1;
+    }
+
+    if(!(chn->flags & (CF_READ_ERROR | CF_READ_TIMEOUT | CF_SHUTR))) {
+        return 1;
+    }
+
+    /* retried, or aborted by the client */
+    if(s->si[1].flags & SI_FL_L7_RETRY
+            || (s->req.flags & (CF_SHUTR | CF_SHUTW)) == (CF_SHUTR | CF_SHUTW)) {
+
+        return 1;
+    }
+
+    if(nst_cache_refresh_failed(s, ctx) == NST_OK) {
+        nst_debug(s, "[cache] Stale if error");
+
+        /* the response analysers are removed */
+        return 0;
+    }
+
+    return 1;
+}
+
 static int
 _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_msg_t *msg) {
     hpx_channel_t           *req = msg->chn;
@@ -149,6 +168,14 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
             ctx->state = NST_CTX_STATE_BYPASS;
         }
 
+        if(ctx->state == NST_CTX_STATE_INIT && ctx->wait.parked) {
+            /* woken up by the creator or by the timer */
+            nst_cache_wait_leave(&ctx->wait);
+
+            req->analyse_exp  = TICK_ETERNITY;
+            req->flags       &= ~CF_ANA_TIMEOUT;
+        }
+
         if(ctx->state == NST_CTX_STATE_INIT) {
             int  i = 0;
 
@@ -182,13 +209,12 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
                 if(!key->data) {
                     /* build key */
-                    if(nst_key_build(s, msg, ctx->rule, &ctx->txn, key, s->txn->meth) != NST_OK) {
+                    if(nst_key_build(s, msg, ctx->rule, &ctx->txn, &ctx->key_cache, key,
+                                s->txn->meth) != NST_OK) {
                         ctx->state = NST_CTX_STATE_BYPASS;
 
                         return 1;
                     }
-
-                    nst_key_hash(key);
                 }
 
                 nst_key_debug(s, key);
@@ -251,17 +277,31 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
             nst_cache_hit(s, si, req, res, ctx);
         }
 
+        if(ctx->state == NST_CTX_STATE_PASS && ctx->revalidate) {
+            nst_cache_revalidate(msg, ctx);
+        }
+
         if(ctx->state == NST_CTX_STATE_WAIT) {
+            uint64_t  elapsed = get_current_timestamp() - ctx->ctime;
+
             if(ctx->rule->wait == 0 || (ctx->rule->wait > 0
-                        && get_current_timestamp() - ctx->ctime < ctx->rule->wait * 1000)) {
+                        && elapsed < ctx->rule->wait * 1000)) {
 
-                usleep(1);
-                ctx->state = NST_CTX_STATE_INIT;
+                uint64_t  timeout = global.nbproc > 1
+                    ? NST_CACHE_WAIT_POLL_NBPROC : NST_CACHE_WAIT_POLL;
 
-                task_wakeup(s->task, TASK_WOKEN_MSG);
+                if(ctx->rule->wait > 0 && ctx->rule->wait * 1000 - elapsed < timeout) {
+                    timeout = ctx->rule->wait * 1000 - elapsed;
+                }
+
+                /* sleep until the creator wakes us up or the timer expires */
+                ctx->state       = NST_CTX_STATE_INIT;
+                req->analyse_exp = tick_add(now_ms, timeout);
 
                 return 0;
             }
+
+            nst_cache_wait_leave(&ctx->wait);
         }
 
     } else {
@@ -290,6 +330,22 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
         }
 
+        if(ctx->state == NST_CTX_STATE_PASS && ctx->revalidate && ctx->refresh
+                && s->txn->status == 304) {
+
+            nst_debug(s, "[cache] Revalidated");
+
+            nst_cache_revalidated(s, ctx);
+
+            return 1;
+        }
+
+        if(ctx->refresh && s->txn->status >= 500 && nst_cache_refresh_failed(s, ctx) == NST_OK) {
+            nst_debug(s, "[cache] Stale if error");
+
+            return 1;
+        }
+
         if(ctx->state == NST_CTX_STATE_PASS) {
             nst_rule_code_t  *cc    = ctx->rule->code;
             int               valid = 0;
@@ -378,6 +434,9 @@ hpx_flt_ops_t nst_cache_filter_ops = {
     .attach = _nst_cache_filter_attach,
     .detach = _nst_cache_filter_detach,
 
+    /* Handle channels activity */
+    .channel_pre_analyze = _nst_cache_filter_pre_analyze,
+
     /* Filter HTTP requests and responses */
     .http_headers = _nst_cache_filter_http_headers,
     .http_payload = _nst_cache_filter_http_payload,
@@ -14,132 +14,988 @@
 
 #include <nuster/nuster.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static inline int
+_nst_dict_entry_match(nst_dict_entry_t *entry, nst_key_t *key) {
+
+    return entry->key.hash == key->hash && entry->key.size == key->size && entry->key.data
+        && !memcmp(entry->key.data, key->data, key->size);
+}
+
+
+/*
+ * chain engine
+ * size buckets of singly linked entries, bucket is hash % size
+ */
+
+static nst_dict_entry_t *
+_nst_dict_chain_lookup(void *table, uint64_t size, nst_key_t *key) {
+    nst_dict_entry_t  *entry = ((nst_dict_entry_t **)table)[key->hash % size];
+
+    while(entry) {
+
+        if(_nst_dict_entry_match(entry, key)) {
+            return entry;
+        }
+
+        entry = entry->next;
+    }
+
+    return NULL;
+}
+
+static int
+_nst_dict_chain_insert(void *table, uint64_t size, nst_dict_entry_t *entry) {
+    nst_dict_entry_t  **bucket = &((nst_dict_entry_t **)table)[entry->key.hash % size];
+
+    /* prepend entry to the bucket, lock-free readers must see next first */
+    entry->next = *bucket;
+
+    __sync_synchronize();
+
+    *bucket     = entry;
+
+    return NST_OK;
+}
+
+static int
+_nst_dict_chain_remove(void *table, uint64_t size, nst_dict_entry_t *entry) {
+    nst_dict_entry_t  **prev = &((nst_dict_entry_t **)table)[entry->key.hash % size];
+
+    while(*prev) {
+
+        if(*prev == entry) {
+            *prev = entry->next;
+
+            return NST_OK;
+        }
+
+        prev = &(*prev)->next;
+    }
+
+    return NST_ERR;
+}
+
+static int
+_nst_dict_chain_walk(nst_dict_t *dict, void *table, uint64_t idx, int old,
+        nst_dict_walk_cb cb, void *data) {
+
+    nst_dict_entry_t  **prev = &((nst_dict_entry_t **)table)[idx];
+    nst_dict_entry_t   *entry, *next;
+    int                 ret;
+
+    while((entry = *prev) != NULL) {
+        next = entry->next;
+        ret  = cb(dict, entry, data);
+
+        if(ret & NST_DICT_WALK_REMOVE) {
+            *prev = next;
+        } else {
+            prev  = &entry->next;
+        }
+
+        if(ret & NST_DICT_WALK_STOP) {
+            return *prev ? NST_ERR : NST_OK;
+        }
+    }
+
+    return NST_OK;
+}
+
+
+/*
+ * swiss engine
+ * size groups, size is a power of 2, the first probed group is
+ * hash & (size - 1), then the groups at triangular multiples of
+ * NST_DICT_STRIPES, which visits every group of the stripe.
+ */
+
+static inline uint8_t
+_nst_dict_swiss_h2(uint64_t hash) {
+    return hash >> 57;
+}
+
+/* bitmask of the slots whose control byte equals h */
+static inline uint32_t
+_nst_dict_group_match(nst_dict_group_t *group, uint8_t h) {
+#if defined(__SSE2__)
+    __m128i  ctrl = _mm_loadu_si128((const __m128i *)group->ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h)));
+#else
+    uint32_t  mask = 0;
+    int       i;
+
+    for(i = 0; i < NST_DICT_GROUP_SLOTS; i++) {
+
+        if(group->ctrl[i] == h) {
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+#endif
+}
+
+/* bitmask of the empty or deleted slots */
+static inline uint32_t
+_nst_dict_group_match_free(nst_dict_group_t *group) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group->ctrl));
+#else
+    uint32_t  mask = 0;
+    int       i;
+
+    for(i = 0; i < NST_DICT_GROUP_SLOTS; i++) {
+
+        if(group->ctrl[i] & 0x80) {
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+#endif
+}
+
+static nst_dict_entry_t *
+_nst_dict_swiss_lookup(void *table, uint64_t size, nst_key_t *key) {
+    nst_dict_entry_t  *entry;
+    nst_dict_group_t  *group;
+    uint64_t           idx  = key->hash & (size - 1);
+    uint64_t           i, n = size / NST_DICT_STRIPES;
+    uint32_t           mask;
+    uint8_t            h2   = _nst_dict_swiss_h2(key->hash);
+    int                slot;
+
+    for(i = 0; i < n; i++) {
+        group = (nst_dict_group_t *)table + idx;
+        mask  = _nst_dict_group_match(group, h2);
+
+        while(mask) {
+            slot  = __builtin_ctz(mask);
+            mask &= mask - 1;
+            entry = group->entry[slot];
+
+            /* cleared under a lock-free reader */
+            if(entry && _nst_dict_entry_match(entry, key)) {
+                return entry;
+            }
+        }
+
+        /* an empty slot ends the probe sequence */
+        if(_nst_dict_group_match(group, NST_DICT_CTRL_EMPTY)) {
+            return NULL;
+        }
+
+        idx = (idx + NST_DICT_STRIPES * (i + 1)) & (size - 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * return NST_OK if a deleted slot was reused
+ */
+static int
+_nst_dict_swiss_insert(void *table, uint64_t size, nst_dict_entry_t *entry, int *reused) {
+    nst_dict_group_t  *group;
+    uint64_t           idx  = entry->key.hash & (size - 1);
+    uint64_t           i, n = size / NST_DICT_STRIPES;
+    uint32_t           mask;
+    int                slot;
+
+    for(i = 0; i < n; i++) {
+        group = (nst_dict_group_t *)table + idx;
+        mask  = _nst_dict_group_match_free(group);
+
+        if(mask) {
+            slot    = __builtin_ctz(mask);
+            *reused = group->ctrl[slot] == NST_DICT_CTRL_DELETED;
+
+            group->entry[slot] = entry;
+
+            __sync_synchronize();
+
+            group->ctrl[slot]  = _nst_dict_swiss_h2(entry->key.hash);
+
+            return NST_OK;
+        }
+
+        idx = (idx + NST_DICT_STRIPES * (i + 1)) & (size - 1);
+    }
+
+    return NST_ERR;
+}
+
+/*
+ * old is set for the table being migrated, deleted slots must
+ * stay deleted there so that lookups keep probing through them.
+ */
+static void
+_nst_dict_swiss_clear(nst_dict_t *dict, nst_dict_group_t *group, int slot, int old) {
+    group->entry[slot] = NULL;
+
+    /* no probe sequence went past a group with an empty slot */
+    if(!old && _nst_dict_group_match(group, NST_DICT_CTRL_EMPTY)) {
+        group->ctrl[slot] = NST_DICT_CTRL_EMPTY;
+    } else {
+        group->ctrl[slot] = NST_DICT_CTRL_DELETED;
+
+        if(!old) {
+            __sync_add_and_fetch(&dict->deleted, 1);
+        }
+    }
+}
+
+static int
+_nst_dict_swiss_remove(nst_dict_t *dict, void *table, uint64_t size, int old,
+        nst_dict_entry_t *entry) {
+
+    nst_dict_group_t  *group;
+    uint64_t           idx  = entry->key.hash & (size - 1);
+    uint64_t           i, n = size / NST_DICT_STRIPES;
+    uint32_t           mask;
+    uint8_t            h2   = _nst_dict_swiss_h2(entry->key.hash);
+    int                slot;
+
+    for(i = 0; i < n; i++) {
+        group = (nst_dict_group_t *)table + idx;
+        mask  = _nst_dict_group_match(group, h2);
+
+        while(mask) {
+            slot  = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            if(group->entry[slot] == entry) {
+                _nst_dict_swiss_clear(dict, group, slot, old);
+
+                return NST_OK;
+            }
+        }
+
+        if(_nst_dict_group_match(group, NST_DICT_CTRL_EMPTY)) {
+            return NST_ERR;
+        }
+
+        idx = (idx + NST_DICT_STRIPES * (i + 1)) & (size - 1);
+    }
+
+    return NST_ERR;
+}
+
+static int
+_nst_dict_swiss_walk(nst_dict_t *dict, void *table, uint64_t idx, int old,
+        nst_dict_walk_cb cb, void *data) {
+
+    nst_dict_group_t  *group = (nst_dict_group_t *)table + idx;
+    int                slot, ret;
+
+    for(slot = 0; slot < NST_DICT_GROUP_SLOTS; slot++) {
+
+        if(group->ctrl[slot] & 0x80) {
+            continue;
+        }
+
+        ret = cb(dict, group->entry[slot], data);
+
+        if(ret & NST_DICT_WALK_REMOVE) {
+            _nst_dict_swiss_clear(dict, group, slot, old);
+        }
+
+        if(ret & NST_DICT_WALK_STOP) {
+            return slot == NST_DICT_GROUP_SLOTS - 1 ? NST_OK : NST_ERR;
+        }
+    }
+
+    return NST_OK;
+}
+
+
+/*
+ * engine dispatch
+ */
+
+static void *
+_nst_dict_alloc_table(nst_dict_t *dict, uint64_t size) {
+    nst_dict_group_t  *group;
+    void              *table;
+    uint64_t           bytes, i;
+
+    if(dict->engine == NST_DICT_ENGINE_SWISS) {
+        bytes = size * sizeof(nst_dict_group_t);
+    } else {
+        bytes = size * sizeof(nst_dict_entry_t *);
+    }
+
+    /* empty chain buckets are NULL, fresh memory is not written */
+    if(dict->engine != NST_DICT_ENGINE_SWISS) {
+        return nst_memory_calloc(dict->memory, bytes);
+    }
+
+    table = nst_memory_alloc(dict->memory, bytes);
+
+    if(!table) {
+        return NULL;
+    }
+
+    for(i = 0; i < size; i++) {
+        group = (nst_dict_group_t *)table + i;
+
+        memset(group->ctrl, NST_DICT_CTRL_EMPTY, NST_DICT_GROUP_SLOTS);
+        memset(group->entry, 0, sizeof(group->entry));
+    }
+
+    return table;
+}
+
+/*
+ * the number of entries the table of size can hold before growing
+ */
+static uint64_t
+_nst_dict_capacity(nst_dict_t *dict, uint64_t size) {
+
+    if(dict->engine == NST_DICT_ENGINE_SWISS) {
+        return size * NST_DICT_GROUP_SLOTS / 4 * 3;
+    }
+
+    return size;
+}
+
+static nst_dict_entry_t *
+_nst_dict_table_lookup(nst_dict_t *dict, void *table, uint64_t size, nst_key_t *key) {
+
+    if(dict->engine == NST_DICT_ENGINE_SWISS) {
+        return _nst_dict_swiss_lookup(table, size, key);
+    }
+
+    return _nst_dict_chain_lookup(table, size, key);
+}
+
+static int
+_nst_dict_table_insert(nst_dict_t *dict, void *table, uint64_t size, nst_dict_entry_t *entry) {
+    int  reused = 0;
+
+    if(dict->engine == NST_DICT_ENGINE_SWISS) {
+
+        if(_nst_dict_swiss_insert(table, size, entry, &reused) != NST_OK) {
+            return NST_ERR;
+        }
+
+        if(reused && table == dict->table) {
+            __sync_sub_and_fetch(&dict->deleted, 1);
+        }
+
+        return NST_OK;
+    }
+
+    return _nst_dict_chain_insert(table, size, entry);
+}
+
+static int
+_nst_dict_table_remove(nst_dict_t *dict, void *table, uint64_t size, nst_dict_entry_t *entry) {
+    int  old = table != dict->table;
+
+    if(dict->engine == NST_DICT_ENGINE_SWISS) {
+        return _nst_dict_swiss_remove(dict, table, size, old, entry);
+    }
+
+    return _nst_dict_chain_remove(table, size, entry);
+}
+
+static int
+_nst_dict_table_walk(nst_dict_t *dict, void *table, uint64_t idx, nst_dict_walk_cb cb, void *data) {
+    int  old = table != dict->table;
+
+    if(dict->engine == NST_DICT_ENGINE_SWISS) {
+        return _nst_dict_swiss_walk(dict, table, idx, old, cb, data);
+    }
+
+    return _nst_dict_chain_walk(dict, table, idx, old, cb, data);
+}
+
+
+int
+nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_memory_t *memory, uint64_t dict_size,
+        int engine, nst_epoch_t *epoch) {
+
+    uint64_t  block_size = memory->block_size;
+    uint64_t  size       = (block_size + dict_size - 1) / block_size * block_size;
+    int       i;
+
+    dict->memory   = memory;
+    dict->engine   = engine;
+    dict->used     = 0;
+    dict->deleted  = 0;
+    dict->gen      = 0;
+    dict->store    = store;
+    dict->epoch    = epoch;
+
+    dict->cleanup_idx = 0;
+
+    memset(&dict->retired, 0, sizeof(dict->retired));
+
+    if(engine == NST_DICT_ENGINE_SWISS) {
+        /* the largest power of 2 groups fitting in dict-size */
+        dict->size = NST_DICT_STRIPES;
+
+        while(dict->size * 2 * sizeof(nst_dict_group_t) <= size) {
+            dict->size *= 2;
+        }
+    } else {
+        dict->size = size / sizeof(nst_dict_entry_t *);
+    }
+
+    dict->min_size = dict->size;
+    dict->table    = _nst_dict_alloc_table(dict, dict->size);
+
+    dict->rehash.table = NULL;
+    dict->rehash.size  = 0;
+    dict->rehash.idx   = 0;
+
+    memset(&dict->evict, 0, sizeof(dict->evict));
+
+    if(!dict->table) {
+        return NST_ERR;
+    }
+
+    dict->stripe = nst_memory_alloc(memory, sizeof(nst_dict_stripe_t) * NST_DICT_STRIPES);
+
+    if(!dict->stripe) {
+        return NST_ERR;
+    }
+
+    for(i = 0; i < NST_DICT_STRIPES; i++) {
+        dict->stripe[i].exp = EB_ROOT;
+    }
+
+    return nst_dict_lock_init(dict);
+}
+
+/*
+ * Also called on a memory attached after a process was killed, which may
+ * have left a stripe locked.
+ */
+int
+nst_dict_lock_init(nst_dict_t *dict) {
+    int  i;
+
+    for(i = 0; i < NST_DICT_STRIPES; i++) {
+
+        if(nst_shctx_init(&dict->stripe[i]) != NST_OK) {
+            return NST_ERR;
+        }
+    }
+
+    return NST_OK;
+}
+
+static void
+_nst_dict_lock_all(nst_dict_t *dict) {
+    int  i;
+
+    for(i = 0; i < NST_DICT_STRIPES; i++) {
+        nst_dict_lock(dict, i);
+    }
+}
+
+static void
+_nst_dict_unlock_all(nst_dict_t *dict) {
+    int  i;
+
+    for(i = 0; i < NST_DICT_STRIPES; i++) {
+        nst_dict_unlock(dict, i);
+    }
+}
+
+/*
+ * gen is odd while the tables are swapped, so that lock-free readers
+ * can tell they read a consistent table and size.
+ */
+static inline void
+_nst_dict_gen_begin(nst_dict_t *dict) {
+    dict->gen++;
+
+    __sync_synchronize();
+}
+
+static inline void
+_nst_dict_gen_end(nst_dict_t *dict) {
+    __sync_synchronize();
+
+    dict->gen++;
+}
+
+static int
+_nst_dict_rehash_entry(nst_dict_t *dict, nst_dict_entry_t *entry, void *data) {
+
+    /* keep it in the old table, the bucket will be retried */
+    if(_nst_dict_table_insert(dict, dict->table, dict->size, entry) != NST_OK) {
+        *(int *)data = NST_ERR;
+
+        return NST_DICT_WALK_NEXT;
+    }
+
+    return NST_DICT_WALK_REMOVE;
+}
+
+/*
+ * Start a resize if the load factor is out of range, or move
+ * NST_DICT_REHASH_BUCKETS buckets of the old table to the new one.
+ * Only called by master housekeeping.
+ *
+ * All entries of old bucket i and the buckets they move to are protected
+ * by the same stripe, since both sizes are multiples of NST_DICT_STRIPES,
+ * so all stripes are only locked to swap tables.
+ */
+void
+nst_dict_rehash(nst_dict_t *dict) {
+    void      *table;
+    uint64_t   size, capacity, idx;
+    int        n, ret;
+
+    if(!nst_dict_rehashing(dict)) {
+        capacity = _nst_dict_capacity(dict, dict->size);
+        size     = 0;
+
+        if(dict->used + dict->deleted >= capacity) {
+            size = dict->size * 2;
+
+            /* mostly deleted slots, rebuild with the same size */
+            if(dict->used < capacity / 2) {
+                size = dict->size;
+            }
+        } else if(dict->size > dict->min_size
+                && dict->used < capacity / NST_DICT_LOAD_FACTOR_SHRINK) {
+
+            size = dict->size / 2;
+        }
+
+        /* the previous table is not freed yet */
+        if(size == 0 || dict->retired.table) {
+            return;
+        }
+
+        /* keep the current table if no memory */
+        table = _nst_dict_alloc_table(dict, size);
+
+        if(!table) {
+            return;
+        }
+
+        _nst_dict_lock_all(dict);
+
+        _nst_dict_gen_begin(dict);
+
+        dict->rehash.table = dict->table;
+        dict->rehash.size  = dict->size;
+        dict->rehash.idx   = 0;
+
+        dict->table        = table;
+        dict->size         = size;
+        dict->deleted      = 0;
+        dict->sync_idx     = 0;
+        dict->evict.idx    = 0;
+
+        _nst_dict_gen_end(dict);
+
+        _nst_dict_unlock_all(dict);
+
+        return;
+    }
+
+    n = NST_DICT_REHASH_BUCKETS;
+
+    while(n-- && dict->rehash.idx < dict->rehash.size) {
+        idx = dict->rehash.idx;
+        ret = NST_OK;
+
+        nst_dict_lock(dict, idx);
+
+        _nst_dict_table_walk(dict, dict->rehash.table, idx, _nst_dict_rehash_entry, &ret);
+
+        nst_dict_unlock(dict, idx);
+
+        if(ret != NST_OK) {
+            break;
+        }
+
+        dict->rehash.idx++;
+    }
+
+    if(dict->rehash.idx == dict->rehash.size) {
+        _nst_dict_lock_all(dict);
+
+        _nst_dict_gen_begin(dict);
+
+        table = dict->rehash.table;
+
+        dict->rehash.table = NULL;
+        dict->rehash.size  = 0;
+        dict->rehash.idx   = 0;
+        dict->sync_idx     = 0;
+        dict->evict.idx    = 0;
+
+        _nst_dict_gen_end(dict);
+
+        _nst_dict_unlock_all(dict);
+
+        dict->retired.table = table;
+        dict->retired.epoch = dict->epoch->global;
+    }
+}
+
+/*
+ * Call cb on every entry of bucket idx in [0, nst_dict_walk_size()),
+ * caller must hold nst_dict_lock(dict, idx).
+ * Return NST_OK if the whole bucket has been walked.
+ */
 int
-nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_memory_t *memory, uint64_t dict_size) {
+nst_dict_walk(nst_dict_t *dict, uint64_t idx, nst_dict_walk_cb cb, void *data) {
+
+    if(idx < dict->rehash.size) {
+        return _nst_dict_table_walk(dict, dict->rehash.table, idx, cb, data);
+    }
+
+    return _nst_dict_table_walk(dict, dict->table, idx - dict->rehash.size, cb, data);
+}
+
+/*
+ * Find the entry of key in the current table,
+ * and in the old one if resizing.
+ */
+static nst_dict_entry_t *
+_nst_dict_lookup(nst_dict_t *dict, nst_key_t *key) {
+    nst_dict_entry_t  *entry;
+
+    entry = _nst_dict_table_lookup(dict, dict->table, dict->size, key);
+
+    if(entry || !nst_dict_rehashing(dict)) {
+        return entry;
+    }
+
+    return _nst_dict_table_lookup(dict, dict->rehash.table, dict->rehash.size, key);
+}
+
+/*
+ * Unlink entry from the current table, or from the old one if resizing.
+ */
+static void
+_nst_dict_remove(nst_dict_t *dict, nst_dict_entry_t *entry) {
 
-    int  block_size = memory->block_size;
-    int  entry_size = sizeof(nst_dict_entry_t *);
-    int  size       = (block_size + dict_size - 1) / block_size * block_size;
-    int  i;
+    if(_nst_dict_table_remove(dict, dict->table, dict->size, entry) == NST_OK
+            || !nst_dict_rehashing(dict)) {
+
+        return;
+    }
 
-    dict->memory = memory;
-    dict->size   = size / entry_size;
-    dict->used   = 0;
-    dict->entry  = nst_memory_alloc(memory, block_size);
-    dict->store  = store;
+    _nst_dict_table_remove(dict, dict->rehash.table, dict->rehash.size, entry);
+}
 
-    if(!dict->entry) {
-        return NST_ERR;
+/*
+ * Release an entry removed from the table, its ring data is left to
+ * nst_ring_cleanup, and its memory to nst_dict_reclaim once no lock-free
+ * reader can hold it anymore.
+ */
+static void
+_nst_dict_entry_free(nst_dict_t *dict, nst_dict_entry_t *entry) {
+    int  n = nst_epoch_retire_list(dict->epoch);
+
+    eb64_delete(&entry->exp);
+
+    entry->state = NST_DICT_ENTRY_STATE_INVALID;
+
+    if(entry->store.ring.data) {
+        nst_ring_data_invalidate(&dict->store->ring, entry->store.ring.data);
+
+        entry->store.ring.data = NULL;
     }
 
-    for(i = 1; i < size / block_size; i++) {
+    entry->retired         = dict->retired.entry[n];
+    dict->retired.entry[n] = entry;
 
-        if(!nst_memory_alloc(memory, block_size)) {
-            return NST_ERR;
+    nst_dict_decr_used(dict);
+}
+
+/*
+ * free the entries retired two epochs ago, and the old table.
+ * Only called by master housekeeping.
+ */
+void
+nst_dict_reclaim(nst_dict_t *dict) {
+    nst_dict_entry_t  *entry, *next;
+    int                n = nst_epoch_reclaim_list(dict->epoch);
+
+    entry = dict->retired.entry[n];
+
+    dict->retired.entry[n] = NULL;
+
+    while(entry) {
+        next = entry->retired;
+
+        if(entry->store.disk.file) {
+            nst_memory_free(dict->memory, entry->store.disk.file);
         }
-    }
 
-    for(i = 0; i < dict->size; i++) {
-        dict->entry[i] = NULL;
+        nst_memory_free(dict->memory, entry->buf.area);
+        nst_memory_free(dict->memory, entry->key.data);
+        nst_memory_free(dict->memory, entry);
+
+        entry = next;
     }
 
-    return nst_shctx_init(dict);
+    if(dict->retired.table && dict->epoch->global >= dict->retired.epoch + 2) {
+        nst_memory_free(dict->memory, dict->retired.table);
+
+        dict->retired.table = NULL;
+    }
 }
 
 /*
- * Check entry validity, free the entry if its invalid,
+ * (Re)schedule entry in the expiry tree of its stripe: invalid entries
+ * right away, valid ones once expired and past the extend and stale windows.
+ * Entries being created and entries without ttl are not scheduled.
+ * caller must hold nst_dict_lock(dict, entry->key.hash)
  */
 void
+nst_dict_schedule(nst_dict_t *dict, nst_dict_entry_t *entry) {
+    uint64_t  key;
+
+    eb64_delete(&entry->exp);
+
+    if(entry->state == NST_DICT_ENTRY_STATE_INVALID) {
+        key = 0;
+    } else if(entry->state == NST_DICT_ENTRY_STATE_VALID && entry->expire) {
+        key = entry->expire;
+
+        if(entry->extend[0] != 0xFF) {
+            key += (entry->ttl * entry->extend[3] + 99) / 100;
+        }
+
+        if(nst_dict_entry_stale_end(entry) > key) {
+            key = nst_dict_entry_stale_end(entry);
+        }
+    } else {
+        return;
+    }
+
+    entry->exp.key = key;
+
+    eb64_insert(&nst_dict_stripe(dict, entry->key.hash)->exp, &entry->exp);
+}
+
+/*
+ * Pop one entry due in the expiry trees, starting from the stripe of
+ * cleanup_idx, and free it if it is invalid. Entries that are still
+ * valid have been updated and will be scheduled again.
+ * Return NST_ERR if no entry is due.
+ */
+int
 nst_dict_cleanup(nst_dict_t *dict) {
     nst_dict_entry_t  *entry;
-    nst_dict_entry_t  *prev;
-    uint64_t           start;
+    struct eb64_node  *node;
+    uint64_t           now, idx;
+    int                i;
 
     if(!dict->used) {
-        return;
+        return NST_ERR;
     }
 
-    start  = get_current_timestamp();
+    now = get_current_timestamp() / 1000;
 
-    nst_shctx_lock(dict);
+    for(i = 0; i < NST_DICT_STRIPES; i++) {
+        idx = dict->cleanup_idx;
 
-    entry = dict->entry[dict->cleanup_idx];
-    prev  = entry;
+        nst_dict_lock(dict, idx);
 
-    while(entry) {
+        node = eb64_first(&nst_dict_stripe(dict, idx)->exp);
 
-        if(nst_dict_entry_invalid(entry)) {
-            nst_dict_entry_t  *tmp = entry;
+        if(node && node->key <= now) {
+            entry = eb64_entry(node, nst_dict_entry_t, exp);
 
-            if(entry->store.ring.data) {
-                entry->store.ring.data->invalid = 1;
-                entry->store.ring.data = NULL;
+            eb64_delete(node);
 
-                nst_ring_incr_invalid(&dict->store->ring);
+            if(nst_dict_entry_invalid(entry)) {
+                _nst_dict_remove(dict, entry);
+                _nst_dict_entry_free(dict, entry);
             }
 
-            if(entry->store.disk.file) {
-                nst_memory_free(dict->memory, entry->store.disk.file);
-                entry->store.disk.file = NULL;
-            }
+            nst_dict_unlock(dict, idx);
 
-            if(prev == entry) {
-                dict->entry[dict->cleanup_idx] = entry->next;
-                prev = entry->next;
-            } else {
-                prev->next = entry->next;
-            }
+            return NST_OK;
+        }
 
-            entry = entry->next;
+        nst_dict_unlock(dict, idx);
 
-            nst_memory_free(dict->memory, tmp->buf.area);
-            nst_memory_free(dict->memory, tmp->key.data);
-            nst_memory_free(dict->memory, tmp);
+        dict->cleanup_idx = (idx + 1) & (NST_DICT_STRIPES - 1);
+    }
 
-            dict->used--;
-        } else {
-            prev  = entry;
-            entry = entry->next;
-        }
+    return NST_ERR;
+}
 
-        if(get_current_timestamp() - start >= 10) {
-            break;
-        }
+void
+nst_dict_evict_init(nst_dict_t *dict, int policy, int high, int low) {
+    dict->evict.policy = policy;
+    dict->evict.high   = dict->memory->size / 100 * high;
+    dict->evict.low    = dict->memory->size / 100 * low;
+}
+
+typedef struct nst_dict_evict_ctx {
+    uint64_t                    start;
+    uint64_t                    need;           /* bytes to release */
+    uint64_t                    freed;
+} nst_dict_evict_ctx_t;
+
+static int
+_nst_dict_evict_entry(nst_dict_t *dict, nst_dict_entry_t *entry, void *data) {
+    nst_dict_evict_ctx_t  *ctx  = data;
+    nst_ring_data_t       *ring = entry->store.ring.data;
+    int                    ret  = NST_DICT_WALK_NEXT;
+
+    /* being created or updated, or still read by a client */
+    if(entry->state != NST_DICT_ENTRY_STATE_VALID || (ring && ring->clients)) {
+        goto next;
+    }
+
+    if(entry->freq) {
+        entry->freq--;
+
+        goto next;
+    }
+
+    if(ring && entry->store.disk.file) {
+        /* keep the entry, it is served from disk from now on */
+        nst_ring_data_invalidate(&dict->store->ring, ring);
+
+        entry->store.ring.data = NULL;
+
+        ctx->freed += ring->size;
+    } else {
+        ctx->freed += sizeof(*entry) + entry->key.size + entry->buf.size;
+        ctx->freed += ring ? ring->size : 0;
+
+        _nst_dict_entry_free(dict, entry);
+
+        ret = NST_DICT_WALK_REMOVE;
+    }
+
+    dict->evict.count++;
+
+next:
+
+    if(ctx->freed >= ctx->need || get_current_timestamp() - ctx->start >= 10) {
+        ret |= NST_DICT_WALK_STOP;
+    }
+
+    return ret;
+}
+
+/*
+ * Once memory used reaches the high watermark, move the clock hand over
+ * the dict and evict entries until the low watermark is reached.
+ * The memory of evicted ring data is released by nst_ring_cleanup,
+ * so the caller should run it over the whole ring when this returns
+ * a positive number.
+ * Only called by master housekeeping.
+ */
+int
+nst_dict_evict(nst_dict_t *dict) {
+    nst_dict_evict_ctx_t  ctx;
+    uint64_t              used, failed, count, n;
+    int                   pressure, ret;
+
+    if(dict->evict.policy == NST_DICT_EVICT_OFF || !dict->used) {
+        return 0;
+    }
+
+    used     = dict->memory->used;
+    failed   = dict->memory->failed;
+    pressure = 0;
+
+    /*
+     * allocations can fail below the high watermark when free chunks
+     * are spread over blocks of other sizes, release at least the
+     * room between the watermarks then.
+     */
+    if(failed != dict->evict.failed) {
+        dict->evict.failed = failed;
+        pressure           = 1;
+    }
+
+    if(used >= dict->evict.high) {
+        dict->evict.active = 1;
+    }
+
+    if(!dict->evict.active && !pressure) {
+        return 0;
+    }
+
+    ctx.start = get_current_timestamp();
+    ctx.need  = used > dict->evict.low ? used - dict->evict.low : 0;
+    ctx.freed = 0;
+
+    if(pressure && ctx.need < dict->evict.high - dict->evict.low) {
+        ctx.need = dict->evict.high - dict->evict.low;
     }
 
-    if(entry == NULL) {
-        dict->cleanup_idx++;
+    if(ctx.need == 0) {
+        dict->evict.active = 0;
+
+        return 0;
     }
 
-    /* if we have checked the whole dict */
-    if(dict->cleanup_idx == dict->size) {
-        dict->cleanup_idx = 0;
+    dict->evict.active = 1;
+
+    count = dict->evict.count;
+
+    /* every freq reaches 0 after NST_DICT_EVICT_FREQ_MAX + 1 turns */
+    n = nst_dict_walk_size(dict) * (NST_DICT_EVICT_FREQ_MAX + 1);
+
+    while(n--) {
+        nst_dict_lock(dict, dict->evict.idx);
+
+        ret = nst_dict_walk(dict, dict->evict.idx, _nst_dict_evict_entry, &ctx);
+
+        nst_dict_unlock(dict, dict->evict.idx);
+
+        if(ret == NST_OK) {
+            dict->evict.idx++;
+        }
+
+        if(dict->evict.idx >= nst_dict_walk_size(dict)) {
+            dict->evict.idx = 0;
+        }
+
+        if(ctx.freed >= ctx.need) {
+            dict->evict.active = 0;
+
+            break;
+        }
+
+        if(get_current_timestamp() - ctx.start >= 10) {
+            break;
+        }
     }
 
-    nst_shctx_unlock(dict);
+    return dict->evict.count - count;
 }
 
-nst_dict_entry_t *
-nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_t *rule, int pid) {
+static nst_dict_entry_t *
+_nst_dict_entry_new(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_t *rule,
+        int pid) {
 
     nst_dict_entry_t  *entry = NULL;
-    int                idx;
 
     entry = nst_memory_alloc(dict->memory, sizeof(*entry));
 
     if(!entry) {
-        goto err;
+        return NULL;
     }
 
     memset(entry, 0, sizeof(*entry));
 
-    idx = key->hash % dict->size;
-
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
-
     /* init entry */
     entry->state = NST_DICT_ENTRY_STATE_INIT;
 
@@ -153,7 +1009,6 @@ nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_t *
     }
 
     memcpy(entry->key.data, key->data, key->size);
-    memcpy(entry->key.uuid, key->uuid, 20);
 
     /* set buf */
     entry->buf.size = txn->buf->data;
@@ -174,7 +1029,9 @@ nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_t *
     entry->etag.len          = txn->res.etag.len;
     entry->last_modified.ptr = entry->buf.area + (txn->res.last_modified.ptr - txn->buf->area);
     entry->last_modified.len = txn->res.last_modified.len;
+    entry->validator         = txn->res.validator;
     entry->rule              = rule;
+    entry->rule_uuid         = rule->uuid;
     entry->expire            = 0;
     entry->pid               = pid;
     entry->ttl               = rule->ttl;
@@ -182,135 +1039,289 @@ nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_t *
     entry->extend[1]         = rule->extend[1];
     entry->extend[2]         = rule->extend[2];
     entry->extend[3]         = rule->extend[3];
+    entry->stale.revalidate  = rule->stale.revalidate;
+    entry->stale.error       = rule->stale.error;
 
     return entry;
 
 err:
+    nst_dict_discard(dict, entry);
 
-    if(entry) {
-        entry->state = NST_DICT_ENTRY_STATE_INVALID;
+    return NULL;
+}
+
+nst_dict_entry_t *
+nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_t *rule, int pid) {
+    nst_dict_entry_t  *entry;
+
+    if(!nst_dict_owned(dict)) {
+        return NULL;
     }
 
-    return NULL;
+    entry = _nst_dict_entry_new(dict, key, txn, rule, pid);
+
+    if(!entry) {
+        return NULL;
+    }
+
+    if(_nst_dict_table_insert(dict, dict->table, dict->size, entry) != NST_OK) {
+        nst_dict_discard(dict, entry);
+
+        return NULL;
+    }
+
+    nst_dict_incr_used(dict);
+
+    return entry;
+}
+
+/*
+ * Create an entry which is not linked in the table, so that the entry it
+ * refreshes is still served until nst_dict_replace swaps them.
+ */
+nst_dict_entry_t *
+nst_dict_prepare(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_t *rule,
+        int pid) {
+
+    if(!nst_dict_owned(dict)) {
+        return NULL;
+    }
+
+    return _nst_dict_entry_new(dict, key, txn, rule, pid);
+}
+
+/*
+ * Link an entry made by nst_dict_prepare in place of the entry of the
+ * same key if any. Lock-free readers which miss both fall back to
+ * nst_dict_get. The entry is discarded if the table is full, if another
+ * stream is creating the entry of the key, or if the dict has been
+ * attached by a new configuration since it was prepared.
+ * caller must hold nst_dict_lock(dict, entry->key.hash)
+ */
+int
+nst_dict_replace(nst_dict_t *dict, nst_dict_entry_t *entry) {
+    nst_dict_entry_t  *old = _nst_dict_lookup(dict, &entry->key);
+
+    if(!nst_dict_owned(dict) || (old && (old->state == NST_DICT_ENTRY_STATE_INIT
+                    || old->state == NST_DICT_ENTRY_STATE_UPDATE))) {
+
+        nst_dict_discard(dict, entry);
+
+        return NST_ERR;
+    }
+
+    if(old) {
+        _nst_dict_remove(dict, old);
+        _nst_dict_entry_free(dict, old);
+    }
+
+    if(_nst_dict_table_insert(dict, dict->table, dict->size, entry) != NST_OK) {
+        nst_dict_discard(dict, entry);
+
+        return NST_ERR;
+    }
+
+    nst_dict_incr_used(dict);
+
+    nst_dict_schedule(dict, entry);
+
+    return NST_OK;
+}
+
+/*
+ * free an entry which is not linked in the table
+ */
+void
+nst_dict_discard(nst_dict_t *dict, nst_dict_entry_t *entry) {
+
+    if(entry) {
+
+        if(entry->store.ring.data) {
+            nst_ring_data_invalidate(&dict->store->ring, entry->store.ring.data);
+        }
+
+        nst_memory_free(dict->memory, entry->store.disk.file);
+        nst_memory_free(dict->memory, entry->buf.area);
+        nst_memory_free(dict->memory, entry->key.data);
+        nst_memory_free(dict->memory, entry);
+    }
 }
 
 /*
  * return NULL if invalid;
  * return entry if init and valid
+ * caller must hold nst_dict_lock(dict, key->hash), same for set
  */
 nst_dict_entry_t *
 nst_dict_get(nst_dict_t *dict, nst_key_t *key) {
     nst_dict_entry_t  *entry = NULL;
     uint64_t           max;
-    int                idx, expired;
+    int                expired;
 
     if(dict->used == 0) {
         return NULL;
     }
 
-    idx   = key->hash % dict->size;
-    entry = dict->entry[idx];
-
-    while(entry) {
+    entry = _nst_dict_lookup(dict, key);
 
-        if(entry->key.hash == key->hash && entry->key.size == key->size
-                && !memcmp(entry->key.uuid, key->uuid, NST_KEY_UUID_LEN)
-                && !memcmp(entry->key.data, key->data, key->size)) {
+    if(!entry) {
+        return NULL;
+    }
 
-            if(entry->state == NST_DICT_ENTRY_STATE_INVALID) {
-                return NULL;
-            }
+    if(entry->state == NST_DICT_ENTRY_STATE_INVALID) {
+        return NULL;
+    }
 
-            if(entry->state == NST_DICT_ENTRY_STATE_INIT
-                    || entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
+    if(entry->state == NST_DICT_ENTRY_STATE_INIT
+            || entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
 
-                return entry;
-            }
+        return entry;
+    }
 
-            expired  = nst_dict_entry_expired(entry);
+    expired  = nst_dict_entry_expired(entry);
 
-            max = 1000 * entry->expire + 1000 * entry->ttl * entry->extend[3] / 100;
+    max = 1000 * entry->expire + 1000 * entry->ttl * entry->extend[3] / 100;
 
-            entry->atime = get_current_timestamp();
+    entry->atime = get_current_timestamp();
 
-            if(expired && entry->extend[0] != 0xFF && entry->atime <= max
-                    && entry->access[3] > entry->access[2]
-                    && entry->access[2] > entry->access[1]) {
+    if(expired && entry->extend[0] != 0xFF && entry->atime <= max
+            && entry->access[3] > entry->access[2]
+            && entry->access[2] > entry->access[1]) {
 
-                entry->expire    += entry->ttl;
+        entry->expire    += entry->ttl;
 
-                entry->access[0] += entry->access[1];
-                entry->access[0] += entry->access[2];
-                entry->access[0] += entry->access[3];
-                entry->access[1]  = 0;
-                entry->access[2]  = 0;
-                entry->access[3]  = 0;
-                entry->extended  += 1;
+        entry->access[0] += entry->access[1];
+        entry->access[0] += entry->access[2];
+        entry->access[0] += entry->access[3];
+        entry->access[1]  = 0;
+        entry->access[2]  = 0;
+        entry->access[3]  = 0;
+        entry->extended  += 1;
 
-                if(entry->store.disk.file) {
-                    nst_disk_update_expire(entry->store.disk.file, entry->expire);
-                }
+        if(entry->store.disk.file) {
+            nst_disk_update_expire(entry->store.disk.file, entry->expire);
+        }
 
-                expired = 0;
-            }
+        nst_dict_schedule(dict, entry);
 
-            /* check expire
-             * change state only, leave the free stuff to cleanup
-             * */
-            if(entry->state == NST_DICT_ENTRY_STATE_VALID && expired) {
-                entry->state     = NST_DICT_ENTRY_STATE_INVALID;
-                entry->expire    = 0;
-                entry->access[0] = 0;
-                entry->access[1] = 0;
-                entry->access[2] = 0;
-                entry->access[3] = 0;
-                entry->extended  = 0;
-
-                if(entry->store.ring.data) {
-                    entry->store.ring.data->invalid = 1;
-                    entry->store.ring.data          = NULL;
-
-                    nst_ring_incr_invalid(&dict->store->ring);
-                }
-
-                return NULL;
-            }
+        expired = 0;
+    }
 
-            return entry;
+    /* check expire
+     * change state only, leave the free stuff to cleanup
+     * stale entries are returned expired, see nst_cache_exists
+     * */
+    if(entry->state == NST_DICT_ENTRY_STATE_VALID && expired && !nst_dict_entry_stale(entry)) {
+        entry->state     = NST_DICT_ENTRY_STATE_INVALID;
+        entry->expire    = 0;
+        entry->access[0] = 0;
+        entry->access[1] = 0;
+        entry->access[2] = 0;
+        entry->access[3] = 0;
+        entry->extended  = 0;
+
+        if(entry->store.ring.data) {
+            nst_ring_data_invalidate(&dict->store->ring, entry->store.ring.data);
+
+            entry->store.ring.data = NULL;
         }
 
-        entry = entry->next;
+        nst_dict_schedule(dict, entry);
+
+        return NULL;
     }
 
-    return NULL;
-}
+    if(entry->freq < NST_DICT_EVICT_FREQ_MAX) {
+        entry->freq++;
+    }
 
-int
-nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, hpx_ist_t host, hpx_ist_t path,
-        nst_key_t *key, char *file, char *meta) {
+    return entry;
+}
 
+/*
+ * Lock-free lookup of a memory hit, caller must be in an epoch read
+ * section. Return a valid entry and attach its ring data to *data,
+ * or return NULL, then the caller should retry with nst_dict_get.
+ * Expired entries are left to nst_dict_get, which extends or
+ * invalidates them.
+ */
+nst_dict_entry_t *
+nst_dict_get_hit(nst_dict_t *dict, nst_key_t *key, nst_ring_data_t **data) {
     nst_dict_entry_t  *entry = NULL;
-    uint64_t           ttl_extend;
-    int                idx;
+    nst_ring_data_t   *ring;
+    void              *table, *old;
+    uint64_t           size, old_size, gen;
+
+    if(dict->used == 0) {
+        return NULL;
+    }
 
-    key->hash = nst_disk_meta_get_hash(meta);
+    gen = *(volatile uint64_t *)&dict->gen;
 
-    idx = key->hash % dict->size;
+    if(gen & 1) {
+        return NULL;
+    }
 
-    entry = dict->entry[idx];
+    __sync_synchronize();
 
-    while(entry) {
+    table    = dict->table;
+    size     = dict->size;
+    old      = dict->rehash.table;
+    old_size = dict->rehash.size;
 
-        if(entry->key.hash == key->hash && entry->key.size == key->size
-                && !memcmp(entry->key.uuid, key->uuid, NST_KEY_UUID_LEN)
-                && !memcmp(entry->key.data, key->data, key->size)) {
+    __sync_synchronize();
 
-            break;
-        }
+    if(*(volatile uint64_t *)&dict->gen != gen) {
+        return NULL;
+    }
 
-        entry = entry->next;
+    entry = _nst_dict_table_lookup(dict, table, size, key);
+
+    if(!entry && old) {
+        entry = _nst_dict_table_lookup(dict, old, old_size, key);
+    }
+
+    if(!entry || entry->state != NST_DICT_ENTRY_STATE_VALID || nst_dict_entry_expired(entry)) {
+        return NULL;
+    }
+
+    ring = entry->store.ring.data;
+
+    if(!ring) {
+        return NULL;
+    }
+
+    nst_ring_data_attach(&dict->store->ring, ring);
+
+    /* nst_ring_cleanup only retires invalid data without clients */
+    if(ring->invalid || entry->store.ring.data != ring
+            || entry->state != NST_DICT_ENTRY_STATE_VALID) {
+
+        nst_ring_data_detach(&dict->store->ring, ring);
+
+        return NULL;
     }
 
+    *data = ring;
+
+    entry->atime = get_current_timestamp();
+
+    if(entry->freq < NST_DICT_EVICT_FREQ_MAX) {
+        entry->freq++;
+    }
+
+    return entry;
+}
+
+int
+nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, hpx_ist_t host, hpx_ist_t path,
+        nst_key_t *key, char *file, char *meta) {
+
+    nst_dict_entry_t  *entry = NULL;
+    uint64_t           ttl_extend;
+
+    entry = _nst_dict_lookup(dict, key);
+
     if(entry) {
         return NST_OK;
     }
@@ -325,11 +1336,6 @@ nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, hpx_ist_t host, hpx_
 
     memset(entry, 0, sizeof(*entry));
 
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
-
     /* init entry */
     entry->state  = NST_DICT_ENTRY_STATE_VALID;
     entry->key    = *key;
@@ -359,5 +1365,19 @@ nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, hpx_ist_t host, hpx_
 
     entry->ttl = ttl_extend >> 32;
 
+    entry->stale.revalidate = nst_disk_meta_get_stale_revalidate(meta);
+    entry->stale.error      = nst_disk_meta_get_stale_error(meta);
+
+    if(_nst_dict_table_insert(dict, dict->table, dict->size, entry) != NST_OK) {
+        nst_memory_free(dict->memory, entry->store.disk.file);
+        nst_memory_free(dict->memory, entry);
+
+        return NST_ERR;
+    }
+
+    nst_dict_incr_used(dict);
+
+    nst_dict_schedule(dict, entry);
+
     return NST_OK;
 }
@@ -0,0 +1,90 @@
+/*
+ * nuster epoch based reclamation functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <nuster/nuster.h>
+
+uint64_t  nst_epoch_self;
+
+int
+nst_epoch_init(nst_epoch_t *epoch, nst_memory_t *memory, int size) {
+    uint64_t  bytes = sizeof(nst_epoch_slot_t) * size * 2;
+
+    epoch->slot = nst_memory_calloc(memory, bytes);
+
+    if(!epoch->slot) {
+        return NST_ERR;
+    }
+
+    /* 0 means outside of read sections */
+    epoch->global = 1;
+    epoch->owner  = nst_epoch_self;
+    epoch->half   = 0;
+    epoch->size   = size;
+
+    return NST_OK;
+}
+
+/*
+ * Make the processes of this configuration the owner of the epoch.
+ * A reader which sees the new half also sees the new owner, so the
+ * workers of the old configuration never write the slots of the new one.
+ * Both halves are cleared if no process is left, slots of a killed reader
+ * would stop the epoch otherwise.
+ * Only called by the master before the workers are forked.
+ */
+void
+nst_epoch_own(nst_epoch_t *epoch, int orphaned) {
+    int  half = !epoch->half;
+    int  i;
+
+    /* left by the configuration before the previous one */
+    for(i = 0; i < epoch->size; i++) {
+        epoch->slot[half * epoch->size + i].epoch = 0;
+
+        if(orphaned) {
+            epoch->slot[!half * epoch->size + i].epoch = 0;
+        }
+    }
+
+    epoch->owner = nst_epoch_self;
+
+    __sync_synchronize();
+
+    epoch->half = half;
+}
+
+/*
+ * Move to the next epoch if every reader in a read section has seen
+ * the current one. Only called by master housekeeping.
+ */
+int
+nst_epoch_advance(nst_epoch_t *epoch) {
+    uint64_t  global = epoch->global;
+    uint64_t  e;
+    int       i;
+
+    /* order the unlinks of retired objects before reading the slots */
+    __sync_synchronize();
+
+    /* both halves, the workers of the old configuration may still read */
+    for(i = 0; i < epoch->size * 2; i++) {
+        e = *(volatile uint64_t *)&epoch->slot[i].epoch;
+
+        if(e && e != global) {
+            return NST_ERR;
+        }
+    }
+
+    __sync_add_and_fetch(&epoch->global, 1);
+
+    return NST_OK;
+}
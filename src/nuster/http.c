@@ -19,6 +19,8 @@
 #include <types/proxy.h>
 
 #include <proto/stream_interface.h>
+#include <proto/stream.h>
+#include <proto/queue.h>
 #include <proto/http_ana.h>
 #include <proto/http_htx.h>
 
@@ -121,9 +123,14 @@ nst_http_ring_item_to_htx(nst_ring_item_t *item, hpx_htx_t *htx) {
 
     info  = item->info;
     type  = (info >> 28);
-    blksz = ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
-            ? (info & 0xff) + ((info >> 8) & 0xfffff)
-            : info & 0xfffffff);
+    blksz = nst_ring_item_size(item);
+
+    /* consecutive data items are appended to the same block */
+    if(type == HTX_BLK_DATA) {
+        blk = htx_add_data_atonce(htx, ist2(item->data, blksz));
+
+        return blk ? NST_OK : NST_ERR;
+    }
 
     blk = htx_add_blk(htx, type, blksz);
 
@@ -254,6 +261,55 @@ nst_http_reply_304(hpx_stream_t *s, hpx_ist_t last_modified, hpx_ist_t etag) {
 
 }
 
+/*
+ * Drop the response of the server and release the connection to it, so
+ * that an applet registered afterwards answers instead, as L7 retries do.
+ * Called while analysing the response headers.
+ */
+void
+nst_http_drop_response(hpx_stream_t *s) {
+    hpx_stream_interface_t  *si  = &s->si[1];
+    hpx_channel_t           *res = &s->res;
+    hpx_server_t            *srv = objt_server(s->target);
+
+    if(srv) {
+
+        if(s->flags & SF_CURR_SESS) {
+            s->flags &= ~SF_CURR_SESS;
+            _HA_ATOMIC_SUB(&srv->cur_sess, 1);
+        }
+
+        sess_change_server(s, NULL);
+
+        if(may_dequeue_tasks(srv, s->be)) {
+            process_srv_queue(srv);
+        }
+    }
+
+    si_release_endpoint(si);
+
+    res->flags &= ~(CF_READ_ERROR | CF_READ_TIMEOUT | CF_SHUTR | CF_EOI | CF_READ_NULL
+            | CF_SHUTR_NOW);
+
+    res->analysers  &= AN_RES_FLT_END;
+    res->analyse_exp = TICK_ETERNITY;
+    res->rex         = TICK_ETERNITY;
+    res->total       = 0;
+
+    channel_htx_erase(res, htxbuf(&res->buf));
+
+    si->flags &= ~(SI_FL_ERR | SI_FL_EXP | SI_FL_RXBLK_SHUT);
+    si->exp    = TICK_ETERNITY;
+    si->state  = SI_ST_REQ;
+
+    s->flags &= ~(SF_ERR_SRVTO | SF_ERR_SRVCL | SF_DIRECT | SF_ASSIGNED | SF_ADDR_SET);
+    s->target = NULL;
+
+    s->txn->rsp.flags     = 0;
+    s->txn->rsp.msg_state = HTTP_MSG_RPBEFORE;
+    s->txn->status        = -1;
+}
+
 int
 nst_http_handle_expect(hpx_stream_t *s, hpx_htx_t *htx, hpx_http_msg_t *msg) {
 
@@ -25,185 +25,282 @@
 
 #include <nuster/nuster.h>
 
-int
-nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_txn_t *txn,
-        nst_key_t *key, enum http_meth_t method) {
+/*
+ * append the value of one element, followed by a NULL delimiter
+ */
+static int
+_nst_key_append(hpx_stream_t *s, hpx_http_msg_t *msg, nst_key_element_t *ck, nst_http_txn_t *txn,
+        hpx_buffer_t *buf, enum http_meth_t method) {
 
-    nst_key_element_t  **pck = rule->key->data;
-    nst_key_element_t   *ck  = NULL;
-    hpx_buffer_t        *buf = nst_key_init();
+    int  ret = NST_ERR;
 
-    nst_debug_beg(s, "[rule ] key:  ");
+    switch(ck->type) {
+        case NST_KEY_ELEMENT_METHOD:
+            ret = nst_key_catist(buf, http_known_methods[method]);
 
-    while((ck = *pck++)) {
-        int  ret = NST_ERR;
+            break;
+        case NST_KEY_ELEMENT_SCHEME:
+            {
+                hpx_ist_t scheme = txn->req.scheme == SCH_HTTPS ? ist("HTTPS") : ist("HTTP");
+                ret = nst_key_catist(buf, scheme);
+            }
 
-        switch(ck->type) {
-            case NST_KEY_ELEMENT_METHOD:
-                nst_debug_add("method.");
+            break;
+        case NST_KEY_ELEMENT_HOST:
+            if(txn->req.host.len) {
+                ret = nst_key_catist(buf, txn->req.host);
+            } else {
+                ret = nst_key_catdel(buf);
+            }
 
-                ret = nst_key_catist(buf, http_known_methods[method]);
+            break;
+        case NST_KEY_ELEMENT_URI:
+            if(txn->req.uri.len) {
+                ret = nst_key_catist(buf, txn->req.uri);
+            } else {
+                ret = nst_key_catdel(buf);
+            }
 
-                break;
-            case NST_KEY_ELEMENT_SCHEME:
-                nst_debug_add("scheme.");
+            break;
+        case NST_KEY_ELEMENT_PATH:
+            if(txn->req.path.len) {
+                ret = nst_key_catist(buf, txn->req.path);
+            } else {
+                ret = nst_key_catdel(buf);
+            }
 
-                {
-                    hpx_ist_t scheme = txn->req.scheme == SCH_HTTPS ? ist("HTTPS") : ist("HTTP");
-                    ret = nst_key_catist(buf, scheme);
-                }
+            break;
+        case NST_KEY_ELEMENT_DELIMITER:
+            if(txn->req.delimiter) {
+                ret = nst_key_catist(buf, ist("?"));
+            } else {
+                ret = nst_key_catdel(buf);
+            }
 
-                break;
-            case NST_KEY_ELEMENT_HOST:
-                nst_debug_add("host.");
+            break;
+        case NST_KEY_ELEMENT_QUERY:
+            if(txn->req.query.len) {
+                ret = nst_key_catist(buf, txn->req.query);
+            } else {
+                ret = nst_key_catdel(buf);
+            }
 
-                if(txn->req.host.len) {
-                    ret = nst_key_catist(buf, txn->req.host);
-                } else {
-                    ret = nst_key_catdel(buf);
-                }
+            break;
+        case NST_KEY_ELEMENT_PARAM:
+            if(txn->req.query.len) {
+                char  *v   = NULL;
+                int    v_l = 0;
 
-                break;
-            case NST_KEY_ELEMENT_URI:
-                nst_debug_add("uri.");
+                if(nst_http_find_param(txn->req.query.ptr,
+                            txn->req.query.ptr + txn->req.query.len,
+                            ck->data, &v, &v_l) == NST_OK) {
 
-                if(txn->req.uri.len) {
-                    ret = nst_key_catist(buf, txn->req.uri);
-                } else {
-                    ret = nst_key_catdel(buf);
+                    ret = nst_key_catist(buf, ist2(v, v_l));
+                    break;
                 }
+            }
 
-                break;
-            case NST_KEY_ELEMENT_PATH:
-                nst_debug_add("path.");
-
-                if(txn->req.path.len) {
-                    ret = nst_key_catist(buf, txn->req.path);
-                } else {
-                    ret = nst_key_catdel(buf);
+            ret = nst_key_catdel(buf);
+            break;
+        case NST_KEY_ELEMENT_HEADER:
+            {
+                hpx_htx_t          *htx = htxbuf(&s->req.buf);
+                hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+                hpx_ist_t           h   = {
+                    .ptr = ck->data,
+                    .len = strlen(ck->data),
+                };
+
+                while(http_find_header(htx, h, &hdr, 0)) {
+                    ret = nst_key_catist(buf, hdr.value);
+
+                    if(ret == NST_ERR) {
+                        break;
+                    }
                 }
+            }
 
-                break;
-            case NST_KEY_ELEMENT_DELIMITER:
-                nst_debug_add("delimiter.");
+            ret = nst_key_catdel(buf);
+            break;
+        case NST_KEY_ELEMENT_COOKIE:
+            if(txn->req.cookie.len) {
+                char   *v   = NULL;
+                size_t  v_l = 0;
 
-                if(txn->req.delimiter) {
-                    ret = nst_key_catist(buf, ist("?"));
-                } else {
-                    ret = nst_key_catdel(buf);
+                if(http_extract_cookie_value(txn->req.cookie.ptr,
+                            txn->req.cookie.ptr + txn->req.cookie.len,
+                            ck->data, strlen(ck->data), 1, &v, &v_l)) {
+
+                    ret = nst_key_catist(buf, ist2(v, v_l));
+                    break;
                 }
 
-                break;
-            case NST_KEY_ELEMENT_QUERY:
-                nst_debug_add("query.");
+            }
+
+            ret = nst_key_catdel(buf);
+            break;
+        case NST_KEY_ELEMENT_BODY:
+            if(s->txn->meth == HTTP_METH_POST || s->txn->meth == HTTP_METH_PUT) {
 
-                if(txn->req.query.len) {
-                    ret = nst_key_catist(buf, txn->req.query);
-                } else {
-                    ret = nst_key_catdel(buf);
-                }
+                int         idx;
+                hpx_htx_t  *htx = htxbuf(&msg->chn->buf);
 
-                break;
-            case NST_KEY_ELEMENT_PARAM:
-                nst_debug_add("param_%s.", ck->data);
+                for(idx = htx_get_first(htx); idx != -1; idx = htx_get_next(htx, idx)) {
+                    hpx_htx_blk_t      *blk  = htx_get_blk(htx, idx);
+                    hpx_htx_blk_type_t  type = htx_get_blk_type(blk);
+                    uint32_t            sz   = htx_get_blksz(blk);
 
-                if(txn->req.query.len) {
-                    char  *v   = NULL;
-                    int    v_l = 0;
+                    if(type != HTX_BLK_DATA) {
+                        continue;
+                    }
 
-                    if(nst_http_find_param(txn->req.query.ptr,
-                                txn->req.query.ptr + txn->req.query.len,
-                                ck->data, &v, &v_l) == NST_OK) {
+                    ret = nst_key_cat(buf, htx_get_blk_ptr(htx, blk), sz);
 
-                        ret = nst_key_catist(buf, ist2(v, v_l));
+                    if(ret != NST_OK) {
                         break;
                     }
                 }
+            }
 
-                ret = nst_key_catdel(buf);
-                break;
-            case NST_KEY_ELEMENT_HEADER:
-                {
-                    hpx_htx_t          *htx = htxbuf(&s->req.buf);
-                    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
-                    hpx_ist_t           h   = {
-                        .ptr = ck->data,
-                        .len = strlen(ck->data),
-                    };
-
-                    nst_debug_add("header_%s.", ck->data);
-
-                    while(http_find_header(htx, h, &hdr, 0)) {
-                        ret = nst_key_catist(buf, hdr.value);
-
-                        if(ret == NST_ERR) {
-                            break;
-                        }
-                    }
-                }
+            ret = nst_key_catdel(buf);
+            break;
+        default:
+            ret = NST_ERR;
+            break;
+    }
 
-                ret = nst_key_catdel(buf);
-                break;
-            case NST_KEY_ELEMENT_COOKIE:
-                nst_debug_add("cookie_%s.", ck->data);
+    return ret;
+}
 
-                if(txn->req.cookie.len) {
-                    char   *v   = NULL;
-                    size_t  v_l = 0;
+static void
+_nst_key_debug_element(nst_key_element_t *ck) {
+
+    switch(ck->type) {
+        case NST_KEY_ELEMENT_METHOD:
+            nst_debug_add("method.");
+            break;
+        case NST_KEY_ELEMENT_SCHEME:
+            nst_debug_add("scheme.");
+            break;
+        case NST_KEY_ELEMENT_HOST:
+            nst_debug_add("host.");
+            break;
+        case NST_KEY_ELEMENT_URI:
+            nst_debug_add("uri.");
+            break;
+        case NST_KEY_ELEMENT_PATH:
+            nst_debug_add("path.");
+            break;
+        case NST_KEY_ELEMENT_DELIMITER:
+            nst_debug_add("delimiter.");
+            break;
+        case NST_KEY_ELEMENT_QUERY:
+            nst_debug_add("query.");
+            break;
+        case NST_KEY_ELEMENT_PARAM:
+            nst_debug_add("param_%s.", ck->data);
+            break;
+        case NST_KEY_ELEMENT_HEADER:
+            nst_debug_add("header_%s.", ck->data);
+            break;
+        case NST_KEY_ELEMENT_COOKIE:
+            nst_debug_add("cookie_%s.", ck->data);
+            break;
+        case NST_KEY_ELEMENT_BODY:
+            nst_debug_add("body.");
+            break;
+        default:
+            break;
+    }
+}
 
-                    if(http_extract_cookie_value(txn->req.cookie.ptr,
-                                txn->req.cookie.ptr + txn->req.cookie.len,
-                                ck->data, strlen(ck->data), 1, &v, &v_l)) {
+/*
+ * Build the key up to node into buf, starting from the longest prefix
+ * already built for the stream, and feed the appended bytes to hash.
+ */
+static int
+_nst_key_build_node(hpx_stream_t *s, hpx_http_msg_t *msg, nst_key_node_t *node,
+        nst_http_txn_t *txn, nst_key_cache_t *cache, hpx_buffer_t *buf, XXH64_state_t *hash,
+        enum http_meth_t method) {
 
-                        ret = nst_key_catist(buf, ist2(v, v_l));
-                        break;
-                    }
+    nst_key_prefix_t  *prefix;
+    hpx_ist_t         *element;
+    uint32_t           beg;
+    int                ret;
 
-                }
+    if(node == NULL) {
+        XXH64_reset(hash, 0);
 
-                ret = nst_key_catdel(buf);
-                break;
-            case NST_KEY_ELEMENT_BODY:
-                nst_debug_add("body.");
+        return NST_OK;
+    }
 
-                if(s->txn->meth == HTTP_METH_POST || s->txn->meth == HTTP_METH_PUT) {
+    if(cache && cache->prefix[node->idx].data) {
+        prefix = &cache->prefix[node->idx];
 
-                    int         idx;
-                    hpx_htx_t  *htx = htxbuf(&msg->chn->buf);
+        memcpy(buf->area, prefix->data, prefix->size);
 
-                    for(idx = htx_get_first(htx); idx != -1; idx = htx_get_next(htx, idx)) {
-                        hpx_htx_blk_t      *blk  = htx_get_blk(htx, idx);
-                        hpx_htx_blk_type_t  type = htx_get_blk_type(blk);
-                        uint32_t            sz   = htx_get_blksz(blk);
+        buf->data = prefix->size;
+        *hash     = prefix->hash;
 
-                        if(type != HTX_BLK_DATA) {
-                            continue;
-                        }
+        return NST_OK;
+    }
 
-                        ret = nst_key_cat(buf, htx_get_blk_ptr(htx, blk), sz);
+    ret = _nst_key_build_node(s, msg, node->parent, txn, cache, buf, hash, method);
 
-                        if(ret != NST_OK) {
-                            break;
-                        }
-                    }
-                }
+    if(ret != NST_OK) {
+        return NST_ERR;
+    }
 
-                ret = nst_key_catdel(buf);
-                break;
-            default:
-                ret = NST_ERR;
-                break;
-        }
+    beg = buf->data;
 
-        if(ret != NST_OK) {
-            return NST_ERR;
-        }
+    if(cache && cache->element[node->eidx].ptr) {
+        element = &cache->element[node->eidx];
+        ret     = nst_key_cat(buf, element->ptr, element->len);
+    } else {
+        ret = _nst_key_append(s, msg, node->element, txn, buf, method);
+    }
+
+    if(ret != NST_OK) {
+        return NST_ERR;
+    }
+
+    XXH64_update(hash, buf->area + beg, buf->data - beg);
+
+    if(cache) {
+        prefix       = &cache->prefix[node->idx];
+        prefix->size = buf->data;
+        prefix->hash = *hash;
+    }
+
+    return NST_OK;
+}
+
+int
+nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_txn_t *txn,
+        nst_key_cache_t *cache, nst_key_t *key, enum http_meth_t method) {
+
+    nst_key_element_t  **pck  = rule->key->data;
+    nst_key_node_t      *node = rule->key->node;
+    hpx_buffer_t        *buf  = nst_key_init();
+    XXH64_state_t        hash;
+    uint32_t             beg;
+
+    nst_debug_beg(s, "[rule ] key:  ");
+
+    while(*pck) {
+        _nst_key_debug_element(*pck++);
     }
 
     nst_debug_end("");
 
-    key->size = buf->data;
-    key->data = malloc(key->size);
+    if(_nst_key_build_node(s, msg, node, txn, cache, buf, &hash, method) != NST_OK) {
+        return NST_ERR;
+    }
+
+    key->size   = buf->data;
+    key->hash   = XXH64_digest(&hash);
+    key->flags &= ~NST_KEY_UUID_SET;
+    key->data   = nst_arena_alloc(cache ? cache->arena : NULL, key->size);
 
     if(!key->data) {
         return NST_ERR;
@@ -211,18 +308,36 @@ nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_t
 
     memcpy(key->data, buf->area, buf->data);
 
+    /* the prefixes and elements built above now live in key->data */
+    while(cache && node && !cache->prefix[node->idx].data) {
+        beg = node->parent ? cache->prefix[node->parent->idx].size : 0;
+
+        cache->prefix[node->idx].data = key->data;
+
+        if(!cache->element[node->eidx].ptr) {
+            cache->element[node->eidx] = ist2(key->data + beg,
+                    cache->prefix[node->idx].size - beg);
+        }
+
+        node = node->parent;
+    }
+
     return NST_OK;
 }
 
 void
-nst_key_hash(nst_key_t *key) {
+nst_key_uuid(nst_key_t *key) {
     blk_SHA_CTX ctx;
 
-    key->hash = XXH64(key->data, key->size, 0);
+    if(key->flags & NST_KEY_UUID_SET) {
+        return;
+    }
 
     blk_SHA1_Init(&ctx);
     blk_SHA1_Update(&ctx, key->data, key->size);
     blk_SHA1_Final(key->uuid, &ctx);
+
+    key->flags |= NST_KEY_UUID_SET;
 }
 
 void
@@ -51,12 +51,10 @@ nst_purger_basic(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
                     free(key.data);
                 }
 
-                if(nst_key_build(s, msg, rule, &txn, &key, HTTP_METH_GET) != NST_OK) {
+                if(nst_key_build(s, msg, rule, &txn, NULL, &key, HTTP_METH_GET) != NST_OK) {
                     goto err;
                 }
 
-                nst_key_hash(&key);
-
                 nst_key_debug(s, &key);
 
                 if(global.nuster.cache.status == NST_STATUS_ON
@@ -353,55 +351,64 @@ nst_purger_check(hpx_appctx_t *appctx, nst_dict_entry_t *entry) {
     return ret;
 }
 
-static void
-nst_purger_handler(hpx_appctx_t *appctx) {
-    nst_dict_entry_t        *entry  = NULL;
-    hpx_stream_interface_t  *si     = appctx->owner;
-    hpx_stream_t            *s      = si_strm(si);
-    nst_dict_t              *dict   = appctx->ctx.nuster.manager.dict;
-    uint64_t                 start  = get_current_timestamp();
-    int                      max    = 1000;
+static int
+_nst_purger_entry(nst_dict_t *dict, nst_dict_entry_t *entry, void *data) {
+    hpx_appctx_t  *appctx = data;
 
-    while(1) {
+    /* proxy and rule ids are those of the configuration owning the dict */
+    if((appctx->st0 == NST_MANAGER_NAME_PROXY || appctx->st0 == NST_MANAGER_NAME_RULE)
+            && !nst_dict_owned(dict)) {
 
-        while(appctx->ctx.nuster.manager.idx < dict->size && max--) {
-            nst_shctx_lock(dict);
+        return NST_DICT_WALK_STOP;
+    }
 
-            entry = dict->entry[appctx->ctx.nuster.manager.idx];
+    if(nst_purger_check(appctx, entry)) {
+        if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
 
-            while(entry) {
+            entry->state  = NST_DICT_ENTRY_STATE_INVALID;
+            entry->expire = 0;
 
-                if(nst_purger_check(appctx, entry)) {
-                    if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
+            if(entry->store.ring.data) {
+                nst_ring_data_invalidate(&dict->store->ring, entry->store.ring.data);
 
-                        entry->state  = NST_DICT_ENTRY_STATE_INVALID;
-                        entry->expire = 0;
+                entry->store.ring.data = NULL;
+            }
 
-                        if(entry->store.ring.data) {
-                            entry->store.ring.data->invalid = 1;
-                            entry->store.ring.data          = NULL;
+            if(entry->store.disk.file) {
+                nst_disk_purge_by_path(entry->store.disk.file);
+            }
 
-                            nst_ring_incr_invalid(&dict->store->ring);
-                        }
+            nst_dict_schedule(dict, entry);
+        }
+    }
 
-                        if(entry->store.disk.file) {
-                            nst_disk_purge_by_path(entry->store.disk.file);
-                        }
-                    }
-                }
+    return NST_DICT_WALK_NEXT;
+}
 
-                entry = entry->next;
+static void
+nst_purger_handler(hpx_appctx_t *appctx) {
+    hpx_stream_interface_t  *si     = appctx->owner;
+    hpx_stream_t            *s      = si_strm(si);
+    nst_dict_t              *dict   = appctx->ctx.nuster.manager.dict;
+    uint64_t                 start  = get_current_timestamp();
+    int                      max    = 1000;
 
-                if(get_current_timestamp() - start > 10) {
-                    break;
-                }
-            }
+    /* restart if the dict tables have changed since last call */
+    if(appctx->ctx.nuster.manager.gen != dict->gen) {
+        appctx->ctx.nuster.manager.gen = dict->gen;
+        appctx->ctx.nuster.manager.idx = 0;
+    }
 
-            if(entry == NULL) {
-                appctx->ctx.nuster.manager.idx++;
-            }
+    while(1) {
 
-            nst_shctx_unlock(dict);
+        while(appctx->ctx.nuster.manager.idx < nst_dict_walk_size(dict) && max--) {
+            nst_dict_lock(dict, appctx->ctx.nuster.manager.idx);
+
+            nst_dict_walk(dict, appctx->ctx.nuster.manager.idx, _nst_purger_entry, appctx);
+
+            nst_dict_unlock(dict, appctx->ctx.nuster.manager.idx);
+
+            appctx->ctx.nuster.manager.idx++;
         }
 
         if(get_current_timestamp() - start > 20) {
@@ -413,7 +420,9 @@ nst_purger_handler(hpx_appctx_t *appctx) {
 
     task_wakeup(s->task, TASK_WOKEN_OTHER);
 
-    if(appctx->ctx.nuster.manager.idx == dict->size) {
+    if(appctx->ctx.nuster.manager.idx >= nst_dict_walk_size(dict)
+            && appctx->ctx.nuster.manager.gen == dict->gen) {
+
         nst_http_reply(s, NST_HTTP_200);
     }
 }
@@ -20,10 +20,11 @@
 #include <nuster/nuster.h>
 
 void
-nst_stats_update_cache(int state, uint64_t bytes) {
+nst_stats_update_cache(int state, uint64_t bytes, uint32_t allocs) {
     nst_shctx_lock(global.nuster.stats);
 
     global.nuster.stats->cache.total++;
+    global.nuster.stats->cache.allocs += allocs;
 
     switch(state) {
         case NST_CTX_STATE_HIT_MEMORY:
@@ -45,10 +46,33 @@ nst_stats_update_cache(int state, uint64_t bytes) {
 }
 
 void
-nst_stats_update_nosql(enum http_meth_t meth) {
+nst_stats_update_cache_admit(int admit) {
+    nst_shctx_lock(global.nuster.stats);
+
+    if(admit) {
+        global.nuster.stats->cache.admit++;
+    } else {
+        global.nuster.stats->cache.reject++;
+    }
+
+    nst_shctx_unlock(global.nuster.stats);
+}
+
+void
+nst_stats_update_cache_revalidate() {
+    nst_shctx_lock(global.nuster.stats);
+
+    global.nuster.stats->cache.revalidate++;
+
+    nst_shctx_unlock(global.nuster.stats);
+}
+
+void
+nst_stats_update_nosql(enum http_meth_t meth, uint32_t allocs) {
     nst_shctx_lock(global.nuster.stats);
 
     global.nuster.stats->nosql.total++;
+    global.nuster.stats->nosql.allocs += allocs;
 
     switch(meth) {
         case HTTP_METH_GET:
@@ -184,6 +208,37 @@ _getMaxPaddingLen() {
     return max;
 }
 
+/*
+ * bytes held by chunk blocks but not used, then the occupancy of each
+ * size class in use
+ */
+static void
+_nst_stats_memory_class(int len, char *name, nst_memory_t *memory) {
+    nst_memory_class_t  *class;
+    char                 key[64];
+    uint64_t             waste = 0;
+    int                  i;
+
+    for(i = 0; i < memory->chunks; i++) {
+        waste += nst_memory_waste(memory, i);
+    }
+
+    snprintf(key, sizeof(key), "store.memory.%s.waste:", name);
+    chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, key, waste);
+
+    for(i = 0; i < memory->chunks; i++) {
+        class = &memory->class[i];
+
+        if(!class->blocks) {
+            continue;
+        }
+
+        snprintf(key, sizeof(key), "store.memory.%s.class.%"PRIu32":", name, class->size);
+        chunk_appendf(&trash, "%-*sblocks=%-8"PRIu64"used=%-10"PRIu64"waste=%"PRIu64"\n",
+                len, key, class->blocks, class->used, nst_memory_waste(memory, i));
+    }
+}
+
 static int
 _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *htx) {
     hpx_channel_t  *res = si_ic(si);
@@ -218,34 +273,70 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.size:",
                     global.nuster.cache.dict_size);
 
+            chunk_appendf(&trash, "%-*s%s\n", len, "dict.cache.engine:",
+                    nuster.cache->dict.engine == NST_DICT_ENGINE_SWISS ? "swiss" : "chain");
+
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.length:",
                     nuster.cache->dict.size);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.used:",
                     nuster.cache->dict.used);
 
+            chunk_appendf(&trash, "%-*s%.2f\n", len, "dict.cache.load_factor:",
+                    (double)nuster.cache->dict.used / nst_dict_slots(&nuster.cache->dict));
+
+            chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.rehash_idx:",
+                    nuster.cache->dict.rehash.idx);
+
+            chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.rehash_length:",
+                    nuster.cache->dict.rehash.size);
+
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.cleanup_idx:",
                     nuster.cache->dict.cleanup_idx);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.sync_idx:",
                     nuster.cache->dict.sync_idx);
+
+            chunk_appendf(&trash, "%-*s%s\n", len, "dict.cache.evict:",
+                    nuster.cache->dict.evict.policy == NST_DICT_EVICT_CLOCK ? "clock" : "off");
+
+            chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.evicted:",
+                    nuster.cache->dict.evict.count);
         }
 
         if(global.nuster.nosql.status == NST_STATUS_ON) {
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.size:",
                     global.nuster.nosql.dict_size);
 
+            chunk_appendf(&trash, "%-*s%s\n", len, "dict.nosql.engine:",
+                    nuster.nosql->dict.engine == NST_DICT_ENGINE_SWISS ? "swiss" : "chain");
+
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.length:",
                     nuster.nosql->dict.size);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.used:",
                     nuster.nosql->dict.used);
 
+            chunk_appendf(&trash, "%-*s%.2f\n", len, "dict.nosql.load_factor:",
+                    (double)nuster.nosql->dict.used / nst_dict_slots(&nuster.nosql->dict));
+
+            chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.rehash_idx:",
+                    nuster.nosql->dict.rehash.idx);
+
+            chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.rehash_length:",
+                    nuster.nosql->dict.rehash.size);
+
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.cleanup_idx:",
                     nuster.nosql->dict.cleanup_idx);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.sync_idx:",
                     nuster.nosql->dict.sync_idx);
+
+            chunk_appendf(&trash, "%-*s%s\n", len, "dict.nosql.evict:",
+                    nuster.nosql->dict.evict.policy == NST_DICT_EVICT_CLOCK ? "clock" : "off");
+
+            chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.evicted:",
+                    nuster.nosql->dict.evict.count);
         }
     }
 
@@ -268,6 +359,11 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "store.memory.cache.count:",
                 nuster.cache->store.ring.count);
+
+        chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "store.memory.cache.compacted:",
+                nuster.cache->store.ring.compact.moved);
+
+        _nst_stats_memory_class(len, "cache", global.nuster.cache.memory);
     }
 
     if(global.nuster.nosql.status == NST_STATUS_ON) {
@@ -279,6 +375,11 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "store.memory.nosql.count:",
                 nuster.nosql->store.ring.count);
+
+        chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "store.memory.nosql.compacted:",
+                nuster.nosql->store.ring.compact.moved);
+
+        _nst_stats_memory_class(len, "nosql", global.nuster.nosql.memory);
     }
 
     if(global.nuster.cache.status == NST_STATUS_ON || global.nuster.nosql.status == NST_STATUS_ON) {
@@ -322,6 +423,18 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.bytes:",
                 global.nuster.stats->cache.bytes);
+
+        chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.admit:",
+                global.nuster.stats->cache.admit);
+
+        chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.reject:",
+                global.nuster.stats->cache.reject);
+
+        chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.revalidate:",
+                global.nuster.stats->cache.revalidate);
+
+        chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.allocs:",
+                global.nuster.stats->cache.allocs);
     }
 
     if(global.nuster.nosql.status == NST_STATUS_ON) {
@@ -336,6 +449,9 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.nosql.delete:",
                 global.nuster.stats->nosql.delete);
+
+        chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.nosql.allocs:",
+                global.nuster.stats->nosql.allocs);
     }
 
     if(!_nst_stats_putdata(res, htx, &trash)) {
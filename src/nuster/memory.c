@@ -11,19 +11,462 @@
  */
 
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <common/standard.h>
 
 #include <nuster/shctx.h>
 #include <nuster/memory.h>
 
+static inline void
+_nst_memory_list_remove(nst_memory_ctrl_t **head, nst_memory_ctrl_t *block) {
+
+    if(block->prev) {
+        block->prev->next = block->next;
+    } else {
+        *head = block->next;
+    }
+
+    if(block->next) {
+        block->next->prev = block->prev;
+    }
+
+    block->prev = NULL;
+    block->next = NULL;
+}
+
+static inline void
+_nst_memory_list_add(nst_memory_ctrl_t **head, nst_memory_ctrl_t *block) {
+    block->prev = NULL;
+    block->next = *head;
+
+    if(block->next) {
+        block->next->prev = block;
+    }
+
+    *head = block;
+}
+
+static inline int
+_nst_memory_run_class(uint64_t n) {
+    int  c = 63 - __builtin_clzll(n);
+
+    return c < NST_MEMORY_RUN_CLASSES ? c : NST_MEMORY_RUN_CLASSES - 1;
+}
+
+/*
+ * Make blocks [start, start + n) a free run
+ */
+static void
+_nst_memory_run_link(nst_memory_t *memory, uint64_t start, uint64_t n) {
+    nst_memory_ctrl_t  *head = &memory->block[start];
+    nst_memory_ctrl_t  *tail = &memory->block[start + n - 1];
+    int                 c    = _nst_memory_run_class(n);
+
+    tail->info = (n << 32) | NST_MEMORY_BLOCK_TYPE_FREE;
+    head->info = tail->info;
+    head->prev = NULL;
+    head->next = memory->runs[c];
+
+    if(head->next) {
+        head->next->prev = head;
+    }
+
+    memory->runs[c] = head;
+}
+
+static void
+_nst_memory_run_unlink(nst_memory_t *memory, nst_memory_ctrl_t *head) {
+    int  c = _nst_memory_run_class(head->info >> 32);
+
+    if(head->prev) {
+        head->prev->next = head->next;
+    } else {
+        memory->runs[c] = head->next;
+    }
+
+    if(head->next) {
+        head->next->prev = head->prev;
+    }
+
+    head->prev = NULL;
+    head->next = NULL;
+}
+
+/*
+ * Take n contiguous blocks from the first free run large enough, looking
+ * from the class of n up, the rest of the run stays free.
+ * Return the index of the first block, or -1.
+ */
+static int64_t
+_nst_memory_run_alloc(nst_memory_t *memory, uint64_t n) {
+    nst_memory_ctrl_t  *head = NULL;
+    uint64_t            start, len;
+    int                 c;
+
+    for(c = _nst_memory_run_class(n); c < NST_MEMORY_RUN_CLASSES && !head; c++) {
+
+        for(head = memory->runs[c]; head; head = head->next) {
+
+            if((head->info >> 32) >= n) {
+                break;
+            }
+        }
+    }
+
+    if(!head) {
+        memory->failed++;
+
+        return -1;
+    }
+
+    start = head - memory->block;
+    len   = head->info >> 32;
+
+    _nst_memory_run_unlink(memory, head);
+
+    if(len > n) {
+        _nst_memory_run_link(memory, start + n, len - n);
+    }
+
+    if(memory->data.begin + (start + n) * memory->block_size > memory->data.free) {
+        memory->data.free = memory->data.begin + (start + n) * memory->block_size;
+    }
+
+    return start;
+}
+
+/*
+ * Give blocks [start, start + n) back, merged with the free runs around
+ */
+static void
+_nst_memory_run_free(nst_memory_t *memory, uint64_t start, uint64_t n) {
+    nst_memory_ctrl_t  *block;
+    uint64_t            len;
+
+    if(start > 0) {
+        /* the last block of a free run */
+        block = &memory->block[start - 1];
+
+        if((block->info & 0xFF) == NST_MEMORY_BLOCK_TYPE_FREE) {
+            len    = block->info >> 32;
+            start -= len;
+            n     += len;
+
+            _nst_memory_run_unlink(memory, &memory->block[start]);
+        }
+    }
+
+    if(start + n < memory->blocks) {
+        block = &memory->block[start + n];
+
+        if((block->info & 0xFF) == NST_MEMORY_BLOCK_TYPE_FREE) {
+            n += block->info >> 32;
+
+            _nst_memory_run_unlink(memory, block);
+        }
+    }
+
+    _nst_memory_run_link(memory, start, n);
+}
+
+/*
+ * When a chunk class has more chunks than NST_MEMORY_INFO_BITMAP_BITS, the
+ * bitmap area of a block starts with summary words, one bit per bitmap word
+ * set when the word is full, and the upper half of info counts the used
+ * chunks, so a free chunk is found with two ctz and emptiness is checked
+ * on the counter.
+ */
+static inline uint64_t
+_nst_memory_summary_words(nst_memory_t *memory) {
+    return (memory->block_size / memory->chunk_size / 64 + 63) / 64;
+}
+
+static inline uint64_t
+_nst_memory_bitmap_size(nst_memory_t *memory) {
+    return memory->block_size / memory->chunk_size / 8 + _nst_memory_summary_words(memory) * 8;
+}
+
+/*
+ * The size class of an allocation of size bytes, size <= block_size
+ */
+static inline int
+_nst_memory_class(nst_memory_t *memory, uint64_t size) {
+    int  shift = memory->chunk_shift;
+    int  fine  = shift > NST_MEMORY_CLASS_FINE_SHIFT ? shift : NST_MEMORY_CLASS_FINE_SHIFT;
+    int  step, k;
+
+    if(size <= 1ULL << shift) {
+        return 0;
+    }
+
+    /* 2^k < size <= 2^(k+1) */
+    k = 63 - __builtin_clzll(size - 1);
+
+    if(k < fine) {
+        return k + 1 - shift;
+    }
+
+    step = k - NST_MEMORY_CLASS_STEP_SHIFT;
+
+    return fine - shift + ((k - fine) << NST_MEMORY_CLASS_STEP_SHIFT)
+        + ((size - (1ULL << k) + (1ULL << step) - 1) >> step);
+}
+
+struct nst_memory_prefault {
+    pthread_t     thread;
+    uint8_t      *start;
+    uint8_t      *stop;
+};
+
+static void *
+_nst_memory_prefault_thread(void *arg) {
+    struct nst_memory_prefault  *pf = arg;
+    uint8_t                     *p;
+
+    /* the memory is still zero, writing it allocates the page */
+    for(p = pf->start; p < pf->stop; p += NST_MEMORY_PAGE_SIZE) {
+        *(volatile uint8_t *)p = 0;
+    }
+
+    return NULL;
+}
+
+/*
+ * Fault in all pages of [p, p + size) with n threads, or with the calling
+ * one if threads cannot be created.
+ */
+static void
+_nst_memory_prefault(uint8_t *p, uint64_t size, int n) {
+    struct nst_memory_prefault  *pf;
+    struct nst_memory_prefault   all = { .start = p, .stop = p + size };
+    uint64_t                     slice;
+    int                          i;
+
+    pf = calloc(n, sizeof(*pf));
+
+    if(!pf) {
+        _nst_memory_prefault_thread(&all);
+
+        return;
+    }
+
+    slice = (size / n + NST_MEMORY_PAGE_SIZE - 1) / NST_MEMORY_PAGE_SIZE * NST_MEMORY_PAGE_SIZE;
+
+    for(i = 0; i < n; i++) {
+        pf[i].start = p + slice * i < p + size ? p + slice * i : p + size;
+        pf[i].stop  = pf[i].start + slice < p + size ? pf[i].start + slice : p + size;
+
+        if(pthread_create(&pf[i].thread, NULL, _nst_memory_prefault_thread, &pf[i])) {
+            _nst_memory_prefault_thread(&pf[i]);
+
+            pf[i].stop = NULL;
+        }
+    }
+
+    for(i = 0; i < n; i++) {
+
+        if(pf[i].stop) {
+            pthread_join(pf[i].thread, NULL);
+        }
+    }
+
+    free(pf);
+}
+
+static void
+_nst_memory_advise(uint8_t *p, uint64_t size, int pages) {
+
+#ifdef MADV_HUGEPAGE
+    if(pages == NST_MEMORY_PAGES_TRANSPARENT && madvise(p, size, MADV_HUGEPAGE)) {
+        fprintf(stderr, "Transparent huge pages not available.\n");
+    }
+#endif
+
+}
+
+/*
+ * Map size bytes of shared memory, from the new file fd if not -1, from
+ * huge pages or advised to use transparent huge pages if asked. A file
+ * gets huge pages if it is on a hugetlbfs.
+ * The memory is zero, and only the pages written are allocated, unless
+ * prefaulted.
+ */
+static uint8_t *
+_nst_memory_map(uint64_t size, int pages, int prefault, int fd) {
+    uint8_t  *p = MAP_FAILED;
+
+    if(fd != -1) {
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+#ifdef MAP_HUGETLB
+    if(fd == -1 && pages == NST_MEMORY_PAGES_HUGE) {
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED|MAP_HUGETLB, -1, 0);
+
+        if(p == MAP_FAILED) {
+            fprintf(stderr, "No huge pages available, using normal pages.\n");
+        }
+    }
+#endif
+
+    if(fd == -1 && p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+    }
+
+    if(p == MAP_FAILED) {
+        return NULL;
+    }
+
+    _nst_memory_advise(p, size, pages);
+
+    if(prefault > 0) {
+        _nst_memory_prefault(p, size, prefault);
+    }
+
+    return p;
+}
+
+/*
+ * Map the memory left in fd by a previous process, NULL if it cannot be
+ * used as is.
+ */
+static nst_memory_t *
+_nst_memory_attach(int fd, uint64_t size, uint32_t block_size, uint32_t chunk_size,
+        uint64_t layout, int pages) {
+
+    nst_memory_t  header;
+    struct stat   st;
+    uint8_t      *p;
+
+    if(fstat(fd, &st) || (uint64_t)st.st_size != size) {
+        return NULL;
+    }
+
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return NULL;
+    }
+
+    if(header.magic != NST_MEMORY_MAGIC || header.layout != layout || header.root == NULL
+            || header.size != size || header.start + size != header.stop
+            || header.block_size != block_size || header.chunk_size != chunk_size) {
+
+        return NULL;
+    }
+
+#ifdef MAP_FIXED_NOREPLACE
+    p = mmap(header.start, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED_NOREPLACE, fd, 0);
+#else
+    p = mmap(header.start, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+
+    if(p == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* taken by something else in this process */
+    if(p != header.start) {
+        munmap(p, size);
+
+        return NULL;
+    }
+
+    _nst_memory_advise(p, size, pages);
+
+    return (nst_memory_t *)p;
+}
+
+/*
+ * Return the memory left in file if it can be used as is, otherwise NULL
+ * and fd set to an empty file of size which replaces it, or -1 on error.
+ * The file is never truncated, the workers of the previous configuration
+ * may still use it, they keep the old one once it is replaced.
+ * The descriptor is left open with a shared lock, inherited by the
+ * workers, so that a process which gets the lock exclusively knows that
+ * no process uses the memory any more, see orphaned.
+ */
+static nst_memory_t *
+_nst_memory_open(char *file, uint64_t size, uint32_t block_size, uint32_t chunk_size,
+        uint64_t layout, int pages, int *fd) {
+
+    nst_memory_t  *memory;
+    char           tmp[PATH_MAX];
+    int            orphaned;
+
+    *fd = open(file, O_RDWR|O_CLOEXEC);
+
+    if(*fd != -1) {
+        orphaned = flock(*fd, LOCK_EX|LOCK_NB) == 0;
+        memory   = _nst_memory_attach(*fd, size, block_size, chunk_size, layout, pages);
+
+        if(memory && flock(*fd, LOCK_SH) == 0) {
+            memory->orphaned = orphaned;
+
+            return memory;
+        }
+
+        if(memory) {
+            munmap(memory, size);
+        }
+
+        close(*fd);
+    } else if(errno != ENOENT) {
+        fprintf(stderr, "Cannot open `%s`: %s.\n", file, strerror(errno));
+
+        return NULL;
+    }
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "File name `%s` is too long.\n", file);
+
+        *fd = -1;
+
+        return NULL;
+    }
+
+    /* left by a process which failed to create it */
+    unlink(tmp);
+
+    *fd = open(tmp, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+
+    if(*fd == -1 || ftruncate(*fd, size) || flock(*fd, LOCK_SH) || rename(tmp, file)) {
+        fprintf(stderr, "Cannot create `%s`: %s.\n", tmp, strerror(errno));
+
+        if(*fd != -1) {
+            close(*fd);
+            unlink(tmp);
+        }
+
+        *fd = -1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Block control structs and bitmaps are not written here, the zero
+ * filled mapping is a valid state for them, see _nst_memory_block_init,
+ * so the pages of a large memory are only touched when first used.
+ *
+ * If file is set the memory is kept in it, and the memory left there by
+ * a previous process with the same layout and sizes is returned as is,
+ * with root set, see nst_memory_t.
+ */
 nst_memory_t *
-nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_size) {
+nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_size,
+        int pages, int prefault, char *file, uint64_t layout) {
+
     uint8_t       *p;
     nst_memory_t  *memory;
     uint64_t       n;
     uint8_t       *begin, *end;
     uint32_t       bitmap_size;
+    int            i, fine, fd = -1;
 
     if(block_size < NST_MEMORY_BLOCK_MIN_SIZE) {
         block_size = NST_MEMORY_BLOCK_MIN_SIZE;
@@ -67,10 +510,27 @@ nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk
 
     size = (size + block_size - 1) / block_size * block_size;
 
-    /* create shared memory */
-    p = (uint8_t *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+    if(pages == NST_MEMORY_PAGES_HUGE) {
+        size = (size + NST_MEMORY_HUGE_PAGE_SIZE - 1)
+            / NST_MEMORY_HUGE_PAGE_SIZE * NST_MEMORY_HUGE_PAGE_SIZE;
+    }
+
+    if(file) {
+        memory = _nst_memory_open(file, size, block_size, chunk_size, layout, pages, &fd);
+
+        if(memory || fd == -1) {
+            return memory;
+        }
+    }
+
+    /* create shared memory, fd is left open, see _nst_memory_open */
+    p = _nst_memory_map(size, pages, prefault, fd);
+
+    if(!p) {
+        if(fd != -1) {
+            close(fd);
+        }
 
-    if(p == MAP_FAILED) {
         fprintf(stderr, "Out of memory when initialization.\n");
 
         return NULL;
@@ -83,6 +543,11 @@ nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk
         strlcpy2(memory->name, name, sizeof(memory->name));
     }
 
+    memory->magic      = NST_MEMORY_MAGIC;
+    memory->layout     = layout;
+    memory->root       = NULL;
+    memory->orphaned   = 0;
+
     memory->start      = p;
     memory->stop       = p + size;
     memory->block_size = block_size;
@@ -90,6 +555,7 @@ nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk
 
     memory->size       = size;
     memory->used       = 0;
+    memory->failed     = 0;
 
     p += sizeof(nst_memory_t);
 
@@ -101,16 +567,41 @@ nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk
     for(n = NST_MEMORY_BLOCK_MIN_SHIFT; (1ULL << n) < block_size; n++) { }
 
     memory->block_shift = n;
-    memory->chunks      = n - memory->chunk_shift + 1;
-    memory->chunk       = (nst_memory_ctrl_t **)p;
+    memory->class       = (nst_memory_class_t *)p;
+    memory->chunks      = 0;
+
+    fine = memory->chunk_shift > NST_MEMORY_CLASS_FINE_SHIFT
+        ? memory->chunk_shift : NST_MEMORY_CLASS_FINE_SHIFT;
+
+    for(n = memory->chunk_shift; n <= fine; n++) {
+        memory->class[memory->chunks++].size = 1U << n;
+    }
+
+    for(n = fine; n < memory->block_shift; n++) {
+
+        for(i = 1; i <= 1 << NST_MEMORY_CLASS_STEP_SHIFT; i++) {
+            memory->class[memory->chunks++].size = (1U << n)
+                + i * (1U << (n - NST_MEMORY_CLASS_STEP_SHIFT));
+        }
+    }
+
+    for(i = 0; i < memory->chunks; i++) {
+        memory->class[i].chunks = block_size / memory->class[i].size;
+        memory->class[i].blocks = 0;
+        memory->class[i].used   = 0;
+    }
+
+    p += memory->chunks * sizeof(nst_memory_class_t);
+
+    memory->chunk = (nst_memory_ctrl_t **)p;
 
     p += memory->chunks * sizeof(nst_memory_ctrl_t *);
 
     memory->block = (nst_memory_ctrl_t *)p;
-    memory->empty = NULL;
     memory->full  = NULL;
+    memory->evac  = NULL;
 
-    bitmap_size = block_size / chunk_size / 8;
+    bitmap_size = _nst_memory_bitmap_size(memory);
 
     /* set data begin */
     n = (memory->stop - p) / (sizeof(nst_memory_ctrl_t) + block_size + bitmap_size);
@@ -147,32 +638,29 @@ nst_memory_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk
         memory->chunk[n] = NULL;
     }
 
-    /* initialize block */
-    for(n = 0; n < memory->blocks; n++) {
-        memory->block[n].info   = 0;
-        memory->block[n].bitmap = memory->bitmap + n * bitmap_size;
-        memory->block[n].prev   = NULL;
-        memory->block[n].next   = NULL;
+    for(n = 0; n < NST_MEMORY_RUN_CLASSES; n++) {
+        memory->runs[n] = NULL;
     }
 
+    _nst_memory_run_link(memory, 0, memory->blocks);
+
     return memory;
 }
 
 void *
 _nst_memory_block_alloc(nst_memory_t *memory, nst_memory_ctrl_t *block, int chunk_idx) {
 
-    int  chunk_size = 1<<(memory->chunk_shift + chunk_idx);
-    int  block_idx  = block - memory->block;
-    int  bits_need  = memory->block_size / chunk_size;
-    int  bits_idx   = 0;
-    int  i          = 0;
-    int  unset      = 1;
-    int  full       = 1;
+    nst_memory_class_t  *class     = &memory->class[chunk_idx];
+    int                  block_idx = block - memory->block;
+    int                  bits_need = class->chunks;
+    int                  bits_idx  = 0;
+    int                  full      = 1;
 
-    memory->used += chunk_size;
+    memory->used += class->size;
+    class->used++;
 
     /* use info, should not use anymore */
-    if(chunk_size * NST_MEMORY_INFO_BITMAP_BITS >= memory->block_size) {
+    if(bits_need <= NST_MEMORY_INFO_BITMAP_BITS) {
         uint32_t  mask =  ~0U >> (NST_MEMORY_INFO_BITMAP_BITS - bits_need);
         uint32_t  *v   = (uint32_t *)(&block->info) + 1;
         uint32_t  t    = *v;
@@ -185,35 +673,23 @@ _nst_memory_block_alloc(nst_memory_t *memory, nst_memory_ctrl_t *block, int chun
     }
     /* use bitmap */
     else {
-        uint64_t  *begin;
+        uint64_t  *summary = (uint64_t *)block->bitmap;
+        uint64_t  *begin   = summary + _nst_memory_summary_words(memory);
+        uint32_t  *count   = (uint32_t *)(&block->info) + 1;
+        int        s, w;
 
-        begin = (uint64_t *)block->bitmap;
-        i     = 0;
-        unset = 1;
+        /* the block is not full, so the first zero is a valid word */
+        for(s = 0; summary[s] == ~0ULL; s++) {}
 
-        for(i = 0; i < bits_need / 64; i++) {
-            uint64_t  *v = begin + i;
+        w         = s * 64 + __builtin_ctzll(~summary[s]);
+        bits_idx  = w * 64 + __builtin_ctzll(~begin[w]);
+        begin[w] |= begin[w] + 1;
 
-            if(*v == ~0ULL && unset) {
-                bits_idx += 64;
-
-                continue;
-            }
-
-            if(unset) {
-                uint64_t  t = *v;
-
-                bits_idx  += __builtin_ffsll(~t) - 1;
-                *v        |= *v + 1;
-                unset      = 0;
-            }
-
-            if(*v != ~0ULL) {
-                full = 0;
-
-                break;
-            }
+        if(begin[w] == ~0ULL) {
+            summary[s] |= 1ULL << (w % 64);
         }
+
+        full = ++*count == (uint32_t)bits_need;
     }
 
     /* yes */
@@ -239,20 +715,32 @@ _nst_memory_block_alloc(nst_memory_t *memory, nst_memory_ctrl_t *block, int chun
     }
 
     return (void *)(memory->data.begin + 1ULL * memory->block_size * block_idx
-            + chunk_size * bits_idx);
+            + 1ULL * class->size * bits_idx);
 }
 
 void
 _nst_memory_block_init(nst_memory_t * memory, nst_memory_ctrl_t *block, int chunk_idx) {
     nst_memory_ctrl_t  *chunk;
+    uint32_t            n;
 
-    chunk       = memory->chunk[chunk_idx];
-    block->info = 0;
+    chunk         = memory->chunk[chunk_idx];
+    block->info   = 0;
+    block->bitmap = memory->bitmap + (block - memory->block) * _nst_memory_bitmap_size(memory);
 
     _nst_memory_block_set_type(block, chunk_idx);
     _nst_memory_block_set_inited(block);
 
-    memset(block->bitmap, 0, memory->block_size / memory->chunk_size / 8);
+    memset(block->bitmap, 0, _nst_memory_bitmap_size(memory));
+
+    n = memory->class[chunk_idx].chunks;
+
+    /* the bits after the last chunk are never free */
+    if(n > NST_MEMORY_INFO_BITMAP_BITS && n % 64) {
+        *((uint64_t *)block->bitmap + _nst_memory_summary_words(memory) + n / 64)
+            = ~0ULL << (n % 64);
+    }
+
+    memory->class[chunk_idx].blocks++;
 
     block->prev = NULL;
     block->next = NULL;
@@ -266,71 +754,223 @@ _nst_memory_block_init(nst_memory_t * memory, nst_memory_ctrl_t *block, int chun
     memory->chunk[chunk_idx] = block;
 }
 
+/*
+ * Allocate n contiguous blocks as a run, for sizes above block_size
+ */
+static void *
+_nst_memory_run_alloc_locked(nst_memory_t *memory, uint64_t n) {
+    nst_memory_ctrl_t  *block;
+    int64_t             start;
+    uint64_t            i;
+
+    start = _nst_memory_run_alloc(memory, n);
+
+    if(start < 0) {
+        return NULL;
+    }
+
+    for(i = start; i < start + n; i++) {
+        block       = &memory->block[i];
+        block->info = 0;
+        block->prev = NULL;
+        block->next = NULL;
+
+        _nst_memory_block_set_type(block, NST_MEMORY_BLOCK_TYPE_RUN);
+        _nst_memory_block_set_inited(block);
+    }
+
+    memory->block[start].info |= n << 32;
+    memory->used += n * memory->block_size;
+
+    return (void *)(memory->data.begin + start * memory->block_size);
+}
+
 void *
-nst_memory_alloc_locked(nst_memory_t *memory, int size) {
+nst_memory_alloc_locked(nst_memory_t *memory, uint64_t size) {
     nst_memory_ctrl_t  *chunk, *block;
-    int                 i, chunk_idx = 0;
+    int64_t             block_idx;
+    int                 chunk_idx;
 
-    if(!size || size > memory->block_size) {
+    if(!size) {
         return NULL;
     }
 
-    for(i = (size - 1) >> (memory->chunk_shift - 1); i >>= 1; chunk_idx++) {}
+    if(size > memory->block_size) {
+        return _nst_memory_run_alloc_locked(memory,
+                (size + memory->block_size - 1) / memory->block_size);
+    }
 
-    chunk = memory->chunk[chunk_idx];
+    chunk_idx = _nst_memory_class(memory, size);
+    chunk     = memory->chunk[chunk_idx];
 
     /* check chunk list */
     if(chunk) {
         block = chunk;
     }
-    /* check empty list */
-    else if(memory->empty) {
-        /* remove from empty list */
-        block         = memory->empty;
-        memory->empty = block->next;
+    /* take a free block */
+    else {
+        block_idx = _nst_memory_run_alloc(memory, 1);
 
-        if(memory->empty) {
-            memory->empty->prev = NULL;
+        if(block_idx < 0) {
+            return NULL;
         }
 
+        block = &memory->block[block_idx];
+
         _nst_memory_block_init(memory, block, chunk_idx);
     }
-    /* require new block from unused */
-    else if(memory->data.free <= memory->data.end) {
-        int  block_idx = (memory->data.free - memory->data.begin) / memory->block_size;
 
-        memory->data.free += memory->block_size;
-        block              = &memory->block[block_idx];
+    return _nst_memory_block_alloc(memory, block, chunk_idx);
+}
 
-        if(_nst_memory_block_is_inited(block)) {
-            return NULL;
-        } else {
-            _nst_memory_block_init(memory, block, chunk_idx);
+static THREAD_LOCAL nst_memory_magazines_t  nst_memory_magazines[NST_MEMORY_MAGAZINES];
+
+/*
+ * The magazines of the calling thread for memory, NULL outside of the
+ * workers, the master and the process before the fork have none, or if
+ * the thread already has NST_MEMORY_MAGAZINES memories.
+ */
+static nst_memory_magazines_t *
+_nst_memory_magazines(nst_memory_t *memory) {
+    nst_memory_magazines_t  *mags;
+    uint64_t                 bytes;
+    int                      i, n;
+
+    if(!proc_self || !(proc_self->options & PROC_O_TYPE_WORKER)) {
+        return NULL;
+    }
+
+    for(i = 0; i < NST_MEMORY_MAGAZINES; i++) {
+        mags = &nst_memory_magazines[i];
+
+        if(mags->memory == memory) {
+            return mags;
+        }
+
+        if(mags->memory == NULL) {
+            break;
         }
     }
-    else {
+
+    if(i == NST_MEMORY_MAGAZINES) {
         return NULL;
     }
 
-    return _nst_memory_block_alloc(memory, block, chunk_idx);
+    mags->memory = memory;
+
+    bytes = memory->size / NST_MEMORY_MAGAZINE_SHARE
+        / (global.nbproc * global.nbthread) / memory->chunks;
+
+    if(bytes > NST_MEMORY_MAGAZINE_BYTES) {
+        bytes = NST_MEMORY_MAGAZINE_BYTES;
+    }
+
+    for(i = 0; i < NST_MEMORY_MAGAZINE_CLASSES; i++) {
+        n = i < memory->chunks ? bytes / memory->class[i].size : 0;
+
+        mags->magazine[i].count = 0;
+        mags->magazine[i].size  = n > NST_MEMORY_MAGAZINE_SIZE ? NST_MEMORY_MAGAZINE_SIZE : n;
+    }
+
+    return mags;
 }
 
+/*
+ * Give back the chunks of the magazine which lie in blocks evacuated since
+ * they were cached, nothing new is allocated there, see nst_memory_evacuate.
+ * Called with the memory lock held.
+ */
+static void
+_nst_memory_magazine_evac(nst_memory_t *memory, nst_memory_magazine_t *mag) {
+    int  i, n = 0;
+
+    for(i = 0; i < mag->count; i++) {
+
+        if(nst_memory_evacuating(memory, mag->chunk[i])) {
+            nst_memory_free_locked(memory, mag->chunk[i]);
+        } else {
+            mag->chunk[n++] = mag->chunk[i];
+        }
+    }
+
+    mag->count = n;
+}
+
+/*
+ * Sizes above block_size get a run of contiguous blocks.
+ */
 void *
-nst_memory_alloc(nst_memory_t *memory, int size) {
-    void  *p;
+nst_memory_alloc(nst_memory_t *memory, uint64_t size) {
+    nst_memory_magazines_t  *mags = NULL;
+    nst_memory_magazine_t   *mag;
+    void                    *p;
+    int                      chunk_idx = 0;
 
-    nst_shctx_lock(memory);
-    p = nst_memory_alloc_locked(memory, size);
-    nst_shctx_unlock(memory);
+    if(!size) {
+        return NULL;
+    }
 
-    return p;
+    if(size <= memory->block_size) {
+        chunk_idx = _nst_memory_class(memory, size);
+        mags      = _nst_memory_magazines(memory);
+    }
+
+    if(!mags || chunk_idx >= NST_MEMORY_MAGAZINE_CLASSES || !mags->magazine[chunk_idx].size) {
+        nst_shctx_lock(memory);
+        p = nst_memory_alloc_locked(memory, size);
+        nst_shctx_unlock(memory);
+
+        return p;
+    }
+
+    mag = &mags->magazine[chunk_idx];
+
+    if(mag->count && nst_memory_evacuating(memory, mag->chunk[mag->count - 1])) {
+        nst_shctx_lock(memory);
+        _nst_memory_magazine_evac(memory, mag);
+        nst_shctx_unlock(memory);
+    }
+
+    if(!mag->count) {
+        size = memory->class[chunk_idx].size;
+
+        nst_shctx_lock(memory);
+
+        while(mag->count < (mag->size + 1) / 2) {
+            p = nst_memory_alloc_locked(memory, size);
+
+            if(!p) {
+                break;
+            }
+
+            mag->chunk[mag->count++] = p;
+        }
+
+        nst_shctx_unlock(memory);
+
+        if(!mag->count) {
+            return NULL;
+        }
+    }
+
+    return mag->chunk[--mag->count];
+}
+
+static void
+_nst_memory_run_free_locked(nst_memory_t *memory, nst_memory_ctrl_t *block) {
+    uint64_t  n = block->info >> 32;
+
+    memory->used -= n * memory->block_size;
+
+    _nst_memory_run_free(memory, block - memory->block, n);
 }
 
 void
 nst_memory_free_locked(nst_memory_t *memory, void *p) {
-    nst_memory_ctrl_t  *chunk, *block;
-    uint8_t             chunk_idx;
-    int                 block_idx, chunk_size, bits, bits_idx, empty, full;
+    nst_memory_ctrl_t   *chunk, *block;
+    nst_memory_class_t  *class;
+    uint8_t              chunk_idx;
+    int                  block_idx, bits_idx, empty, full;
 
     if((uint8_t *)p < memory->data.begin || (uint8_t *)p >= memory->data.free) {
         return;
@@ -339,14 +979,35 @@ nst_memory_free_locked(nst_memory_t *memory, void *p) {
     block_idx  = ((uint8_t *)p - memory->data.begin) / memory->block_size;
     block      = &memory->block[block_idx];
     chunk_idx  = block->info & 0xFF;
-    chunk      = memory->chunk[chunk_idx];
-    chunk_size = 1<<(memory->chunk_shift + chunk_idx);
-    bits       = memory->block_size / chunk_size;
+
+    if(chunk_idx == NST_MEMORY_BLOCK_TYPE_RUN) {
+
+        /* only the first block of a run can be freed */
+        if(block->info >> 32) {
+            _nst_memory_run_free_locked(memory, block);
+        }
+
+        return;
+    }
+
+    /* a free block */
+    if(chunk_idx >= memory->chunks) {
+        return;
+    }
+
+    chunk = memory->chunk[chunk_idx];
+    class = &memory->class[chunk_idx];
 
     bits_idx = ((uint8_t *)p - (memory->data.begin + 1ULL * block_idx * memory->block_size))
-        / chunk_size;
+        / class->size;
 
-    memory->used -= chunk_size;
+    /* past the last chunk */
+    if(bits_idx >= class->chunks) {
+        return;
+    }
+
+    memory->used -= class->size;
+    class->used--;
 
     empty = 0;
     full  = _nst_memory_block_is_full(block);
@@ -354,7 +1015,7 @@ nst_memory_free_locked(nst_memory_t *memory, void *p) {
     _nst_memory_block_clear_full(block);
 
     /* info used */
-    if(chunk_size * NST_MEMORY_INFO_BITMAP_BITS >= memory->block_size) {
+    if(class->chunks <= NST_MEMORY_INFO_BITMAP_BITS) {
         block->info &= ~(1ULL << (bits_idx + 32));
 
         if(!(block->info & 0xFFFFFFFF00000000ULL)) {
@@ -363,38 +1024,46 @@ nst_memory_free_locked(nst_memory_t *memory, void *p) {
     }
     /* bitmap used */
     else {
-        int  i;
-        *((uint64_t *)block->bitmap + bits_idx / 64 ) &= ~(1ULL<<(bits_idx % 64));
+        uint64_t  *summary = (uint64_t *)block->bitmap;
+        uint64_t  *begin   = summary + _nst_memory_summary_words(memory);
+        uint32_t  *count   = (uint32_t *)(&block->info) + 1;
 
-        for(i = 0; i < bits / 64; i++) {
+        begin[bits_idx / 64]     &= ~(1ULL << (bits_idx % 64));
+        summary[bits_idx / 4096] &= ~(1ULL << (bits_idx / 64 % 64));
 
-            if(*((uint64_t *)block->bitmap + i) == 0) {
-                empty += 64;
-            }
-        }
+        empty = --*count == 0;
+    }
 
-        if(empty == bits) {
-            empty = 1;
-        } else {
-            empty = 0;
+    if(empty) {
+        class->blocks--;
+    }
+
+    /* evacuated blocks only go back to the free runs */
+    if(_nst_memory_block_is_evac(block)) {
+
+        if(empty) {
+            _nst_memory_list_remove(&memory->evac, block);
+            _nst_memory_run_free(memory, block_idx, 1);
         }
+
+        return;
     }
 
     /*
      * 1. if the block previously was full
-     *  a. if chunk_id is LAST, move the block from full list to empty list
+     *  a. if chunk_id is LAST, move the block from full list to the free runs
      *  b. else move the block from full list to chunk[chunk_idx]
      * 2. else if the block became empty after free
-     *  a. if chunk_id is LAST, move the block from full list to empty list
-     *  b. else move the block from chunk[chunk_idx] to empty list
+     *  a. if chunk_id is LAST, move the block from full list to the free runs
+     *  b. else move the block from chunk[chunk_idx] to the free runs
      * 3. else do nothing
      *
      * 1. if chunk_id is LAST(full && empty)
-     *  a. move the block from full list to empty list
+     *  a. move the block from full list to the free runs
      * 2. else
      *  a. if previously full, move the block from full list to chunk[chunk_idx]
      *  b. else if empty after free, move the block
-     *     from chunk[chunk_idx] to empty list
+     *     from chunk[chunk_idx] to the free runs
      *  c. else do nothing
      */
     /* remove from full list and add to chunk list */
@@ -411,14 +1080,7 @@ nst_memory_free_locked(nst_memory_t *memory, void *p) {
             block->next->prev = block->prev;
         }
 
-        /* add to empty list */
-        block->prev   = NULL;
-        block->next   = memory->empty;
-        memory->empty = block;
-
-        if(block->next) {
-            block->next->prev = block;
-        }
+        _nst_memory_run_free(memory, block_idx, 1);
     } else {
 
         if(full) {
@@ -455,27 +1117,220 @@ nst_memory_free_locked(nst_memory_t *memory, void *p) {
                 block->next->prev = block->prev;
             }
 
-            /* add to empty list */
-            block->prev   = NULL;
-            block->next   = memory->empty;
-            memory->empty = block;
-
-            if(block->next) {
-                block->next->prev = block;
-            }
+            _nst_memory_run_free(memory, block_idx, 1);
         }
     }
 }
 
 void
 nst_memory_free(nst_memory_t *memory, void *p) {
+    nst_memory_magazines_t  *mags;
+    nst_memory_magazine_t   *mag;
+    nst_memory_ctrl_t       *block;
+    uint8_t                  chunk_idx;
 
     if(p == NULL) {
         return;
     }
 
+    mags = _nst_memory_magazines(memory);
+
+    if(mags && (uint8_t *)p >= memory->data.begin && (uint8_t *)p < memory->data.free) {
+        block     = &memory->block[((uint8_t *)p - memory->data.begin) / memory->block_size];
+        /* the type does not change while the chunk is used */
+        chunk_idx = block->info & 0xFF;
+
+        if(chunk_idx < NST_MEMORY_MAGAZINE_CLASSES && mags->magazine[chunk_idx].size
+                && !_nst_memory_block_is_evac(block)) {
+            mag = &mags->magazine[chunk_idx];
+
+            if(mag->count == mag->size) {
+                nst_shctx_lock(memory);
+
+                while(mag->count > mag->size / 2) {
+                    nst_memory_free_locked(memory, mag->chunk[--mag->count]);
+                }
+
+                nst_shctx_unlock(memory);
+            }
+
+            mag->chunk[mag->count++] = p;
+
+            return;
+        }
+    }
+
     nst_shctx_lock(memory);
     nst_memory_free_locked(memory, p);
     nst_shctx_unlock(memory);
 }
 
+/*
+ * Give the chunks in the magazines of the calling thread back when it
+ * leaves, a memory kept in a file would lose them otherwise.
+ */
+static void
+_nst_memory_magazines_flush() {
+    nst_memory_magazines_t  *mags;
+    nst_memory_magazine_t   *mag;
+    int                      i, j;
+
+    for(i = 0; i < NST_MEMORY_MAGAZINES && nst_memory_magazines[i].memory; i++) {
+        mags = &nst_memory_magazines[i];
+
+        nst_shctx_lock(mags->memory);
+
+        for(j = 0; j < NST_MEMORY_MAGAZINE_CLASSES; j++) {
+            mag = &mags->magazine[j];
+
+            while(mag->count) {
+                nst_memory_free_locked(mags->memory, mag->chunk[--mag->count]);
+            }
+        }
+
+        nst_shctx_unlock(mags->memory);
+    }
+}
+
+REGISTER_PER_THREAD_DEINIT(_nst_memory_magazines_flush);
+
+/*
+ * Like nst_memory_alloc, with the memory zeroed. Blocks never used before
+ * are still zero, so a run taken from them is not written and its pages
+ * are only touched when used.
+ */
+void *
+nst_memory_calloc(nst_memory_t *memory, uint64_t size) {
+    uint8_t  *p, *fresh;
+
+    if(size <= memory->block_size) {
+        p = nst_memory_alloc(memory, size);
+        fresh = NULL;
+    } else {
+        nst_shctx_lock(memory);
+
+        fresh = memory->data.free;
+        p     = nst_memory_alloc_locked(memory, size);
+
+        nst_shctx_unlock(memory);
+    }
+
+    if(p && (!fresh || p < fresh)) {
+        memset(p, 0, size);
+    }
+
+    return p;
+}
+
+/*
+ * The bytes actually taken by an allocation of size bytes
+ */
+uint64_t
+nst_memory_size(nst_memory_t *memory, uint64_t size) {
+
+    if(size > memory->block_size) {
+        return (size + memory->block_size - 1) / memory->block_size * memory->block_size;
+    }
+
+    return size ? memory->class[_nst_memory_class(memory, size)].size : 0;
+}
+
+/*
+ * The bytes of the blocks of a class which hold no used chunk,
+ * read without the lock
+ */
+uint64_t
+nst_memory_waste(nst_memory_t *memory, int idx) {
+    nst_memory_class_t  *class = &memory->class[idx];
+    uint64_t             held  = class->blocks * memory->block_size;
+    uint64_t             used  = class->used * class->size;
+
+    return held > used ? held - used : 0;
+}
+
+/*
+ * number of used chunks of a chunk block
+ */
+static inline uint32_t
+_nst_memory_block_used(nst_memory_t *memory, nst_memory_ctrl_t *block) {
+    uint32_t  v = block->info >> 32;
+
+    if(memory->class[block->info & 0xFF].chunks <= NST_MEMORY_INFO_BITMAP_BITS) {
+        return __builtin_popcount(v);
+    }
+
+    return v;
+}
+
+/*
+ * Move up to max sparse blocks to the evac list, only as long as the other
+ * blocks of their class have room for the chunks used in them.
+ * Return the number of blocks moved.
+ * Only called by master housekeeping.
+ */
+int
+nst_memory_evacuate(nst_memory_t *memory, int max) {
+    nst_memory_class_t  *class;
+    nst_memory_ctrl_t   *block, *next;
+    uint64_t             room, used;
+    uint32_t             n;
+    int                  i, count = 0;
+
+    nst_shctx_lock(memory);
+
+    for(i = 0; i < memory->chunks && count < max; i++) {
+        class = &memory->class[i];
+
+        if(class->chunks < NST_MEMORY_EVAC_SPARSE || class->blocks < 2) {
+            continue;
+        }
+
+        /* free chunks in the blocks of the class, and the used ones to move */
+        room = class->blocks * class->chunks - class->used;
+        used = 0;
+
+        for(block = memory->chunk[i]; block && count < max; block = next) {
+            next = block->next;
+            n    = _nst_memory_block_used(memory, block);
+
+            if(n * NST_MEMORY_EVAC_SPARSE > class->chunks) {
+                continue;
+            }
+
+            if(room - (class->chunks - n) < used + n) {
+                break;
+            }
+
+            room -= class->chunks - n;
+            used += n;
+
+            _nst_memory_list_remove(&memory->chunk[i], block);
+            _nst_memory_block_set_evac(block);
+            _nst_memory_list_add(&memory->evac, block);
+
+            count++;
+        }
+    }
+
+    nst_shctx_unlock(memory);
+
+    return count;
+}
+
+/*
+ * Only called by master housekeeping.
+ */
+void
+nst_memory_evacuate_end(nst_memory_t *memory) {
+    nst_memory_ctrl_t  *block;
+
+    nst_shctx_lock(memory);
+
+    while((block = memory->evac) != NULL) {
+        _nst_memory_list_remove(&memory->evac, block);
+        _nst_memory_block_clear_evac(block);
+        _nst_memory_list_add(&memory->chunk[block->info & 0xFF], block);
+    }
+
+    nst_shctx_unlock(memory);
+}
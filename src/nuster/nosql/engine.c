@@ -33,7 +33,8 @@ nst_nosql_handler(hpx_appctx_t *appctx) {
     hpx_stream_t            *s       = si_strm(si);
     hpx_channel_t           *req     = si_oc(si);
     hpx_channel_t           *res     = si_ic(si);
-    nst_ring_item_t         *item    = NULL;
+    nst_ring_data_t         *data;
+    nst_ring_item_t         *item;
     hpx_buffer_t            *buf;
     hpx_htx_t               *req_htx, *res_htx;
     hpx_htx_blk_type_t       type;
@@ -74,8 +75,11 @@ nst_nosql_handler(hpx_appctx_t *appctx) {
             break;
         case NST_NOSQL_APPCTX_STATE_HIT_MEMORY:
 
-            if(appctx->ctx.nuster.store.ring.item) {
-                item = appctx->ctx.nuster.store.ring.item;
+            data = appctx->ctx.nuster.store.ring.data;
+            item = nst_ring_item_get(data, &appctx->ctx.nuster.store.ring.extent,
+                    &appctx->ctx.nuster.store.ring.offset);
+
+            if(item) {
 
                 while(item) {
 
@@ -85,7 +89,10 @@ nst_nosql_handler(hpx_appctx_t *appctx) {
                         goto out;
                     }
 
-                    item = item->next;
+                    nst_ring_item_skip(item, &appctx->ctx.nuster.store.ring.offset);
+
+                    item = nst_ring_item_get(data, &appctx->ctx.nuster.store.ring.extent,
+                            &appctx->ctx.nuster.store.ring.offset);
                 }
 
             } else {
@@ -108,11 +115,10 @@ nst_nosql_handler(hpx_appctx_t *appctx) {
                     htx_to_buf(req_htx, &req->buf);
                 }
 
-                nst_ring_data_detach(&nuster.nosql->store.ring, appctx->ctx.nuster.store.ring.data);
+                nst_ring_data_detach(&nuster.nosql->store.ring, data);
             }
 
 out:
-            appctx->ctx.nuster.store.ring.item = item;
             total = res_htx->data - total;
 
             if(total) {
@@ -315,42 +321,50 @@ nst_nosql_housekeeping() {
         int  disk_saver   = global.nuster.nosql.disk_saver;
         int  ms           = 10;
         int  ratio        = 1;
+        int  evicted;
+
+        nst_dict_rehash(&nuster.nosql->dict);
 
         start = get_current_timestamp();
 
         while(dict_cleaner--) {
-            nst_dict_cleanup(&nuster.nosql->dict);
+
+            if(nst_dict_cleanup(&nuster.nosql->dict) != NST_OK) {
+                break;
+            }
 
             if(get_current_timestamp() - start >= ms) {
                 break;
             }
         }
 
-        start = get_current_timestamp();
-
-        if(data_cleaner > nuster.nosql->store.ring.count) {
-            data_cleaner = nuster.nosql->store.ring.count;
-        }
+        evicted = nst_dict_evict(&nuster.nosql->dict);
 
         if(nuster.nosql->store.ring.count) {
             ratio = nuster.nosql->store.ring.invalid * 10 / nuster.nosql->store.ring.count;
         }
 
         if(ratio >= 2) {
-            data_cleaner = nuster.nosql->store.ring.count;
+            data_cleaner = nuster.nosql->store.ring.invalid;
 
             ms = ms * ratio ;
             ms = ms >= 100 ? 100 : ms;
         }
 
-        while(data_cleaner--) {
-            nst_ring_cleanup(&nuster.nosql->store.ring);
+        /* release the memory of evicted data right away */
+        if(evicted) {
+            data_cleaner = nuster.nosql->store.ring.invalid;
 
-            if(get_current_timestamp() - start >= ms) {
-                break;
-            }
+            ms = 100;
         }
 
+        /* only invalid data are checked */
+        nst_ring_cleanup(&nuster.nosql->store.ring, data_cleaner);
+
+        nst_core_reclaim(nuster.nosql);
+
+        nst_ring_compact(nuster.nosql);
+
         start = get_current_timestamp();
         ms    = 10;
 
@@ -392,39 +406,71 @@ nst_nosql_init() {
 
         global.nuster.nosql.memory = nst_memory_create("nosql.shm",
                 global.nuster.nosql.dict_size + global.nuster.nosql.data_size,
-                global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE);
+                global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE,
+                global.nuster.nosql.huge_pages, global.nuster.nosql.prefault,
+                global.nuster.nosql.shm_file,
+                nst_core_layout(global.nuster.nosql.dict_engine, global.nuster.nosql.dict_size,
+                    global.nuster.nosql.data_size, global.nuster.nosql.root));
 
         if(!global.nuster.nosql.memory) {
             goto shm_err;
         }
 
-        if(nst_shctx_init(global.nuster.nosql.memory) != NST_OK) {
-            goto shm_err;
-        }
+        if(global.nuster.nosql.memory->root) {
+            nuster.nosql = global.nuster.nosql.memory->root;
 
-        nuster.nosql = nst_memory_alloc(global.nuster.nosql.memory, sizeof(nst_core_t));
+            if(nst_core_attach(nuster.nosql, NST_MODE_NOSQL, global.nuster.nosql.root) != NST_OK) {
+                goto shm_err;
+            }
 
-        if(!nuster.nosql) {
-            goto err;
-        }
+            ha_notice("[nuster][nosql] attached %s, %"PRIu64" entries\n",
+                    global.nuster.nosql.shm_file, nuster.nosql->dict.used);
+        } else {
+            if(nst_shctx_init(global.nuster.nosql.memory) != NST_OK) {
+                goto shm_err;
+            }
 
-        memset(nuster.nosql, 0, sizeof(*nuster.nosql));
+            nuster.nosql = nst_memory_alloc(global.nuster.nosql.memory, sizeof(nst_core_t));
 
-        nuster.nosql->memory = global.nuster.nosql.memory;
-        nuster.nosql->root   = global.nuster.nosql.root;
+            if(!nuster.nosql) {
+                goto err;
+            }
 
-        if(nst_store_init(global.nuster.nosql.root, &nuster.nosql->store,
-                    global.nuster.nosql.memory) != NST_OK) {
+            memset(nuster.nosql, 0, sizeof(*nuster.nosql));
 
-            goto err;
-        }
+            nuster.nosql->memory = global.nuster.nosql.memory;
+            nuster.nosql->root   = global.nuster.nosql.root;
+
+            if(nst_epoch_init(&nuster.nosql->epoch, global.nuster.nosql.memory,
+                        global.nbproc * MAX_THREADS) != NST_OK) {
+
+                goto err;
+            }
+
+            if(nst_store_init(global.nuster.nosql.root, &nuster.nosql->store,
+                        global.nuster.nosql.memory, &nuster.nosql->epoch) != NST_OK) {
+
+                goto err;
+            }
+
+            if(nst_dict_init(&nuster.nosql->dict, &nuster.nosql->store, global.nuster.nosql.memory,
+                        global.nuster.nosql.dict_size, global.nuster.nosql.dict_engine,
+                        &nuster.nosql->epoch) != NST_OK) {
 
-        if(nst_dict_init(&nuster.nosql->dict, &nuster.nosql->store, global.nuster.nosql.memory,
-                    global.nuster.nosql.dict_size) != NST_OK) {
+                goto err;
+            }
 
-            goto err;
+            if(nst_core_bind(nuster.nosql, NST_MODE_NOSQL) != NST_OK) {
+                goto err;
+            }
+
+            /* the memory can be attached from now on */
+            global.nuster.nosql.memory->root = nuster.nosql;
         }
 
+        nst_dict_evict_init(&nuster.nosql->dict, global.nuster.nosql.evict,
+                global.nuster.nosql.evict_high, global.nuster.nosql.evict_low);
+
         ha_notice("[nuster][nosql] on, dict_size=%"PRIu64", data_size=%"PRIu64"\n",
                 global.nuster.nosql.dict_size, global.nuster.nosql.data_size);
     }
@@ -485,9 +531,31 @@ nst_nosql_check_applet(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
     return 0;
 }
 
-nst_ring_item_t *
+/*
+ * Append a header block of size bytes to the header buffer, stored as
+ * the info followed by the value the way it is written to disk.
+ * Return the value to fill in, NULL if there is no room.
+ */
+static char *
+_nst_nosql_header_add(hpx_buffer_t *header, nst_http_txn_t *txn, uint32_t info, uint32_t size) {
+    char  *p = b_tail(header);
+
+    if(b_room(header) < 4 + size) {
+        return NULL;
+    }
+
+    memcpy(p, &info, 4);
+
+    b_add(header, 4 + size);
+
+    txn->res.header_len += 4 + size;
+
+    return p + 4;
+}
+
+hpx_buffer_t *
 _nst_nosql_create_header(hpx_stream_t *s, nst_http_txn_t *txn) {
-    nst_ring_item_t     *item_sl, *item_ct, *item_te, *item_eoh, *tail;
+    hpx_buffer_t        *header;
     hpx_htx_blk_type_t   type;
     hpx_htx_sl_t        *sl;
     uint32_t             size, info;
@@ -499,7 +567,11 @@ _nst_nosql_create_header(hpx_stream_t *s, nst_http_txn_t *txn) {
     hpx_ist_t            p3   = ist("OK");
     char                *data = NULL;
 
-    item_sl = item_ct = item_te = item_eoh = tail = NULL;
+    header = alloc_trash_chunk();
+
+    if(!header) {
+        return NULL;
+    }
 
     /* status line */
     type  = HTX_BLK_RES_SL;
@@ -507,16 +579,12 @@ _nst_nosql_create_header(hpx_stream_t *s, nst_http_txn_t *txn) {
     size  = sizeof(*sl) + p1.len + p2.len + p3.len;
     info += size;
 
-    txn->res.header_len += 4 + size;
-
-    item_sl = nst_ring_alloc_item(&nuster.nosql->store.ring, size);
+    data = _nst_nosql_header_add(header, txn, info, size);
 
-    if(!item_sl) {
+    if(!data) {
         goto err;
     }
 
-    data = item_sl->data;
-
     sl = (hpx_htx_sl_t *)data;
     sl->hdrs_bytes = -1;
 
@@ -529,87 +597,52 @@ _nst_nosql_create_header(hpx_stream_t *s, nst_http_txn_t *txn) {
     memcpy(HTX_SL_P2_PTR(sl), p2.ptr, p2.len);
     memcpy(HTX_SL_P3_PTR(sl), p3.ptr, p3.len);
 
-    item_sl->info = info;
-
-    tail = item_sl;
-
     /* content-type */
     type  = HTX_BLK_HDR;
     info  = type << 28;
     size  = ctk.len + txn->req.content_type.len;
     info += (txn->req.content_type.len << 8) + ctk.len;
 
-    item_ct = nst_ring_alloc_item(&nuster.nosql->store.ring, size);
+    data = _nst_nosql_header_add(header, txn, info, size);
 
-    if(!item_ct) {
+    if(!data) {
         goto err;
     }
 
-    data = item_ct->data;
-
-    txn->res.header_len += 4 + size;
-
     ist2bin_lc(data, ctk);
     memcpy(data + ctk.len, txn->req.content_type.ptr, txn->req.content_type.len);
 
-    item_ct->info = info;
-
-    tail->next = item_ct;
-    tail       = item_ct;
-
     /* transfer-encoding */
     type  = HTX_BLK_HDR;
     info  = type << 28;
     size  = tek.len + tev.len;
     info += (tev.len << 8) + tek.len;
 
-    item_te = nst_ring_alloc_item(&nuster.nosql->store.ring, size);
+    data = _nst_nosql_header_add(header, txn, info, size);
 
-    if(!item_te) {
+    if(!data) {
         goto err;
     }
 
-    data = item_te->data;
-
-    txn->res.header_len += 4 + size;
-
     ist2bin_lc(data, tek);
     memcpy(data + tek.len, tev.ptr, tev.len);
 
-    item_te->info = info;
-
-    tail->next = item_te;
-    tail       = item_te;
-
     /* eoh */
     type  = HTX_BLK_EOH;
     info  = type << 28;
     size  = 1;
     info += size;
 
-    item_eoh = nst_ring_alloc_item(&nuster.nosql->store.ring, size);
+    data = _nst_nosql_header_add(header, txn, info, size);
 
-    if(!item_eoh) {
+    if(!data) {
         goto err;
     }
 
-    data = item_eoh->data;
-
-    txn->res.header_len += 4 + size;
-
-    item_eoh->info = info;
-
-    tail->next = item_eoh;
-    tail       = item_eoh;
-    tail->next = NULL;
-
-    return item_sl;
+    return header;
 
 err:
-    nst_memory_free(nuster.nosql->memory, item_sl);
-    nst_memory_free(nuster.nosql->memory, item_ct);
-    nst_memory_free(nuster.nosql->memory, item_te);
-    nst_memory_free(nuster.nosql->memory, item_eoh);
+    free_trash_chunk(header);
 
     return NULL;
 }
@@ -617,9 +650,10 @@ err:
 void
 nst_nosql_create(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
     nst_dict_entry_t    *entry  = NULL;
-    nst_ring_item_t     *item   = NULL;
-    nst_ring_item_t     *header = NULL;
+    hpx_buffer_t        *header = NULL;
+    nst_ring_item_t     *item;
     nst_key_t           *key;
+    char                *p;
     int                  idx;
 
     header = _nst_nosql_create_header(s, &ctx->txn);
@@ -635,7 +669,7 @@ nst_nosql_create(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
 
     ctx->state = NST_CTX_STATE_CREATE;
 
-    nst_shctx_lock(&nuster.nosql->dict);
+    nst_dict_lock(&nuster.nosql->dict, key->hash);
 
     entry = nst_dict_get(&nuster.nosql->dict, key);
 
@@ -660,7 +694,7 @@ nst_nosql_create(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         }
     }
 
-    nst_shctx_unlock(&nuster.nosql->dict);
+    nst_dict_unlock(&nuster.nosql->dict, key->hash);
 
     /* init store data */
 
@@ -688,47 +722,33 @@ nst_nosql_create(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
     if(ctx->state == NST_CTX_STATE_CREATE || ctx->state == NST_CTX_STATE_UPDATE) {
 
         if(nst_store_memory_on(ctx->rule->store) && ctx->store.ring.data) {
-            ctx->store.ring.data->item = header;
+            p = b_head(header);
 
-            item = header;
-
-            while(item) {
-                ctx->store.ring.item = item;
-
-                item = item->next;
-            }
-        }
+            while(p < b_tail(header)) {
+                int  ret;
 
-        if(nst_store_disk_on(ctx->rule->store) && ctx->store.disk.file) {
-            item = header;
+                item = (nst_ring_item_t *)p;
 
-            while(item) {
-                int  sz = ((item->info & 0xff) + ((item->info >> 8) & 0xfffff));
+                ret = nst_ring_store_add(&nuster.nosql->store.ring, ctx->store.ring.data,
+                        &ctx->store.ring.tail, item->data, nst_ring_item_size(item), item->info);
 
-                nst_disk_store_add(&nuster.nosql->store.disk, &ctx->store.disk,
-                        (char *)&item->info, 4);
+                if(ret == NST_ERR) {
+                    ctx->store.ring.data = NULL;
 
-                nst_disk_store_add(&nuster.nosql->store.disk, &ctx->store.disk, item->data, sz);
+                    break;
+                }
 
-                item = item->next;
+                p += 4 + nst_ring_item_size(item);
             }
         }
 
-        if(nst_store_memory_off(ctx->rule->store)) {
-            item = header;
-
-            while(item) {
-                nst_ring_item_t  *t = item;
-
-                item = item->next;
-
-                nst_memory_free(nuster.nosql->memory, t);
-            }
+        if(nst_store_disk_on(ctx->rule->store) && ctx->store.disk.file) {
+            nst_disk_store_add(&nuster.nosql->store.disk, &ctx->store.disk,
+                    b_head(header), b_data(header));
         }
     }
 
-err:
-    return;
+    free_trash_chunk(header);
 }
 
 int
@@ -770,7 +790,7 @@ nst_nosql_update(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 int  ret;
 
                 ret = nst_ring_store_add(&nuster.nosql->store.ring, ctx->store.ring.data,
-                        &ctx->store.ring.item, data.ptr, data.len, info);
+                        &ctx->store.ring.tail, data.ptr, data.len, info);
 
                 if(ret == NST_ERR) {
                     ctx->store.ring.data = NULL;
@@ -792,7 +812,7 @@ nst_nosql_update(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 int  ret;
 
                 ret = nst_ring_store_add(&nuster.nosql->store.ring, ctx->store.ring.data,
-                        &ctx->store.ring.item, htx_get_blk_ptr(htx, blk), sz, blk->info);
+                        &ctx->store.ring.tail, htx_get_blk_ptr(htx, blk), sz, blk->info);
 
                 if(ret == NST_ERR) {
                     ctx->store.ring.data = NULL;
@@ -852,7 +872,7 @@ nst_nosql_finish(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
             int  ret;
 
             ret = nst_ring_store_add(&nuster.nosql->store.ring, ctx->store.ring.data,
-                    &ctx->store.ring.item, "", size, info);
+                    &ctx->store.ring.tail, "", size, info);
 
             if(ret == NST_ERR) {
                 ctx->store.ring.data = NULL;
@@ -862,20 +882,18 @@ nst_nosql_finish(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
 
     if(nst_store_memory_on(ctx->rule->store) && ctx->store.ring.data) {
 
-        nst_shctx_lock(&nuster.nosql->dict);
+        nst_dict_lock(&nuster.nosql->dict, key->hash);
 
         if(ctx->entry && ctx->entry->state != NST_DICT_ENTRY_STATE_INVALID
                 && ctx->entry->store.ring.data) {
 
-            ctx->entry->store.ring.data->invalid = 1;
-
-            nst_ring_incr_invalid(&nuster.nosql->store.ring);
+            nst_ring_data_invalidate(&nuster.nosql->store.ring, ctx->entry->store.ring.data);
         }
 
         ctx->entry->state = NST_DICT_ENTRY_STATE_VALID;
         ctx->entry->store.ring.data = ctx->store.ring.data;
 
-        nst_shctx_unlock(&nuster.nosql->dict);
+        nst_dict_unlock(&nuster.nosql->dict, key->hash);
     }
 
     if(nst_store_disk_on(ctx->rule->store) && ctx->store.disk.file) {
@@ -898,16 +916,22 @@ nst_nosql_finish(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
     }
 
 
+    nst_dict_lock(&nuster.nosql->dict, key->hash);
+
     if(ctx->entry->state != NST_DICT_ENTRY_STATE_VALID) {
         ctx->state = NST_CTX_STATE_INVALID;
         ctx->entry->state = NST_DICT_ENTRY_STATE_INIT;
     }
 
+    nst_dict_schedule(&nuster.nosql->dict, ctx->entry);
+
+    nst_dict_unlock(&nuster.nosql->dict, key->hash);
 }
 
 int
 nst_nosql_exists(nst_ctx_t *ctx) {
     nst_dict_entry_t  *entry = NULL;
+    nst_epoch_slot_t  *slot;
     nst_key_t         *key;
     int                ret, idx;
 
@@ -922,31 +946,45 @@ nst_nosql_exists(nst_ctx_t *ctx) {
     if(!nst_key_memory_checked(key)) {
         nst_key_memory_set_checked(key);
 
-        nst_shctx_lock(&nuster.nosql->dict);
+        slot = nst_epoch_enter(&nuster.nosql->epoch);
 
-        entry = nst_dict_get(&nuster.nosql->dict, key);
+        if(slot) {
 
-        if(entry) {
+            if(nst_dict_get_hit(&nuster.nosql->dict, key, &ctx->store.ring.data)) {
+                ret = NST_CTX_STATE_HIT_MEMORY;
+            }
+
+            nst_epoch_leave(slot);
+        }
+
+        if(ret == NST_CTX_STATE_INIT) {
+
+            nst_dict_lock(&nuster.nosql->dict, key->hash);
+
+            entry = nst_dict_get(&nuster.nosql->dict, key);
 
-            if(entry->state == NST_DICT_ENTRY_STATE_VALID
-                    || entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
+            if(entry) {
 
-                if(entry->store.ring.data) {
-                    ctx->store.ring.data = entry->store.ring.data;
-                    nst_ring_data_attach(&nuster.nosql->store.ring, ctx->store.ring.data);
-                    ret = NST_CTX_STATE_HIT_MEMORY;
-                } else if(entry->store.disk.file) {
-                    ctx->store.disk.file = entry->store.disk.file;
-                    ret = NST_CTX_STATE_HIT_DISK;
+                if(entry->state == NST_DICT_ENTRY_STATE_VALID
+                        || entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
+
+                    if(entry->store.ring.data) {
+                        ctx->store.ring.data = entry->store.ring.data;
+                        nst_ring_data_attach(&nuster.nosql->store.ring, ctx->store.ring.data);
+                        ret = NST_CTX_STATE_HIT_MEMORY;
+                    } else if(entry->store.disk.file) {
+                        ctx->store.disk.file = entry->store.disk.file;
+                        ret = NST_CTX_STATE_HIT_DISK;
+                    }
                 }
-            }
 
-            if(entry->state == NST_DICT_ENTRY_STATE_INIT) {
-                ret = NST_CTX_STATE_INIT;
+                if(entry->state == NST_DICT_ENTRY_STATE_INIT) {
+                    ret = NST_CTX_STATE_INIT;
+                }
             }
-        }
 
-        nst_shctx_unlock(&nuster.nosql->dict);
+            nst_dict_unlock(&nuster.nosql->dict, key->hash);
+        }
     }
 
     if(ret == NST_CTX_STATE_INIT) {
@@ -969,12 +1007,21 @@ nst_nosql_exists(nst_ctx_t *ctx) {
             nst_key_disk_set_checked(key);
 
             if(ctx->store.disk.file) {
-                if(nst_disk_data_valid(&ctx->store.disk, key) != NST_OK) {
+                if(nst_disk_data_valid(&ctx->store.disk, key, 0) != NST_OK) {
                     ret = NST_CTX_STATE_INIT;
 
-                    if(entry && entry->state == NST_DICT_ENTRY_STATE_VALID) {
+                    /* the entry may have been released since the lookup */
+                    nst_dict_lock(&nuster.nosql->dict, key->hash);
+
+                    if(entry && nst_dict_get(&nuster.nosql->dict, key) == entry
+                            && entry->state == NST_DICT_ENTRY_STATE_VALID) {
+
                         entry->state = NST_DICT_ENTRY_STATE_INVALID;
+
+                        nst_dict_schedule(&nuster.nosql->dict, entry);
                     }
+
+                    nst_dict_unlock(&nuster.nosql->dict, key->hash);
                 }
             } else {
                 ret = NST_CTX_STATE_INIT;
@@ -1015,7 +1062,13 @@ nst_nosql_abort(nst_ctx_t *ctx) {
         }
     }
 
+    nst_dict_lock(&nuster.nosql->dict, ctx->entry->key.hash);
+
     ctx->entry->state = NST_DICT_ENTRY_STATE_INVALID;
+
+    nst_dict_schedule(&nuster.nosql->dict, ctx->entry);
+
+    nst_dict_unlock(&nuster.nosql->dict, ctx->entry->key.hash);
 }
 
 /*
@@ -1028,7 +1081,7 @@ nst_nosql_delete(nst_key_t *key) {
     nst_dict_entry_t  *entry = NULL;
     int                ret   = 0;
 
-    nst_shctx_lock(&nuster.nosql->dict);
+    nst_dict_lock(&nuster.nosql->dict, key->hash);
 
     entry = nst_dict_get(&nuster.nosql->dict, key);
 
@@ -1041,10 +1094,9 @@ nst_nosql_delete(nst_key_t *key) {
             entry->expire = 0;
 
             if(entry->store.ring.data) {
-                entry->store.ring.data->invalid = 1;
-                entry->store.ring.data          = NULL;
+                nst_ring_data_invalidate(&nuster.nosql->store.ring, entry->store.ring.data);
 
-                nst_ring_incr_invalid(&nuster.nosql->store.ring);
+                entry->store.ring.data = NULL;
             }
 
             if(entry->store.disk.file) {
@@ -1053,6 +1105,8 @@ nst_nosql_delete(nst_key_t *key) {
                 entry->store.disk.file = NULL;
             }
 
+            nst_dict_schedule(&nuster.nosql->dict, entry);
+
             ret = 1;
         }
 
@@ -1060,7 +1114,7 @@ nst_nosql_delete(nst_key_t *key) {
         ret = 0;
     }
 
-    nst_shctx_unlock(&nuster.nosql->dict);
+    nst_dict_unlock(&nuster.nosql->dict, key->hash);
 
     if(!nuster.nosql->store.disk.loaded && global.nuster.nosql.root.len){
         nst_disk_data_t  disk;
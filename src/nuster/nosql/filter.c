@@ -63,31 +63,12 @@ _nst_nosql_filter_attach(hpx_stream_t *s, hpx_filter_t *filter) {
     nst_debug(s, "[nosql] ===== attach =====");
 
     if(!filter->ctx) {
-        nst_ctx_t  *ctx;
-        int         rule_cnt, key_cnt, size;
-
-        rule_cnt = nuster.proxy[conf->pid]->rule_cnt;
-        key_cnt  = nuster.proxy[conf->pid]->key_cnt;
-
-        size = sizeof(nst_ctx_t) + key_cnt * sizeof(nst_key_t);
-
-        ctx = calloc(1, size);
+        nst_ctx_t  *ctx = nst_ctx_alloc(conf->pid);
 
         if(ctx == NULL) {
             return 0;
         }
 
-        ctx->state    = NST_CTX_STATE_INIT;
-        ctx->pid      = conf->pid;
-        ctx->rule_cnt = rule_cnt;
-        ctx->key_cnt  = key_cnt;
-
-        if(nst_http_txn_attach(&ctx->txn) != NST_OK) {
-            free(ctx);
-
-            return 0;
-        }
-
         filter->ctx = ctx;
     }
 
@@ -101,25 +82,14 @@ _nst_nosql_filter_detach(hpx_stream_t *s, hpx_filter_t *filter) {
 
     if(filter->ctx) {
         nst_ctx_t  *ctx = filter->ctx;
-        int         i;
 
-        nst_stats_update_nosql(s->txn->meth);
+        nst_stats_update_nosql(s->txn->meth, ctx->arena.allocs);
 
         if(ctx->state == NST_CTX_STATE_CREATE || ctx->state == NST_CTX_STATE_UPDATE) {
             nst_nosql_abort(ctx);
         }
 
-        for(i = 0; i < ctx->key_cnt; i++) {
-            nst_key_t  key = ctx->keys[i];
-
-            if(key.data) {
-                free(key.data);
-            }
-        }
-
-        nst_http_txn_detach(&ctx->txn);
-
-        free(ctx);
+        nst_ctx_free(ctx);
     }
 
     nst_debug(s, "[nosql] ===== detach =====");
@@ -172,13 +142,12 @@ _nst_nosql_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
             if(!key->data) {
                 /* build key */
-                if(nst_key_build(s, msg, ctx->rule, &ctx->txn, key, HTTP_METH_GET) != NST_OK) {
+                if(nst_key_build(s, msg, ctx->rule, &ctx->txn, &ctx->key_cache, key,
+                            HTTP_METH_GET) != NST_OK) {
                     ctx->state = NST_CTX_STATE_FULL;
 
                     break;
                 }
-
-                nst_key_hash(key);
             }
 
             nst_key_debug(s, key);
@@ -248,7 +217,8 @@ _nst_nosql_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
         appctx->st1 = 0;
 
         appctx->ctx.nuster.store.ring.data = ctx->store.ring.data;
-        appctx->ctx.nuster.store.ring.item = ctx->store.ring.data->item;
+        appctx->ctx.nuster.store.ring.extent = NULL;
+        appctx->ctx.nuster.store.ring.offset = 0;
 
         req->analysers &= ~AN_REQ_FLT_HTTP_HDRS;
         req->analysers &= ~AN_REQ_FLT_XFER_DATA;
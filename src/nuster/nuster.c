@@ -10,6 +10,9 @@
  *
  */
 
+#include <common/chunk.h>
+#include <common/memory.h>
+
 #include <types/global.h>
 #include <types/http_htx.h>
 
@@ -43,8 +46,84 @@ nuster_t  nuster = {
         },
     },
     .proxy = NULL,
+    .pool = {
+        .ctx = NULL,
+    },
 };
 
+static int
+_nst_key_element_equal(nst_key_element_t *a, nst_key_element_t *b) {
+
+    if(a->type != b->type) {
+        return 0;
+    }
+
+    if(a->data == NULL || b->data == NULL) {
+        return a->data == b->data;
+    }
+
+    return !strcmp(a->data, b->data);
+}
+
+/*
+ * Add the elements of key to the prefix tree of the proxy, reusing the
+ * nodes of the longest prefix it shares with the keys already added.
+ */
+static int
+_nst_key_compile(nst_proxy_t *px, nst_rule_key_t *key, nst_memory_t *memory) {
+    nst_key_element_t  **pck    = key->data;
+    nst_key_node_t      *parent = NULL;
+    nst_key_node_t      *node;
+
+    while(*pck) {
+        nst_key_element_t  *ck = *pck++;
+
+        for(node = px->node; node; node = node->next) {
+
+            if(node->parent == parent && _nst_key_element_equal(node->element, ck)) {
+                break;
+            }
+        }
+
+        if(!node) {
+            nst_key_node_t  *n;
+
+            node = nst_memory_alloc(memory, sizeof(nst_key_node_t));
+
+            if(!node) {
+                return NST_ERR;
+            }
+
+            node->parent  = parent;
+            node->element = ck;
+            node->idx     = px->node_cnt++;
+            node->eidx    = -1;
+
+            for(n = px->node; n; n = n->next) {
+
+                if(_nst_key_element_equal(n->element, ck)) {
+                    node->eidx = n->eidx;
+
+                    break;
+                }
+            }
+
+            if(node->eidx == -1) {
+                node->eidx = px->element_cnt++;
+            }
+
+            node->next = px->node;
+            px->node   = node;
+        }
+
+        parent = node;
+    }
+
+    key->node = parent;
+
+    return NST_OK;
+}
+
 static void
 _nst_proxy_init() {
     hpx_proxy_t   *px1;
@@ -53,7 +132,7 @@ _nst_proxy_init() {
 
     /* new rule init */
     global.nuster.memory = nst_memory_create("nuster.shm", NST_DEFAULT_SIZE,
-            global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE);
+            global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE, NST_MEMORY_PAGES_DEFAULT, 0, NULL, 0);
 
     if(!global.nuster.memory) {
         goto err;
@@ -179,6 +258,10 @@ out:
                     }
 
                     px->key = key;
+
+                    if(_nst_key_compile(px, key, memory) != NST_OK) {
+                        goto err;
+                    }
                 }
 
                 rule->key   = key;
@@ -196,6 +279,14 @@ out:
 
                 rule->wait = rc->wait;
 
+                rule->admit = rc->admit;
+
+                rule->early  = rc->early;
+                rule->jitter = rc->jitter;
+
+                rule->stale.revalidate = rc->stale.revalidate;
+                rule->stale.error      = rc->stale.error;
+
                 rule->cond = rc->cond;
 
                 rule->next = NULL;
@@ -221,6 +312,51 @@ err:
     exit(1);
 }
 
+/*
+ * bytes of the key cache of a stream, taken from the arena
+ */
+static unsigned int
+_nst_ctx_cache_size(nst_proxy_t *px) {
+    return px->node_cnt * sizeof(nst_key_prefix_t) + px->element_cnt * sizeof(hpx_ist_t)
+        + 2 * NST_ARENA_ALIGN;
+}
+
+/*
+ * One pool object holds the ctx of a stream sized for the largest proxy,
+ * the txn buffer, the key cache and room for the key data.
+ */
+static void
+_nst_ctx_pool_init() {
+    hpx_proxy_t   *px  = proxies_list;
+    unsigned int   max = 0;
+    unsigned int   size;
+
+    while(px) {
+        if(px->nuster.mode == NST_MODE_CACHE || px->nuster.mode == NST_MODE_NOSQL) {
+            nst_proxy_t  *p = nuster.proxy[px->uuid];
+
+            size = p->key_cnt * sizeof(nst_key_t) + _nst_ctx_cache_size(p);
+
+            if(size > max) {
+                max = size;
+            }
+        }
+
+        px = px->next;
+    }
+
+    size = sizeof(nst_ctx_t) + max
+        + sizeof(hpx_buffer_t) + NST_ARENA_ALIGN + global.tune.bufsize + NST_CTX_KEYS_SIZE();
+
+    nuster.pool.ctx = create_pool("nuster_ctx", size, MEM_F_SHARED);
+
+    if(!nuster.pool.ctx) {
+        ha_alert("Out of memory when initializing nuster ctx pool.\n");
+
+        exit(1);
+    }
+}
+
 void
 nuster_init() {
 
@@ -231,8 +367,13 @@ nuster_init() {
         exit(1);
     }
 
+    /* tells this configuration from the previous one, see nst_epoch_own */
+    nst_epoch_self = ha_random64() | 1;
+
     _nst_proxy_init();
 
+    _nst_ctx_pool_init();
+
     nst_manager_init();
 
     nst_cache_init();
@@ -267,6 +408,314 @@ nst_test_rule(hpx_stream_t *s, nst_rule_t *rule, int res) {
     return NST_ERR;
 }
 
+/*
+ * Fingerprint of what must not change for a memory kept in a file to be
+ * attached by a new configuration, see nst_memory_create.
+ */
+uint64_t
+nst_core_layout(int engine, uint64_t dict_size, uint64_t data_size, hpx_ist_t root) {
+    struct {
+        char      version[16];
+        uint64_t  size[6];
+        uint64_t  dict_size;
+        uint64_t  data_size;
+        int       engine;
+        int       nbproc;
+    } layout;
+
+    memset(&layout, 0, sizeof(layout));
+
+    strlcpy2(layout.version, NUSTER_VERSION, sizeof(layout.version));
+
+    layout.size[0]   = sizeof(nst_memory_t);
+    layout.size[1]   = sizeof(nst_core_t);
+    layout.size[2]   = sizeof(nst_dict_entry_t);
+    layout.size[3]   = sizeof(nst_ring_data_t);
+    layout.size[4]   = sizeof(nst_ring_extent_t);
+    layout.size[5]   = MAX_THREADS;
+    layout.dict_size = dict_size;
+    layout.data_size = data_size;
+    layout.engine    = engine;
+    layout.nbproc    = global.nbproc;
+
+    return XXH64(&layout, sizeof(layout), root.len ? XXH64(root.ptr, root.len, 0) : 0);
+}
+
+static char *
+_nst_core_strdup(nst_memory_t *memory, const char *str) {
+    char  *p = nst_memory_alloc(memory, strlen(str) + 1);
+
+    if(p) {
+        strcpy(p, str);
+    }
+
+    return p;
+}
+
+/*
+ * Record the names of the rules of this configuration in the memory of
+ * core, see nst_core_rule_t.
+ */
+int
+nst_core_bind(nst_core_t *core, int mode) {
+    hpx_proxy_t      *px;
+    nst_rule_t       *rule;
+    nst_core_rule_t  *r;
+    int               i, cnt = 0;
+
+    for(i = 0; i < core->rule_cnt; i++) {
+        nst_memory_free(core->memory, core->rule[i].proxy);
+        nst_memory_free(core->memory, core->rule[i].name);
+    }
+
+    nst_memory_free(core->memory, core->rule);
+
+    core->rule     = NULL;
+    core->rule_cnt = 0;
+
+    for(px = proxies_list; px; px = px->next) {
+
+        if(px->nuster.mode == mode) {
+
+            for(rule = nuster.proxy[px->uuid]->rule; rule; rule = rule->next) {
+
+                if(rule->uuid >= cnt) {
+                    cnt = rule->uuid + 1;
+                }
+            }
+        }
+    }
+
+    if(!cnt) {
+        return NST_OK;
+    }
+
+    core->rule = nst_memory_calloc(core->memory, cnt * sizeof(nst_core_rule_t));
+
+    if(!core->rule) {
+        return NST_ERR;
+    }
+
+    core->rule_cnt = cnt;
+
+    for(px = proxies_list; px; px = px->next) {
+
+        if(px->nuster.mode == mode) {
+
+            for(rule = nuster.proxy[px->uuid]->rule; rule; rule = rule->next) {
+                r = &core->rule[rule->uuid];
+
+                r->proxy = _nst_core_strdup(core->memory, px->id);
+                r->name  = _nst_core_strdup(core->memory, rule->name);
+
+                if(!r->proxy || !r->name) {
+                    return NST_ERR;
+                }
+            }
+        }
+    }
+
+    return NST_OK;
+}
+
+typedef struct nst_core_rebind {
+    nst_rule_t                **rule;           /* new rule by old uuid, or NULL */
+    int                        *pid;
+    int                         cnt;
+} nst_core_rebind_t;
+
+static int
+_nst_core_rebind_entry(nst_dict_t *dict, nst_dict_entry_t *entry, void *data) {
+    nst_core_rebind_t  *rebind = data;
+    int                 uuid   = entry->rule_uuid;
+
+    /* loaded from disk, or of a rule gone at a previous attach */
+    if(!entry->rule) {
+        return NST_DICT_WALK_NEXT;
+    }
+
+    if(uuid >= 0 && uuid < rebind->cnt && rebind->rule[uuid]) {
+        entry->rule      = rebind->rule[uuid];
+        entry->rule_uuid = entry->rule->uuid;
+        entry->pid       = rebind->pid[uuid];
+
+        return NST_DICT_WALK_NEXT;
+    }
+
+    entry->rule = NULL;
+
+    if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
+        entry->state  = NST_DICT_ENTRY_STATE_INVALID;
+        entry->expire = 0;
+
+        if(entry->store.ring.data) {
+            nst_ring_data_invalidate(&dict->store->ring, entry->store.ring.data);
+
+            entry->store.ring.data = NULL;
+        }
+
+        if(entry->store.disk.file) {
+            nst_disk_purge_by_path(entry->store.disk.file);
+        }
+
+        nst_dict_schedule(dict, entry);
+    }
+
+    return NST_DICT_WALK_NEXT;
+}
+
+static void
+_nst_core_rebind(nst_core_t *core, int mode) {
+    nst_core_rebind_t   rebind;
+    nst_core_rule_t    *r;
+    hpx_proxy_t        *px;
+    nst_rule_t         *rule;
+    uint64_t            idx;
+    int                 i;
+
+    rebind.cnt  = core->rule_cnt;
+    rebind.rule = calloc(rebind.cnt + 1, sizeof(*rebind.rule));
+    rebind.pid  = calloc(rebind.cnt + 1, sizeof(*rebind.pid));
+
+    /* every entry is invalidated then */
+    if(!rebind.rule || !rebind.pid) {
+        rebind.cnt = 0;
+    }
+
+    for(i = 0; i < rebind.cnt; i++) {
+        r = &core->rule[i];
+
+        if(!r->proxy || !r->name) {
+            continue;
+        }
+
+        for(px = proxies_list; px && !rebind.rule[i]; px = px->next) {
+
+            if(px->nuster.mode != mode || strcmp(px->id, r->proxy)) {
+                continue;
+            }
+
+            for(rule = nuster.proxy[px->uuid]->rule; rule; rule = rule->next) {
+
+                if(!strcmp(rule->name, r->name)) {
+                    rebind.rule[i] = rule;
+                    rebind.pid[i]  = px->uuid;
+
+                    break;
+                }
+            }
+        }
+    }
+
+    for(idx = 0; idx < nst_dict_walk_size(&core->dict); idx++) {
+        nst_dict_lock(&core->dict, idx);
+
+        nst_dict_walk(&core->dict, idx, _nst_core_rebind_entry, &rebind);
+
+        nst_dict_unlock(&core->dict, idx);
+    }
+
+    free(rebind.rule);
+    free(rebind.pid);
+}
+
+/*
+ * Take over a core left in a memory kept in a file by the previous
+ * configuration, whose workers may still be running: they stop reading
+ * without lock and creating entries, see nst_epoch_own, then the entries
+ * are bound to the rules with the same proxy and rule names, those of
+ * the rules which are gone are invalidated.
+ * Only called by the master before the workers are forked.
+ */
+int
+nst_core_attach(nst_core_t *core, int mode, hpx_ist_t root) {
+
+    /* a process killed while holding them leaves them locked */
+    if(core->memory->orphaned) {
+
+        if(nst_shctx_init(core->memory) != NST_OK) {
+            return NST_ERR;
+        }
+
+        if(nst_dict_lock_init(&core->dict) != NST_OK) {
+            return NST_ERR;
+        }
+    }
+
+    nst_epoch_own(&core->epoch, core->memory->orphaned);
+
+    /* pointers to the memory of the previous process */
+    core->root            = root;
+    core->store.disk.root = root;
+    core->store.disk.dir  = NULL;
+
+    _nst_core_rebind(core, mode);
+
+    /* if it fails the entries are invalidated by the next attach */
+    nst_core_bind(core, mode);
+
+    return NST_OK;
+}
+
+/*
+ * Allocate the ctx of a stream, the txn buffer, the key cache and the keys
+ * come from its arena, so that nst_ctx_free releases everything at once.
+ */
+nst_ctx_t *
+nst_ctx_alloc(int pid) {
+    nst_proxy_t   *px = nuster.proxy[pid];
+    nst_ctx_t     *ctx;
+    hpx_buffer_t  *buf;
+    char          *area;
+    unsigned int   size;
+
+    ctx = pool_alloc(nuster.pool.ctx);
+
+    if(ctx == NULL) {
+        return NULL;
+    }
+
+    size = sizeof(nst_ctx_t) + px->key_cnt * sizeof(nst_key_t);
+
+    memset(ctx, 0, size);
+
+    ctx->state    = NST_CTX_STATE_INIT;
+    ctx->pid      = pid;
+    ctx->rule_cnt = px->rule_cnt;
+    ctx->key_cnt  = px->key_cnt;
+
+    nst_arena_init(&ctx->arena, (char *)ctx + size, nuster.pool.ctx->size - size);
+
+    buf  = nst_arena_alloc(&ctx->arena, sizeof(hpx_buffer_t));
+    area = nst_arena_alloc(&ctx->arena, global.tune.bufsize);
+
+    chunk_init(buf, area, global.tune.bufsize);
+
+    ctx->txn.buf = buf;
+
+    ctx->key_cache.arena   = &ctx->arena;
+    ctx->key_cache.prefix  = nst_arena_alloc(&ctx->arena,
+            px->node_cnt * sizeof(nst_key_prefix_t));
+    ctx->key_cache.element = nst_arena_alloc(&ctx->arena,
+            px->element_cnt * sizeof(hpx_ist_t));
+
+    memset(ctx->key_cache.prefix, 0, px->node_cnt * sizeof(nst_key_prefix_t));
+    memset(ctx->key_cache.element, 0, px->element_cnt * sizeof(hpx_ist_t));
+
+    return ctx;
+}
+
+void
+nst_ctx_free(nst_ctx_t *ctx) {
+    int  i;
+
+    for(i = 0; i < ctx->key_cnt; i++) {
+        nst_arena_free(&ctx->arena, ctx->keys[i].data);
+    }
+
+    pool_free(nuster.pool.ctx, ctx);
+}
+
 void
 nst_debug(hpx_stream_t *s, const char *fmt, ...) {
 
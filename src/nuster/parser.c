@@ -485,6 +485,26 @@ nuster_parse_global_cache(const char *file, int line, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "dict-engine")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "chain")) {
+                global.nuster.cache.dict_engine = NST_DICT_ENGINE_CHAIN;
+            } else if(!strcmp(args[cur_arg], "swiss")) {
+                global.nuster.cache.dict_engine = NST_DICT_ENGINE_SWISS;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] dict-engine expects chain or swiss.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "dir")) {
             cur_arg++;
 
@@ -615,6 +635,156 @@ nuster_parse_global_cache(const char *file, int line, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "huge-pages")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.cache.huge_pages = NST_MEMORY_PAGES_DEFAULT;
+            } else if(!strcmp(args[cur_arg], "on")) {
+                global.nuster.cache.huge_pages = NST_MEMORY_PAGES_HUGE;
+            } else if(!strcmp(args[cur_arg], "transparent")) {
+                global.nuster.cache.huge_pages = NST_MEMORY_PAGES_TRANSPARENT;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] huge-pages expects off, on or transparent.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "prefault")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] prefault expects a number.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.prefault = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.prefault < 0) {
+                global.nuster.cache.prefault = 0;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "shm-file")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] shm-file expects a file as argument.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(global.nuster.nosql.shm_file
+                    && !strcmp(global.nuster.nosql.shm_file, args[cur_arg])) {
+
+                ha_alert("parsing [%s:%d]: [%s] shm-file `%s` is used by nosql.\n",
+                        file, line, args[0], args[cur_arg]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.shm_file = strdup(args[cur_arg]);
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "evict")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.cache.evict = NST_DICT_EVICT_OFF;
+            } else if(!strcmp(args[cur_arg], "clock")) {
+                global.nuster.cache.evict = NST_DICT_EVICT_CLOCK;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] evict expects off or clock.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "evict-high")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] evict-high expects a percentage.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.evict_high = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.evict_high <= 0 || global.nuster.cache.evict_high > 100) {
+                ha_alert("parsing [%s:%d]: [%s] evict-high expects a percentage, 1 to 100.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "evict-low")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] evict-low expects a percentage.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.evict_low = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.evict_low <= 0 || global.nuster.cache.evict_low > 100) {
+                ha_alert("parsing [%s:%d]: [%s] evict-low expects a percentage, 1 to 100.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         ha_alert("parsing [%s:%d]: [%s] Unrecognized '%s'.\n", file, line, args[0], args[cur_arg]);
 
         err_code |= ERR_ALERT | ERR_FATAL;
@@ -622,6 +792,13 @@ nuster_parse_global_cache(const char *file, int line, char **args) {
         goto out;
     }
 
+    if(global.nuster.cache.evict_low >= global.nuster.cache.evict_high) {
+        ha_alert("parsing [%s:%d]: [%s] evict-low must be lower than evict-high.\n",
+                file, line, args[0]);
+
+        err_code |= ERR_ALERT | ERR_FATAL;
+    }
+
 out:
     return err_code;
 }
@@ -689,6 +866,27 @@ nuster_parse_global_nosql(const char *file, int line, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "dict-engine")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "chain")) {
+                global.nuster.nosql.dict_engine = NST_DICT_ENGINE_CHAIN;
+            } else if(!strcmp(args[cur_arg], "swiss")) {
+                global.nuster.nosql.dict_engine = NST_DICT_ENGINE_SWISS;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] dict-engine expects chain or swiss.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "data-size")) {
             cur_arg++;
 
@@ -848,6 +1046,156 @@ nuster_parse_global_nosql(const char *file, int line, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "huge-pages")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.nosql.huge_pages = NST_MEMORY_PAGES_DEFAULT;
+            } else if(!strcmp(args[cur_arg], "on")) {
+                global.nuster.nosql.huge_pages = NST_MEMORY_PAGES_HUGE;
+            } else if(!strcmp(args[cur_arg], "transparent")) {
+                global.nuster.nosql.huge_pages = NST_MEMORY_PAGES_TRANSPARENT;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] huge-pages expects off, on or transparent.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "prefault")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] prefault expects a number.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.nosql.prefault = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.prefault < 0) {
+                global.nuster.nosql.prefault = 0;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "shm-file")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] shm-file expects a file as argument.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(global.nuster.cache.shm_file
+                    && !strcmp(global.nuster.cache.shm_file, args[cur_arg])) {
+
+                ha_alert("parsing [%s:%d]: [%s] shm-file `%s` is used by cache.\n",
+                        file, line, args[0], args[cur_arg]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.nosql.shm_file = strdup(args[cur_arg]);
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "evict")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.nosql.evict = NST_DICT_EVICT_OFF;
+            } else if(!strcmp(args[cur_arg], "clock")) {
+                global.nuster.nosql.evict = NST_DICT_EVICT_CLOCK;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] evict expects off or clock.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "evict-high")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] evict-high expects a percentage.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.nosql.evict_high = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.evict_high <= 0 || global.nuster.nosql.evict_high > 100) {
+                ha_alert("parsing [%s:%d]: [%s] evict-high expects a percentage, 1 to 100.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "evict-low")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] evict-low expects a percentage.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.nosql.evict_low = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.evict_low <= 0 || global.nuster.nosql.evict_low > 100) {
+                ha_alert("parsing [%s:%d]: [%s] evict-low expects a percentage, 1 to 100.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         ha_alert("parsing [%s:%d]: [%s] Unrecognized '%s'.\n", file, line, args[0], args[cur_arg]);
 
         err_code |= ERR_ALERT | ERR_FATAL;
@@ -855,6 +1203,13 @@ nuster_parse_global_nosql(const char *file, int line, char **args) {
         goto out;
     }
 
+    if(global.nuster.nosql.evict_low >= global.nuster.nosql.evict_high) {
+        ha_alert("parsing [%s:%d]: [%s] evict-low must be lower than evict-high.\n",
+                file, line, args[0]);
+
+        err_code |= ERR_ALERT | ERR_FATAL;
+    }
+
 out:
     return err_code;
 }
@@ -987,11 +1342,13 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
     char               *key  = NULL;
     char               *code = NULL;
 
-    int         memory, disk, ttl, etag, last_modified, wait;
+    int         memory, disk, ttl, etag, last_modified, wait, admit, revalidate, error;
+    int         early, jitter;
     uint8_t     extend[4] = { -1 };
     int         cur_arg   = 2;
 
-    memory = ttl = disk = etag = last_modified = wait = -1;
+    memory = ttl = disk = etag = last_modified = wait = admit = revalidate = error = -1;
+    early  = jitter = -1;
 
     if(proxy == defpx || !(proxy->cap & PR_CAP_BE)) {
         memprintf(err, "rule is not allowed in a 'frontend' or 'defaults' section.");
@@ -1337,6 +1694,164 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "admit")) {
+
+            if(admit != -1) {
+                memprintf(err, "[%s.%s]: admit already specified.", args[1], name);
+
+                goto out;
+            }
+
+            if(proxy->nuster.mode != NST_MODE_CACHE) {
+                memprintf(err, "[%s.%s]: admit is only supported in cache mode.", args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "[%s.%s]: admit expects [off|N], default off.", args[1], name);
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "off")) {
+                admit = 0;
+            } else {
+                admit = atoi(args[cur_arg]);
+
+                if(admit <= 0 || admit > NST_SKETCH_MAX) {
+                    memprintf(err, "[%s.%s]: invalid admit, expects 1 to %d.", args[1], name,
+                            NST_SKETCH_MAX);
+
+                    goto out;
+                }
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "early-refresh")) {
+
+            if(early != -1) {
+                memprintf(err, "[%s.%s]: early-refresh already specified.", args[1], name);
+
+                goto out;
+            }
+
+            if(proxy->nuster.mode != NST_MODE_CACHE) {
+                memprintf(err, "[%s.%s]: early-refresh is only supported in cache mode.",
+                        args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "on")) {
+                early = NST_STATUS_ON;
+            } else if(!strcmp(args[cur_arg], "off")) {
+                early = NST_STATUS_OFF;
+            } else {
+                memprintf(err, "[%s.%s]: early-refresh expects [on|off], default off.",
+                        args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "jitter")) {
+
+            if(jitter != -1) {
+                memprintf(err, "[%s.%s]: jitter already specified.", args[1], name);
+
+                goto out;
+            }
+
+            if(proxy->nuster.mode != NST_MODE_CACHE) {
+                memprintf(err, "[%s.%s]: jitter is only supported in cache mode.", args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "[%s.%s]: jitter expects a percentage of ttl, default 0.",
+                        args[1], name);
+
+                goto out;
+            }
+
+            jitter = atoi(args[cur_arg]);
+
+            if(jitter < 0 || jitter > 100) {
+                memprintf(err, "[%s.%s]: invalid jitter, expects 0 to 100.", args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "stale-while-revalidate")
+                || !strcmp(args[cur_arg], "stale-if-error")) {
+
+            int  *stale = &error;
+
+            if(!strcmp(args[cur_arg], "stale-while-revalidate")) {
+                stale = &revalidate;
+            }
+
+            if(*stale != -1) {
+                memprintf(err, "[%s.%s]: %s already specified.", args[1], name, args[cur_arg]);
+
+                goto out;
+            }
+
+            if(proxy->nuster.mode != NST_MODE_CACHE) {
+                memprintf(err, "[%s.%s]: %s is only supported in cache mode.", args[1], name,
+                        args[cur_arg]);
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "[%s.%s]: %s expects a time(in seconds).", args[1], name,
+                        args[cur_arg - 1]);
+
+                goto out;
+            }
+
+            /*
+             * "d", "h", "m", "s"
+             * s is returned
+             */
+            if(nst_parse_time(args[cur_arg], strlen(args[cur_arg]), (unsigned *)stale)) {
+                memprintf(err, "[%s.%s]: invalid %s.", args[1], name, args[cur_arg - 1]);
+
+                goto out;
+            }
+
+            if(*stale < 0) {
+                memprintf(err, "[%s.%s]: invalid %s(max: %d).", args[1], name,
+                        args[cur_arg - 1], INT_MAX);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         memprintf(err, "[%s.%s]: Unrecognized '%s'.", args[1], name, args[cur_arg]);
 
         goto out;
@@ -1433,6 +1948,14 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
 
     rule->wait = wait;
 
+    rule->admit = admit == -1 ? 0 : admit;
+
+    rule->early  = early  == -1 ? NST_STATUS_OFF : early;
+    rule->jitter = jitter == -1 ? 0 : jitter;
+
+    rule->stale.revalidate = revalidate == -1 ? 0 : revalidate;
+    rule->stale.error      = error      == -1 ? 0 : error;
+
     rule->cond = cond;
 
     LIST_INIT(&rule->list);
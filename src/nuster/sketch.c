@@ -0,0 +1,97 @@
+/*
+ * nuster frequency sketch functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <types/global.h>
+
+#include <nuster/nuster.h>
+
+int
+nst_sketch_init(nst_sketch_t *sketch, nst_memory_t *memory, uint64_t data_size) {
+    uint64_t  bytes;
+
+    sketch->width = NST_SKETCH_MIN_WIDTH;
+    sketch->incr  = 0;
+
+    while(sketch->width * NST_SKETCH_BYTES_PER_KEY < data_size) {
+        sketch->width *= 2;
+    }
+
+    bytes = sketch->width * NST_SKETCH_ROWS;
+
+    sketch->table = nst_memory_calloc(memory, bytes);
+
+    if(!sketch->table) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Count one more occurrence of hash and return the new estimate.
+ * Only the counters at the minimum are incremented (conservative update),
+ * concurrent increments of the same counter may be lost, which only
+ * makes the estimate lower.
+ */
+uint8_t
+nst_sketch_incr(nst_sketch_t *sketch, uint64_t hash) {
+    uint8_t   *counter[NST_SKETCH_ROWS];
+    uint64_t   h1  = hash;
+    uint64_t   h2  = (hash >> 32) | 1;
+    uint8_t    min = NST_SKETCH_MAX;
+    int        i;
+
+    for(i = 0; i < NST_SKETCH_ROWS; i++) {
+        counter[i] = sketch->table + i * sketch->width + ((h1 + i * h2) & (sketch->width - 1));
+
+        if(*counter[i] < min) {
+            min = *counter[i];
+        }
+    }
+
+    if(min == NST_SKETCH_MAX) {
+        return min;
+    }
+
+    for(i = 0; i < NST_SKETCH_ROWS; i++) {
+
+        if(*counter[i] == min) {
+            __sync_bool_compare_and_swap(counter[i], min, min + 1);
+        }
+    }
+
+    __sync_add_and_fetch(&sketch->incr, 1);
+
+    return min + 1;
+}
+
+/*
+ * Halve all counters once enough increments have been sampled.
+ * Only called by master housekeeping.
+ */
+void
+nst_sketch_age(nst_sketch_t *sketch) {
+    uint64_t  *word = (uint64_t *)sketch->table;
+    uint64_t   i, n;
+
+    if(sketch->incr < sketch->width * NST_SKETCH_SAMPLE) {
+        return;
+    }
+
+    n = sketch->width * NST_SKETCH_ROWS / sizeof(uint64_t);
+
+    for(i = 0; i < n; i++) {
+        word[i] = (word[i] >> 1) & 0x7F7F7F7F7F7F7F7FULL;
+    }
+
+    sketch->incr = 0;
+}
@@ -53,7 +53,7 @@ nst_disk_data_init(hpx_ist_t root, char *path, nst_key_t *key) {
 }
 
 int
-nst_disk_data_valid(nst_disk_data_t *data, nst_key_t *key) {
+nst_disk_data_valid(nst_disk_data_t *data, nst_key_t *key, uint32_t stale) {
     hpx_buffer_t  *buf;
     int            ret;
 
@@ -75,7 +75,7 @@ nst_disk_data_valid(nst_disk_data_t *data, nst_key_t *key) {
         goto err;
     }
 
-    if(nst_disk_meta_check_expire(data->meta) != NST_OK) {
+    if(nst_disk_meta_check_expire(data->meta, stale) != NST_OK) {
         goto err;
     }
 
@@ -120,7 +120,7 @@ nst_disk_data_exists(nst_disk_t *disk, nst_disk_data_t *data, nst_key_t *key) {
 
     sprintf(data->file, "%s/%c/%c%c/%s", disk->root.ptr, p[0], p[0], p[1], p);
 
-    if(nst_disk_data_valid(data, key) == NST_OK) {
+    if(nst_disk_data_valid(data, key, 0) == NST_OK) {
         return NST_OK;
     }
 
@@ -153,7 +153,7 @@ nst_disk_read_meta(nst_disk_data_t *data) {
         return NST_ERR;
     }
 
-    if(nst_disk_meta_check_expire(data->meta) != NST_OK) {
+    if(nst_disk_meta_check_expire(data->meta, nst_disk_meta_get_stale(data->meta)) != NST_OK) {
         return NST_ERR;
     }
 
@@ -182,7 +182,8 @@ nst_disk_read_key(nst_disk_t *disk, nst_disk_data_t *data, nst_key_t *key) {
 
     memcpy(key->uuid, data->meta + NST_DISK_META_POS_UUID, 20);
 
-    key->hash = nst_disk_meta_get_hash(data->meta);
+    key->hash   = nst_disk_meta_get_hash(data->meta);
+    key->flags |= NST_KEY_UUID_SET;
 
     return NST_OK;
 }
@@ -457,11 +458,13 @@ nst_disk_load(nst_core_t *core) {
                     goto err;
                 }
 
-                nst_shctx_lock(&core->dict);
+                key.hash = nst_disk_meta_get_hash(data.meta);
+
+                nst_dict_lock(&core->dict, key.hash);
 
                 ret = nst_dict_set_from_disk(&core->dict, &buf, host, path, &key, file, data.meta);
 
-                nst_shctx_unlock(&core->dict);
+                nst_dict_unlock(&core->dict, key.hash);
 
                 if(ret != NST_OK) {
                     goto err;
@@ -564,7 +567,8 @@ nst_disk_cleanup(nst_core_t *core) {
                     continue;
                 }
 
-                if(nst_disk_meta_check_expire(data.meta) != NST_OK) {
+                if(nst_disk_meta_check_expire(data.meta, nst_disk_meta_get_stale(data.meta))
+                        != NST_OK) {
                     remove(file);
                     close(data.fd);
 
@@ -668,6 +672,8 @@ nst_disk_store_end(nst_disk_t *disk, nst_disk_data_t *data, nst_key_t *key, nst_
     nst_disk_meta_set_expire(data->meta, expire);
     nst_disk_meta_set_header_len(data->meta, txn->res.header_len);
     nst_disk_meta_set_payload_len(data->meta, txn->res.payload_len);
+
+    nst_key_uuid(key);
     nst_disk_meta_set_uuid(data->meta, key->uuid);
 
     if(nst_disk_write_meta(data) != NST_OK) {
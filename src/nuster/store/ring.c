@@ -13,19 +13,25 @@
 #include <nuster/nuster.h>
 
 int
-nst_ring_init(nst_ring_t *ring, nst_memory_t *memory) {
+nst_ring_init(nst_ring_t *ring, nst_memory_t *memory, nst_epoch_t *epoch) {
 
     ring->memory  = memory;
+    ring->garbage = NULL;
     ring->head    = NULL;
     ring->tail    = NULL;
     ring->count   = 0;
     ring->invalid = 0;
+    ring->epoch   = epoch;
 
-    return nst_shctx_init(ring);
+    memset(ring->retired, 0, sizeof(ring->retired));
+    memset(&ring->compact, 0, sizeof(ring->compact));
+
+    return NST_OK;
 }
 
 /*
- * create a new nst_ring_data and insert it to nst_ring list
+ * create a new nst_ring_data, it is not linked anywhere until it is
+ * invalidated, see nst_ring_data_invalidate
  */
 nst_ring_data_t *
 nst_ring_alloc_data(nst_ring_t *ring) {
@@ -34,135 +40,371 @@ nst_ring_alloc_data(nst_ring_t *ring) {
     if(data) {
         memset(data, 0, sizeof(*data));
 
-        nst_shctx_lock(ring);
+        __sync_add_and_fetch(&ring->count, 1);
+    }
 
-        if(ring->head == NULL) {
+    return data;
+}
+
+/*
+ * Move the garbage to the queue of invalid data, then check up to max
+ * of them: those without clients are retired, lock-free readers may
+ * still hold them so they are freed by nst_ring_reclaim later, the
+ * others go back to the end of the queue.
+ * Only called by master housekeeping.
+ */
+void
+nst_ring_cleanup(nst_ring_t *ring, int max) {
+    nst_ring_data_t  *data, *next;
+    int               n = nst_epoch_retire_list(ring->epoch);
+
+    data = __sync_lock_test_and_set(&ring->garbage, NULL);
+
+    while(data) {
+        next       = data->next;
+        data->next = NULL;
+
+        if(ring->tail) {
+            ring->tail->next = data;
+        } else {
             ring->head = data;
-            ring->tail = data;
-            data->next = data;
+        }
+
+        ring->tail = data;
+
+        data = next;
+    }
+
+    while(ring->head && max-- > 0) {
+        data       = ring->head;
+        ring->head = data->next;
+        data->next = NULL;
+
+        if(!ring->head) {
+            ring->tail = NULL;
+        }
+
+        if(nst_ring_data_invalid(data) == NST_OK) {
+            data->next       = ring->retired[n];
+            ring->retired[n] = data;
+
+            __sync_sub_and_fetch(&ring->count, 1);
+            __sync_sub_and_fetch(&ring->invalid, 1);
         } else {
 
-            if(ring->head == ring->tail) {
-                ring->head->next = data;
-                data->next       = ring->head;
-                ring->tail       = data;
-            } else {
-                data->next       = ring->head;
+            if(ring->tail) {
                 ring->tail->next = data;
-                ring->tail       = data;
+            } else {
+                ring->head = data;
             }
-        }
 
-        ring->count++;
-
-        nst_shctx_unlock(ring);
+            ring->tail = data;
+        }
     }
-
-    return data;
 }
 
 /*
- * free invalid nst_ring_data
+ * free the data retired two epochs ago, NST_RING_RECLAIM_BATCH data
+ * per memory lock.
+ * Only called by master housekeeping.
  */
 void
-nst_ring_cleanup(nst_ring_t *ring) {
-    nst_ring_data_t  *data = NULL;
-    nst_ring_item_t  *item = NULL;
-    nst_ring_item_t  *tmp;
+nst_ring_reclaim(nst_ring_t *ring) {
+    nst_ring_data_t    *data, *next;
+    nst_ring_extent_t  *extent, *tmp;
+    int                 n = nst_epoch_reclaim_list(ring->epoch);
+    int                 batch;
 
-    nst_shctx_lock(ring);
+    data = ring->retired[n];
 
-    if(ring->head) {
+    ring->retired[n] = NULL;
 
-        if(ring->head == ring->tail) {
+    while(data) {
+        nst_shctx_lock(ring->memory);
 
-            if(nst_ring_data_invalid(ring->head) == NST_OK) {
-                data       = ring->head;
-                ring->head = NULL;
-                ring->tail = NULL;
-            }
+        for(batch = 0; data && batch < NST_RING_RECLAIM_BATCH; batch++) {
+            next   = data->next;
+            extent = data->extent;
 
-        } else {
+            while(extent) {
+                tmp    = extent;
+                extent = extent->next;
 
-            if(nst_ring_data_invalid(ring->head) == NST_OK) {
-                data             = ring->head;
-                ring->tail->next = ring->head->next;
-                ring->head       = ring->head->next;
-            } else {
-                ring->tail = ring->head;
-                ring->head = ring->head->next;
+                nst_memory_free_locked(ring->memory, tmp);
             }
 
+            nst_memory_free_locked(ring->memory, data);
+
+            data = next;
         }
 
+        nst_shctx_unlock(ring->memory);
     }
+}
 
-    if(data) {
-        item = data->item;
+/*
+ * The largest extent, a multiple of the memory block size
+ */
+static inline uint32_t
+_nst_ring_extent_max(nst_ring_t *ring) {
+    uint32_t  block = ring->memory->block_size;
 
-        while(item) {
-            tmp  = item;
-            item = item->next;
+    if(block >= NST_RING_EXTENT_MAX_SIZE) {
+        return block;
+    }
+
+    return NST_RING_EXTENT_MAX_SIZE / block * block;
+}
 
-            nst_memory_free(ring->memory, tmp);
+/*
+ * An extent the size of the expected payload if known, or twice as
+ * large as the previous one, big enough for an item of size bytes,
+ * bounded by _nst_ring_extent_max.
+ * Extents larger than a block are runs of blocks, when no run is left
+ * a block is enough if it holds an item of min bytes.
+ */
+static nst_ring_extent_t *
+_nst_ring_alloc_extent(nst_ring_t *ring, nst_ring_data_t *data, nst_ring_extent_t *tail,
+        uint32_t size, uint32_t min) {
+
+    nst_ring_extent_t  *extent;
+    uint64_t            need  = sizeof(*extent) + nst_ring_item_len(size);
+    uint64_t            want  = NST_RING_EXTENT_MIN_SIZE;
+    uint32_t            block = ring->memory->block_size;
+    uint32_t            max   = _nst_ring_extent_max(ring);
+    uint32_t            len   = NST_RING_EXTENT_MIN_SIZE;
+
+    if(need > max) {
+        return NULL;
+    }
+
+    if(data->expect) {
+        want = sizeof(*extent) + sizeof(nst_ring_item_t) + data->expect;
+    } else if(tail) {
+        want = (sizeof(*tail) + tail->size) * 2;
+    }
+
+    if(want < need) {
+        want = need;
+    }
+
+    if(want > block) {
+        len = want < max ? want : max;
+    } else if(data->expect) {
+        len = want;
+    } else {
+
+        while(len < want) {
+            len *= 2;
         }
+    }
 
-        nst_memory_free(ring->memory, data);
+    /* use the whole chunk or run */
+    len    = nst_memory_size(ring->memory, len);
+    extent = nst_memory_alloc(ring->memory, len);
+
+    if(!extent && len > block && sizeof(*extent) + nst_ring_item_len(min) <= block) {
+        len    = block;
+        extent = nst_memory_alloc(ring->memory, len);
+    }
 
-        ring->count--;
-        ring->invalid--;
+    if(extent) {
+        extent->next = NULL;
+        extent->size = len - sizeof(*extent);
+        extent->used = 0;
     }
 
-    nst_shctx_unlock(ring);
+    return extent;
 }
 
+/*
+ * Append an item at the end of the tail extent, data items which do not
+ * fit are split over the next one.
+ * The item is published by updating used after it is filled, and the
+ * next extent is linked after the last item of tail is published, see
+ * nst_ring_item_get.
+ */
 int
-nst_ring_store_add(nst_ring_t *ring, nst_ring_data_t *data, nst_ring_item_t **tail,
+nst_ring_store_add(nst_ring_t *ring, nst_ring_data_t *data, nst_ring_extent_t **tail,
         const char *buf, uint32_t len, uint32_t info) {
 
-    nst_ring_item_t  *item;
+    nst_ring_extent_t  *extent = *tail;
+    nst_ring_item_t    *item;
+    uint32_t            max  = _nst_ring_extent_max(ring);
+    uint32_t            room, sz;
+    int                 type = info >> 28;
 
     if(data->invalid) {
         return NST_ERR;
     }
 
-    item = nst_ring_alloc_item(ring, len);
+    while(1) {
+        sz   = len;
+        room = extent ? extent->size - extent->used : 0;
 
-    if(!item) {
-        data->invalid = 1;
+        if(type == HTX_BLK_DATA && nst_ring_item_len(sz) > room
+                && room >= nst_ring_item_len(NST_RING_ITEM_SPLIT_MIN)) {
 
-        nst_ring_incr_invalid(ring);
+            sz = room - sizeof(*item);
+        }
 
-        return NST_ERR;
-    }
+        if(nst_ring_item_len(sz) > room) {
 
-    memcpy(item->data, buf, len);
+            /* the rest is split over the next extents */
+            if(type == HTX_BLK_DATA && nst_ring_item_len(sz) + sizeof(*extent) > max) {
+                sz = max - sizeof(*extent) - sizeof(*item);
+            }
 
-    item->info = info;
-    item->next = NULL;
+            extent = _nst_ring_alloc_extent(ring, data, extent, sz,
+                    type == HTX_BLK_DATA && sz > NST_RING_ITEM_SPLIT_MIN
+                    ? NST_RING_ITEM_SPLIT_MIN : sz);
 
-    if(*tail) {
-        (*tail)->next = item;
-    } else {
-        data->item = item;
-    }
+            if(!extent) {
+                goto err;
+            }
+
+            data->size += sizeof(*extent) + extent->size;
+
+            /* the used size of tail is final once the extent is linked */
+            __sync_synchronize();
+
+            if(*tail) {
+                (*tail)->next = extent;
+            } else {
+                data->extent = extent;
+            }
+
+            *tail = extent;
 
-    *tail = item;
+            continue;
+        }
+
+        item = (nst_ring_item_t *)(extent->data + extent->used);
+
+        memcpy(item->data, buf, sz);
+
+        item->info = info;
+
+        if(type == HTX_BLK_DATA) {
+            item->info   = (type << 28) + sz;
+            data->expect = data->expect > sz ? data->expect - sz : 0;
+        }
+
+        /* publish the item content before used, see nst_ring_store_end */
+        __sync_synchronize();
+
+        extent->used += nst_ring_item_len(sz);
+
+        buf += sz;
+        len -= sz;
+
+        if(!len) {
+            break;
+        }
+    }
 
     return NST_OK;
+
+err:
+    nst_ring_data_invalidate(ring, data);
+
+    return NST_ERR;
 }
 
-void
-nst_ring_store_sync(nst_core_t *core) {
-    nst_dict_entry_t   *entry;
-    nst_disk_data_t     data = { .file = NULL };
+static int
+_nst_ring_store_sync_entry(nst_dict_t *dict, nst_dict_entry_t *entry, void *data) {
+    uint64_t            start = *(uint64_t *)data;
+    nst_disk_data_t     disk  = { .file = NULL };
+    nst_ring_extent_t  *extent = NULL;
     nst_ring_item_t    *item;
+    uint32_t            offset = 0;
     nst_http_txn_t      txn;
     hpx_htx_blk_type_t  type;
-    uint64_t            ttl_extend, start;
+    uint64_t            ttl_extend;
     uint32_t            blksz, info;
     int                 ret;
 
+    if(nst_dict_entry_valid(entry)
+            && entry->rule
+            && nst_store_disk_sync(entry->rule->store)
+            && entry->store.disk.file == NULL) {
+
+        ttl_extend  = entry->ttl;
+
+        txn.req.host          = entry->host;
+        txn.req.path          = entry->path;
+        txn.res.etag          = entry->etag;
+        txn.res.last_modified = entry->last_modified;
+        txn.res.header_len    = 0;
+        txn.res.payload_len   = 0;
+
+        ttl_extend = ttl_extend << 32;
+        *( uint8_t *)(&ttl_extend)      = entry->extend[0];
+        *((uint8_t *)(&ttl_extend) + 1) = entry->extend[1];
+        *((uint8_t *)(&ttl_extend) + 2) = entry->extend[2];
+        *((uint8_t *)(&ttl_extend) + 3) = entry->extend[3];
+
+        ret = nst_disk_store_init(&dict->store->disk, &disk, &entry->key, &txn, ttl_extend);
+
+        if(ret != NST_OK) {
+            goto next;
+        }
+
+        entry->store.disk.file = disk.file;
+
+        nst_disk_meta_set_stale(disk.meta, entry->stale.revalidate, entry->stale.error);
+
+        item = nst_ring_item_get(entry->store.ring.data, &extent, &offset);
+
+        while(item) {
+            info  = item->info;
+            type  = (info >> 28);
+            blksz = nst_ring_item_size(item);
+
+            if(type == HTX_BLK_RES_SL || type == HTX_BLK_HDR || type == HTX_BLK_EOH) {
+                txn.res.header_len += 4 + blksz;
+            }
+
+            if(type == HTX_BLK_DATA) {
+                txn.res.payload_len += blksz;
+            }
+
+            if(type != HTX_BLK_DATA) {
+                ret = nst_disk_store_add(&dict->store->disk, &disk, (char *)&info, 4);
+
+                if(ret != NST_OK) {
+                    goto next;
+                }
+
+            }
+
+            ret = nst_disk_store_add(&dict->store->disk, &disk, item->data, blksz);
+
+            if(ret != NST_OK) {
+                goto next;
+            }
+
+            nst_ring_item_skip(item, &offset);
+
+            item = nst_ring_item_get(entry->store.ring.data, &extent, &offset);
+        }
+
+        nst_disk_store_end(&dict->store->disk, &disk, &entry->key, &txn, entry->expire);
+    }
+
+next:
+
+    if(get_current_timestamp() - start >= 10) {
+        return NST_DICT_WALK_STOP;
+    }
+
+    return NST_DICT_WALK_NEXT;
+}
+
+void
+nst_ring_store_sync(nst_core_t *core) {
+    uint64_t  start;
+    int       ret;
 
     if(!core->root.len || !core->store.disk.loaded) {
         return;
@@ -174,95 +416,197 @@ nst_ring_store_sync(nst_core_t *core) {
 
     start = get_current_timestamp();
 
-    nst_shctx_lock(&core->dict);
+    nst_dict_lock(&core->dict, core->dict.sync_idx);
 
-    entry = core->dict.entry[core->dict.sync_idx];
+    ret = nst_dict_walk(&core->dict, core->dict.sync_idx, _nst_ring_store_sync_entry, &start);
 
-    while(entry) {
+    nst_dict_unlock(&core->dict, core->dict.sync_idx);
 
-        if(nst_dict_entry_valid(entry)
-                && entry->rule
-                && nst_store_disk_sync(entry->rule->store)
-                && entry->store.disk.file == NULL) {
+    if(ret == NST_OK) {
+        core->dict.sync_idx++;
+    }
 
-            ttl_extend  = entry->ttl;
+    /* if we have checked the whole dict */
+    if(core->dict.sync_idx >= nst_dict_walk_size(&core->dict)) {
+        core->dict.sync_idx = 0;
+    }
+}
 
-            txn.req.host          = entry->host;
-            txn.req.path          = entry->path;
-            txn.res.etag          = entry->etag;
-            txn.res.last_modified = entry->last_modified;
-            txn.res.header_len    = 0;
-            txn.res.payload_len   = 0;
+static int
+_nst_ring_data_evacuating(nst_ring_t *ring, nst_ring_data_t *data) {
+    nst_ring_extent_t  *extent;
 
-            ttl_extend = ttl_extend << 32;
-            *( uint8_t *)(&ttl_extend)      = entry->extend[0];
-            *((uint8_t *)(&ttl_extend) + 1) = entry->extend[1];
-            *((uint8_t *)(&ttl_extend) + 2) = entry->extend[2];
-            *((uint8_t *)(&ttl_extend) + 3) = entry->extend[3];
+    if(nst_memory_evacuating(ring->memory, data)) {
+        return 1;
+    }
 
-            ret = nst_disk_store_init(&core->store.disk, &data, &entry->key, &txn, ttl_extend);
+    for(extent = data->extent; extent; extent = extent->next) {
 
-            if(ret != NST_OK) {
-                goto next;
-            }
+        if(nst_memory_evacuating(ring->memory, extent)) {
+            return 1;
+        }
+    }
 
-            entry->store.disk.file = data.file;
+    return 0;
+}
 
-            item = entry->store.ring.data->item;
+/*
+ * A copy of a complete data in new extents, NULL if memory is short
+ */
+static nst_ring_data_t *
+_nst_ring_data_copy(nst_ring_t *ring, nst_ring_data_t *data) {
+    nst_ring_data_t    *copy;
+    nst_ring_extent_t  *extent = NULL;
+    nst_ring_extent_t  *tail   = NULL;
+    nst_ring_item_t    *item;
+    uint32_t            offset = 0;
+    uint64_t            size   = 0;
 
-            while(item) {
-                info  = item->info;
-                type  = (info >> 28);
-                blksz = ((type == HTX_BLK_HDR || type == HTX_BLK_TLR)
-                        ? (info & 0xff) + ((info >> 8) & 0xfffff)
-                        : info & 0xfffffff);
+    copy = nst_ring_alloc_data(ring);
 
-                if(type == HTX_BLK_RES_SL || type == HTX_BLK_HDR || type == HTX_BLK_EOH) {
-                    txn.res.header_len += 4 + blksz;
-                }
+    if(!copy) {
+        return NULL;
+    }
 
-                if(type == HTX_BLK_DATA) {
-                    txn.res.payload_len += blksz;
-                }
+    /* so that the copy takes as few extents as possible */
+    for(extent = data->extent; extent; extent = extent->next) {
+        size += extent->used;
+    }
 
-                if(type != HTX_BLK_DATA) {
-                    ret = nst_disk_store_add(&core->store.disk, &data, (char *)&info, 4);
+    nst_ring_store_expect(copy, size);
 
-                    if(ret != NST_OK) {
-                        goto next;
-                    }
+    extent = NULL;
+    item   = nst_ring_item_get(data, &extent, &offset);
 
-                }
+    while(item) {
 
-                ret = nst_disk_store_add(&core->store.disk, &data, item->data, blksz);
+        /* the copy is invalidated on error */
+        if(nst_ring_store_add(ring, copy, &tail, item->data, nst_ring_item_size(item),
+                    item->info) != NST_OK) {
 
-                if(ret != NST_OK) {
-                    goto next;
-                }
+            return NULL;
+        }
 
-                item = item->next;
-            }
+        nst_ring_item_skip(item, &offset);
 
-            nst_disk_store_end(&core->store.disk, &data, &entry->key, &txn, entry->expire);
-        }
-next:
+        item = nst_ring_item_get(data, &extent, &offset);
+    }
 
-        entry = entry->next;
+    nst_ring_store_end(ring, copy);
 
-        if(get_current_timestamp() - start >= 10) {
-            break;
+    return copy;
+}
+
+struct nst_ring_compact_walk {
+    uint64_t  start;
+    int       failed;
+};
+
+static int
+_nst_ring_compact_entry(nst_dict_t *dict, nst_dict_entry_t *entry, void *data) {
+    struct nst_ring_compact_walk  *walk = data;
+    nst_ring_t                    *ring = &dict->store->ring;
+    nst_ring_data_t               *old  = entry->store.ring.data;
+    nst_ring_data_t               *copy;
+
+    /* the data of a valid entry is complete */
+    if(nst_dict_entry_valid(entry) && old && !old->invalid
+            && _nst_ring_data_evacuating(ring, old)) {
+
+        copy = _nst_ring_data_copy(ring, old);
+
+        if(!copy) {
+            walk->failed = 1;
+
+            return NST_DICT_WALK_STOP;
         }
-    }
 
-    if(entry == NULL) {
-        core->dict.sync_idx++;
+        /*
+         * clients of old keep reading it, it is only freed once they are
+         * gone, and lock-free readers see the swap, see nst_dict_get_hit
+         */
+        __sync_synchronize();
+
+        entry->store.ring.data = copy;
+
+        nst_ring_data_invalidate(ring, old);
+
+        ring->compact.moved++;
     }
 
-    /* if we have checked the whole dict */
-    if(core->dict.sync_idx == core->dict.size) {
-        core->dict.sync_idx = 0;
+    if(get_current_timestamp() - walk->start >= 10) {
+        return NST_DICT_WALK_STOP;
     }
 
-    nst_shctx_unlock(&core->dict);
+    return NST_DICT_WALK_NEXT;
 }
 
+/*
+ * Move the valid data out of sparse memory blocks, see nst_memory_evacuate.
+ * A pass walks the whole dict by slices of 10ms, the blocks which are not
+ * empty by the next pass are put back in use.
+ * Only called by master housekeeping.
+ */
+void
+nst_ring_compact(nst_core_t *core) {
+    nst_ring_t                    *ring   = &core->store.ring;
+    nst_memory_t                  *memory = ring->memory;
+    struct nst_ring_compact_walk   walk;
+    uint64_t                       waste  = 0;
+    int                            i, ret;
+
+    walk.start  = get_current_timestamp();
+    walk.failed = 0;
+
+    if(!ring->compact.active) {
+
+        if(walk.start - ring->compact.time < NST_RING_COMPACT_INTERVAL) {
+            return;
+        }
+
+        ring->compact.time = walk.start;
+
+        if(memory->evac) {
+            nst_memory_evacuate_end(memory);
+        }
+
+        for(i = 0; i < memory->chunks; i++) {
+            waste += nst_memory_waste(memory, i);
+        }
+
+        if(!core->dict.used || waste < memory->size / NST_MEMORY_EVAC_WASTE) {
+            return;
+        }
+
+        if(!nst_memory_evacuate(memory, NST_RING_COMPACT_BLOCKS)) {
+            return;
+        }
+
+        ring->compact.active = 1;
+        ring->compact.idx    = 0;
+    }
+
+    while(1) {
+        nst_dict_lock(&core->dict, ring->compact.idx);
+
+        ret = nst_dict_walk(&core->dict, ring->compact.idx, _nst_ring_compact_entry, &walk);
+
+        nst_dict_unlock(&core->dict, ring->compact.idx);
+
+        if(ret == NST_OK) {
+            ring->compact.idx++;
+        }
+
+        if(walk.failed || !memory->evac
+                || ring->compact.idx >= nst_dict_walk_size(&core->dict)) {
+
+            ring->compact.active = 0;
+
+            return;
+        }
+
+        if(get_current_timestamp() - walk.start >= 10) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,254 @@
+/*
+ * nuster-dict-bench.c: insert and lookup cost of the nuster dict engines.
+ *
+ * Build with :
+ *   gcc -Iinclude -Iebtree -O2 -DUSE_THREAD -o nuster-dict-bench \
+ *       tests/nuster-dict-bench.c src/nuster/dict.c src/nuster/memory.c \
+ *       src/nuster/epoch.c ebtree/eb64tree.c ebtree/ebtree.c src/xxhash.c \
+ *       -lpthread
+ *
+ * Run with :
+ *   ./nuster-dict-bench [keys]
+ *
+ * The same keys are inserted in a chain and in a swiss dict of the same
+ * dict-size, then looked up in random order, all present and all absent,
+ * under the stripe lock as nst_cache_exists does. With the 1MB dict-size
+ * the swiss table has 65536 slots, the largest load is just below 3/4 of
+ * them, where the dict would grow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#include <types/global.h>
+
+#include <nuster/nuster.h>
+
+/* what the dict needs from the rest of haproxy */
+struct global        global;
+struct mworker_proc *proc_self;
+
+void
+hap_register_per_thread_deinit(void (*fct)()) {
+}
+
+int
+strlcpy2(char *dst, const char *src, int size) {
+    return snprintf(dst, size, "%s", src);
+}
+
+void
+nst_disk_update_expire(char *file, uint64_t expire) {
+}
+
+#define BENCH_MEMORY_SIZE   (1024ULL << 20)
+#define BENCH_BLOCK_SIZE    16384
+#define BENCH_DICT_SIZE     (1ULL << 20)
+
+static uint64_t  bench_seed = 88172645463325252ULL;
+
+static inline uint64_t
+bench_random() {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+
+    return bench_seed;
+}
+
+static inline uint64_t
+bench_ns() {
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * keys look like those of the default rule: method.scheme.host.uri
+ */
+static void
+bench_key(nst_key_t *key, char *data, uint64_t n, int miss) {
+    key->size  = sprintf(data, "GET.http.www.example.com./static/%s/%lu.js.",
+            miss ? "absent" : "present", (unsigned long)n) + 1;
+    key->data  = data;
+    key->hash  = XXH64(key->data, key->size, 0);
+    key->flags = 0;
+}
+
+static double
+bench_lookup(nst_dict_t *dict, char *keys, uint64_t n, uint64_t *order, int miss) {
+    nst_dict_entry_t  *entry;
+    nst_key_t          key;
+    uint64_t           i, start, found = 0;
+
+    start = bench_ns();
+
+    for(i = 0; i < n; i++) {
+        key.size  = strlen(keys + order[i] * 64) + 1;
+        key.data  = keys + order[i] * 64;
+        key.hash  = XXH64(key.data, key.size, 0);
+
+        nst_dict_lock(dict, key.hash);
+
+        entry = nst_dict_get(dict, &key);
+
+        nst_dict_unlock(dict, key.hash);
+
+        found += entry != NULL;
+    }
+
+    if(found != (miss ? 0 : n)) {
+        fprintf(stderr, "found %lu of %lu\n", (unsigned long)found, (unsigned long)n);
+
+        exit(1);
+    }
+
+    return (double)(bench_ns() - start) / n;
+}
+
+static int
+bench_engine(int engine, uint64_t n, char *hit, char *miss, uint64_t *order) {
+    nst_memory_t      *memory;
+    nst_epoch_t        epoch;
+    nst_store_t        store;
+    nst_dict_t         dict;
+    nst_dict_entry_t  *entry;
+    nst_http_txn_t     txn;
+    nst_rule_t         rule;
+    hpx_buffer_t       buf;
+    nst_key_t          key;
+    char               area[64] = "www.example.com/static/app.js";
+    uint64_t           i, start;
+    double             insert, lookup_hit, lookup_miss;
+
+    memory = nst_memory_create("bench", BENCH_MEMORY_SIZE, BENCH_BLOCK_SIZE, 0, 0, 0, NULL, 0);
+
+    if(!memory || nst_shctx_init(memory) != NST_OK) {
+        return -1;
+    }
+
+    nst_epoch_self = 1;
+
+    memset(&store, 0, sizeof(store));
+
+    if(nst_epoch_init(&epoch, memory, 1) != NST_OK
+            || nst_dict_init(&dict, &store, memory, BENCH_DICT_SIZE, engine, &epoch) != NST_OK) {
+
+        return -1;
+    }
+
+    memset(&txn, 0, sizeof(txn));
+    memset(&rule, 0, sizeof(rule));
+
+    buf.area = area;
+    buf.data = strlen(area);
+    buf.size = sizeof(area);
+    buf.head = 0;
+
+    txn.buf               = &buf;
+    txn.req.host          = ist2(area, 15);
+    txn.req.path          = ist2(area + 15, 14);
+    txn.res.etag          = ist2(area, 0);
+    txn.res.last_modified = ist2(area, 0);
+
+    start = bench_ns();
+
+    for(i = 0; i < n; i++) {
+        bench_key(&key, hit + i * 64, i, 0);
+
+        nst_dict_lock(&dict, key.hash);
+
+        entry = nst_dict_set(&dict, &key, &txn, &rule, 1);
+
+        if(entry) {
+            entry->state = NST_DICT_ENTRY_STATE_VALID;
+        }
+
+        nst_dict_unlock(&dict, key.hash);
+
+        if(!entry) {
+            return -1;
+        }
+    }
+
+    insert      = (double)(bench_ns() - start) / n;
+    lookup_hit  = bench_lookup(&dict, hit, n, order, 0);
+    lookup_miss = bench_lookup(&dict, miss, n, order, 1);
+
+    printf("%8s %10lu %10lu %12.1f %12.1f %12.1f\n",
+            engine == NST_DICT_ENGINE_SWISS ? "swiss" : "chain",
+            (unsigned long)n, (unsigned long)nst_dict_slots(&dict),
+            insert, lookup_hit, lookup_miss);
+
+    /* the memory is the start of the mapping */
+    munmap(memory, BENCH_MEMORY_SIZE);
+
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    static const uint64_t  loads[] = { 5000, 15000, 30000, 45000 };
+
+    uint64_t  max = argc > 1 ? strtoull(argv[1], NULL, 10) : 0;
+    uint64_t  n, i, j, t;
+    uint64_t *order;
+    char     *hit, *miss;
+    int       l;
+
+    global.nbproc   = 1;
+    global.nbthread = 1;
+
+    printf("%8s %10s %10s %12s %12s %12s\n", "engine", "keys", "slots",
+            "insert ns", "hit ns", "miss ns");
+
+    for(l = 0; l < (int)(sizeof(loads) / sizeof(loads[0])); l++) {
+        n = max ? max : loads[l];
+
+        hit   = malloc(n * 64);
+        miss  = malloc(n * 64);
+        order = malloc(n * sizeof(uint64_t));
+
+        if(!hit || !miss || !order) {
+            return 1;
+        }
+
+        for(i = 0; i < n; i++) {
+            nst_key_t  key;
+
+            bench_key(&key, miss + i * 64, i, 1);
+
+            order[i] = i;
+        }
+
+        for(i = n - 1; i > 0; i--) {
+            j        = bench_random() % (i + 1);
+            t        = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+
+        if(bench_engine(NST_DICT_ENGINE_CHAIN, n, hit, miss, order) != 0
+                || bench_engine(NST_DICT_ENGINE_SWISS, n, hit, miss, order) != 0) {
+
+            fprintf(stderr, "cannot create the dict\n");
+
+            return 1;
+        }
+
+        free(hit);
+        free(miss);
+        free(order);
+
+        if(max) {
+            break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * nuster-memory-bench.c: alloc/free latency of the nuster memory by size
+ * class, through the memory lock and through the per-thread magazines.
+ *
+ * Build with :
+ *   gcc -Iinclude -Iebtree -O2 -DUSE_THREAD -o nuster-memory-bench \
+ *       tests/nuster-memory-bench.c src/nuster/memory.c -lpthread
+ *
+ * Run with :
+ *   ./nuster-memory-bench [rounds]
+ *
+ * For each size a working set of live chunks is churned: a random chunk
+ * is freed and a new one allocated in its place. The memory holds many
+ * partially used blocks then, the case where finding a free chunk used to
+ * depend on the number of chunks per block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <types/global.h>
+
+#include <nuster/shctx.h>
+#include <nuster/memory.h>
+
+/* what memory.c needs from the rest of haproxy */
+struct global        global;
+struct mworker_proc *proc_self;
+
+void
+hap_register_per_thread_deinit(void (*fct)()) {
+}
+
+int
+strlcpy2(char *dst, const char *src, int size) {
+    return snprintf(dst, size, "%s", src);
+}
+
+#define BENCH_MEMORY_SIZE   (256ULL << 20)
+#define BENCH_BLOCK_SIZE    16384
+#define BENCH_LIVE_BYTES    (32ULL << 20)
+#define BENCH_LIVE_MAX      65536
+
+static uint64_t  bench_seed = 88172645463325252ULL;
+
+static inline uint64_t
+bench_random() {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+
+    return bench_seed;
+}
+
+static inline uint64_t
+bench_ns() {
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t
+bench_class(nst_memory_t *memory, uint32_t size) {
+    int  i;
+
+    for(i = 0; i < memory->chunks - 1 && memory->class[i].size < size; i++) { }
+
+    return memory->class[i].size;
+}
+
+static int
+bench_cmp(const void *a, const void *b) {
+    uint64_t  x = *(const uint64_t *)a;
+    uint64_t  y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * ns of one free and one alloc, mean and 99th percentile of batches of 256
+ */
+static int
+bench_size(nst_memory_t *memory, uint32_t size, int rounds, double *mean, double *p99) {
+    void      **live;
+    uint64_t   *batch;
+    uint64_t    n, i, j, start, total = 0;
+
+    n = BENCH_LIVE_BYTES / size;
+
+    if(n > BENCH_LIVE_MAX) {
+        n = BENCH_LIVE_MAX;
+    }
+
+    live  = calloc(n, sizeof(void *));
+    batch = calloc(rounds, sizeof(uint64_t));
+
+    if(!live || !batch) {
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        live[i] = nst_memory_alloc(memory, size);
+
+        if(!live[i]) {
+            return -1;
+        }
+    }
+
+    for(i = 0; i < (uint64_t)rounds; i++) {
+        start = bench_ns();
+
+        for(j = 0; j < 256; j++) {
+            uint64_t  k = bench_random() % n;
+
+            nst_memory_free(memory, live[k]);
+
+            live[k] = nst_memory_alloc(memory, size);
+
+            if(!live[k]) {
+                return -1;
+            }
+        }
+
+        batch[i]  = bench_ns() - start;
+        total    += batch[i];
+    }
+
+    for(i = 0; i < n; i++) {
+        nst_memory_free(memory, live[i]);
+    }
+
+    qsort(batch, rounds, sizeof(uint64_t), bench_cmp);
+
+    *mean = (double)total / rounds / 256;
+    *p99  = (double)batch[rounds * 99 / 100] / 256;
+
+    free(live);
+    free(batch);
+
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    static const uint32_t  sizes[] = {
+        16, 48, 100, 256, 400, 1000, 1500, 3000, 4096, 6000, 10000, 16384,
+    };
+
+    struct mworker_proc    worker;
+    nst_memory_t          *memory;
+    double                 mean[2], p99[2];
+    int                    rounds = argc > 1 ? atoi(argv[1]) : 4000;
+    int                    i, m;
+
+    global.nbproc   = 1;
+    global.nbthread = 1;
+
+    worker.options = PROC_O_TYPE_WORKER;
+
+    memory = nst_memory_create("bench", BENCH_MEMORY_SIZE, BENCH_BLOCK_SIZE, 0, 0, 0, NULL, 0);
+
+    if(!memory || nst_shctx_init(memory) != NST_OK) {
+        fprintf(stderr, "cannot create the memory\n");
+
+        return 1;
+    }
+
+    printf("%8s %8s %14s %14s %14s %14s\n", "size", "class", "locked ns", "locked p99",
+            "magazine ns", "magazine p99");
+
+    for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+
+        /* the magazines are only used by the workers */
+        for(m = 0; m < 2; m++) {
+            proc_self = m ? &worker : NULL;
+
+            if(bench_size(memory, sizes[i], rounds, &mean[m], &p99[m]) != 0) {
+                fprintf(stderr, "out of memory with size %u\n", sizes[i]);
+
+                return 1;
+            }
+        }
+
+        printf("%8u %8u %14.1f %14.1f %14.1f %14.1f\n", sizes[i],
+                bench_class(memory, sizes[i]),
+                mean[0], p99[0], mean[1], p99[1]);
+    }
+
+    return 0;
+}